@@ -1,13 +1,21 @@
 #pragma once
 
+#include "CountingTable.hpp"
+#include "IntersectionKernels.hpp"
+
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <future>
 #include <iterator>
+#include <limits>
+#include <memory>
 #include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
+#include <vector>
 
 using namespace std;
 
@@ -19,6 +27,16 @@ using Segment = std::pair<T, T>;
 template<typename T>
 using Segments = vector<Segment<T>>;
 
+/** Marks sets passed to Algorithms::intersection2() as sorted already. */
+struct SortedInput {};
+
+/** Unsigned type the integral T is radix sorted by, void if T is sorted by comparison. */
+template<typename T, typename = void>
+struct RadixKey { using type = void; };
+
+template<typename T>
+struct RadixKey<T, enable_if_t<is_integral<T>::value && !is_same<T, bool>::value>> { using type = make_unsigned_t<T>; };
+
 /** Several algorithms on sets and segments. */
 template<typename T>
 class Algorithms
@@ -28,23 +46,115 @@ public:
     /** Returns intersection between 2 sets taking into account repetitions. O(n) but with allocation. */
     vector<T> intersection(const vector<T>& v1, const vector<T>& v2);
 
-    /** Returns intersection between 2 sets taking into account repetitions. O(nlnn). */
-    vector<T> intersection2(vector<T>& v1, vector<T>& v2);
+    /** Returns intersection between 2 sets taking into account repetitions. O(nlnn), O(n) for integers.
+    * Sets are left untouched: unsorted ones are sorted to the buffers of the calling thread, integers by LSD radix sort.
+    * The object keeps no state, so the calls may be concurrent. Buffers up to MAX_KEPT_BYTES are kept for the next calls
+    * of the thread, bigger ones are freed before return.
+    * Sorted sets of 4 and 8 bytes integers are merged by the vectorized kernels, see IntersectionKernels.hpp.
+    */
+    vector<T> intersection2(const vector<T>& v1, const vector<T>& v2);
+
+    /** Returns intersection between 2 sorted sets taking into account repetitions, sets are not checked or sorted. */
+    vector<T> intersection2(const vector<T>& v1, const vector<T>& v2, SortedInput);
+
+    /** Frees the buffers intersection2() keeps in the calling thread, at most 3 * MAX_KEPT_BYTES. */
+    static void releaseBuffers();
+
+    /** Returns intersection between 2 sorted sets taking into account repetitions.
+    * O(m + n) for sets of comparable sizes, O(m log(n/m)) if set of m elements is much smaller than set of n elements.
+    */
+    vector<T> intersectionSorted(const vector<T>& v1, const vector<T>& v2);
+
+    /** Returns intersection between 2 sets taking into account repetitions using threads, all cores if 0. O(n/threads).
+    * Both sets are partitioned by hash, so repetitions of an element are in the partitions with the same index in both,
+    * then pairs of partitions are intersected by the idle threads. Order of the result differs from intersection().
+    */
+    vector<T> intersectionParallel(const vector<T>& v1, const vector<T>& v2, size_t threads = 0);
 
     /** Unites segments. */
     Segments<T> segmentsUnion(Segments<T>& segs);
 
 private:
+    /** Number of elements the result of the merge grows by before the kernel is called. */
+    static const size_t MERGE_CHUNK{ 4096 };
+
+    /** Bits of the key sorted by one pass of radix sort. */
+    static const unsigned RADIX_BITS{ 8 };
+
+    /** Bytes of every buffer of intersection2() kept by the thread for the next calls. */
+    static const size_t MAX_KEPT_BYTES{ 1 << 22 };
+
+    /** Sorted sets of intersection2() and the buffer of the radix sort between passes, one per thread. */
+    struct Scratch {
+        vector<T> sorted1;
+        vector<T> sorted2;
+        vector<T> buffer;
+
+        /** Frees the buffers bigger than MAX_KEPT_BYTES. */
+        void trim();
+    };
+
+    /** Scratch of the calling thread. */
+    static Scratch& scratch();
+
+    /** Returns v if it is sorted, otherwise sorts v to out by buffer and returns out. */
+    static const vector<T>& sorted(const vector<T>& v, vector<T>& out, vector<T>& buffer);
+
+    /** Sorts in to out by LSD radix sort of the unsigned key U, using buffer between the passes. O(n) */
+    template<typename U>
+    static void sortTo(const vector<T>& in, vector<T>& out, vector<T>& buffer, U*);
+
+    /** Sorts in to out by comparison for T without radix key. O(nlnn) */
+    static void sortTo(const vector<T>& in, vector<T>& out, vector<T>& buffer, void*);
+
+    /** Sets differing in size at least this many times are intersected by galloping instead of merge. */
+    static const size_t GALLOP_RATIO{ 32 };
+
+    /** Returns intersection of sorted small and big by exponential search of every distinct element of small in big. */
+    vector<T> gallopIntersection(const vector<T>& small, const vector<T>& big);
+
+    /** Returns intersection of sorted v1 and v2 by the kernel for the integer type K of the same size as T. */
+    template<typename K>
+    vector<T> mergeIntersection(const vector<T>& v1, const vector<T>& v2, K*);
+
+    /** Returns intersection of sorted v1 and v2 by the scalar merge for T without kernel. */
+    vector<T> mergeIntersection(const vector<T>& v1, const vector<T>& v2, void*);
+
+    /** Sets smaller than this are intersected by one thread. */
+    static const size_t PARALLEL_MIN_SIZE{ 1 << 16 };
+
+    /** Partitions per thread, so threads finished their partitions take the rest and keep busy. */
+    static const size_t PARTITIONS_PER_THREAD{ 8 };
+
+    /** Returns intersection of the ranges by the counting table of the smaller one, with 4 bytes counters if they suffice. */
+    vector<T> hashIntersection(const T* s1, const T* e1, const T* s2, const T* e2);
+
+    /** Returns intersection of big and small ranges by the counting table of small with counters of the type Counter. */
+    template<typename Counter>
+    vector<T> hashIntersection(const T* small, const T* smallEnd, const T* big, const T* bigEnd);
+
     /** Returns hash table where key is element and value is count of its repetition in vector range. O(n) */
     template<typename Counter>
-    unordered_map<T, Counter> buildHash(typename vector<T>::const_iterator s, typename vector<T>::const_iterator e);
+    CountingTable<T, Counter> buildHash(const T* s, const T* e);
+
+    /** Hash choosing the partition of the element. Mixed differently from CountingTable, which gets elements of one partition. */
+    static uint64_t partitionHash(const T& value);
+
+    /** Copies v to out grouped by partitions, offsets of partitions are written to offsets, parts + 1 of them.
+    * Every thread counts and then scatters its chunk of v to its own ranges of partitions.
+    */
+    static void partition(const vector<T>& v, size_t threads, unsigned bits, T* out, vector<size_t>& offsets);
+
+    /** Calls f(index) for every index of threads, in the calling thread for 0. Returns when all calls are done. */
+    template<typename F>
+    static void parallelFor(size_t threads, const F& f);
 
     /**
     * Finds repeated elements from vector range and hash table.
     * @todo Type checking for T to have overloaded operator == and < and for Counter to have ++, operator int() and --.
     */
     template<typename Counter>
-    vector<T> intersection(typename vector<T>::const_iterator s1, typename vector<T>::const_iterator e1, unordered_map<T, Counter>& hashTable, Counter& elementsCount);
+    vector<T> intersection(const T* s1, const T* e1, CountingTable<T, Counter>& hashTable, size_t& elementsCount);
 };
 
 template<typename T>
@@ -56,35 +166,270 @@ inline vector<T> Algorithms<T>::intersection(const vector<T>& v1, const vector<T
     // @note For enough small v1 and v2 simple O(n2) array traversal can be faster.
     // @todo For now do not do tests to see if such solution is more efficient for this case.
 
-    const vector<T>* big = v1.size() >= v2.size() ? &v1 : &v2;
-    const vector<T>* small = v1.size() < v2.size() ? &v1 : &v2;
+    return hashIntersection(v1.data(), v1.data() + v1.size(), v2.data(), v2.data() + v2.size());
+}
+
+template<typename T>
+inline vector<T> Algorithms<T>::hashIntersection(const T* s1, const T* e1, const T* s2, const T* e2)
+{
+    const bool first = e1 - s1 < e2 - s2;
+    const T* small = first ? s1 : s2;
+    const T* smallEnd = first ? e1 : e2;
+    const T* big = first ? s2 : s1;
+    const T* bigEnd = first ? e2 : e1;
+
+    // Repetitions are counted by 4 bytes counters unless the small set is too big for them.
+    if (static_cast<size_t>(smallEnd - small) < numeric_limits<uint32_t>::max())
+        return hashIntersection<uint32_t>(small, smallEnd, big, bigEnd);
+    return hashIntersection<size_t>(small, smallEnd, big, bigEnd);
+}
+
+template<typename T>
+template<typename Counter>
+inline vector<T> Algorithms<T>::hashIntersection(const T* small, const T* smallEnd, const T* big, const T* bigEnd)
+{
+    auto hashTable = buildHash<Counter>(small, smallEnd);
+    size_t count = smallEnd - small;
+    return intersection<Counter>(big, bigEnd, hashTable, count);
+}
+
+template<typename T>
+inline vector<T> Algorithms<T>::intersectionParallel(const vector<T>& v1, const vector<T>& v2, size_t threads)
+{
+    if (v1.empty() || v2.empty())
+        return {};
+    if (!threads)
+        threads = max<size_t>(1, thread::hardware_concurrency());
+    if (threads == 1 || v1.size() + v2.size() < PARALLEL_MIN_SIZE)
+        return intersection(v1, v2);
+
+    unsigned bits{ 0 };
+    while ((size_t(1) << bits) < threads * PARTITIONS_PER_THREAD)
+        bits++;
+    const size_t parts = size_t(1) << bits;
+
+    // Elements are copied, so the buffers are not initialized before.
+    unique_ptr<T[]> parts1(new T[v1.size()]);
+    unique_ptr<T[]> parts2(new T[v2.size()]);
+    vector<size_t> offsets1, offsets2;
+    partition(v1, threads, bits, parts1.get(), offsets1);
+    partition(v2, threads, bits, parts2.get(), offsets2);
+
+    vector<vector<T>> results(parts);
+    atomic<size_t> next{ 0 };
+    parallelFor(threads, [&](size_t) {
+        for (size_t part; (part = next.fetch_add(1, memory_order_relaxed)) < parts;) {
+            results[part] = hashIntersection(parts1.get() + offsets1[part], parts1.get() + offsets1[part + 1],
+                parts2.get() + offsets2[part], parts2.get() + offsets2[part + 1]);
+        }
+    });
+    parts1.reset();
+    parts2.reset();
 
-    auto hashTable = buildHash<size_t>(small->cbegin(), small->cend());
-    size_t count{ small->size() };
-    return intersection<size_t>(big->cbegin(), big->cend(), hashTable, count);
+    vector<size_t> positions(parts + 1);
+    for (size_t part = 0; part < parts; ++part)
+        positions[part + 1] = positions[part] + results[part].size();
+    vector<T> res(positions[parts]);
+    next = 0;
+    parallelFor(threads, [&](size_t) {
+        for (size_t part; (part = next.fetch_add(1, memory_order_relaxed)) < parts;) {
+            move(results[part].begin(), results[part].end(), res.begin() + positions[part]);
+            vector<T>().swap(results[part]);
+        }
+    });
+    return res;
 }
 
 template<typename T>
-inline vector<T> Algorithms<T>::intersection2(vector<T>& v1, vector<T>& v2)
+inline vector<T> Algorithms<T>::intersection2(const vector<T>& v1, const vector<T>& v2)
 {
     if (v1.empty() || v2.empty())
         return {};
 
-    sort(v1.begin(), v1.end());
-    sort(v2.begin(), v2.end());
+    auto& s = scratch();
+    auto res = intersectionSorted(sorted(v1, s.sorted1, s.buffer), sorted(v2, s.sorted2, s.buffer));
+    s.trim();
+    return res;
+}
+
+template<typename T>
+inline vector<T> Algorithms<T>::intersection2(const vector<T>& v1, const vector<T>& v2, SortedInput)
+{
+    return intersectionSorted(v1, v2);
+}
+
+template<typename T>
+inline void Algorithms<T>::releaseBuffers()
+{
+    auto& s = scratch();
+    vector<T>().swap(s.sorted1);
+    vector<T>().swap(s.sorted2);
+    vector<T>().swap(s.buffer);
+}
 
-    int i{}, j{};
+template<typename T>
+inline void Algorithms<T>::Scratch::trim()
+{
+    for (auto* v : { &sorted1, &sorted2, &buffer }) {
+        if (v->capacity() * sizeof(T) > MAX_KEPT_BYTES)
+            vector<T>().swap(*v);
+    }
+}
+
+template<typename T>
+inline typename Algorithms<T>::Scratch& Algorithms<T>::scratch()
+{
+    static thread_local Scratch s;
+    return s;
+}
+
+template<typename T>
+inline const vector<T>& Algorithms<T>::sorted(const vector<T>& v, vector<T>& out, vector<T>& buffer)
+{
+    // Check stops at the first unsorted pair, so it costs little if the set is not sorted.
+    if (is_sorted(v.begin(), v.end()))
+        return v;
+    sortTo(v, out, buffer, static_cast<typename RadixKey<T>::type*>(nullptr));
+    return out;
+}
+
+template<typename T>
+template<typename U>
+inline void Algorithms<T>::sortTo(const vector<T>& in, vector<T>& out, vector<T>& buffer, U*)
+{
+    const unsigned DIGITS = sizeof(U) * 8 / RADIX_BITS;
+    const size_t BUCKETS = size_t(1) << RADIX_BITS;
+    // Signed keys are sorted as unsigned with the sign bit flipped, so negative ones go first.
+    const U sign = is_signed<T>::value ? static_cast<U>(U(1) << (sizeof(U) * 8 - 1)) : U(0);
+    auto digit = [sign](const T& value, unsigned d) {
+        return static_cast<size_t>((static_cast<U>(static_cast<U>(value) ^ sign) >> (d * RADIX_BITS)) & (BUCKETS - 1));
+    };
+
+    // Counts of all the digits are taken by one read of the set.
+    const auto size = in.size();
+    vector<size_t> counts(DIGITS * BUCKETS);
+    for (const auto& value : in) {
+        for (unsigned d = 0; d < DIGITS; ++d)
+            counts[d * BUCKETS + digit(value, d)]++;
+    }
+
+    // Digits equal in all the elements do not change the order, their passes are skipped.
+    vector<unsigned> passes;
+    for (unsigned d = 0; d < DIGITS; ++d) {
+        if (*max_element(counts.begin() + d * BUCKETS, counts.begin() + (d + 1) * BUCKETS) != size)
+            passes.push_back(d);
+    }
+    out.resize(size);
+    if (passes.empty()) {
+        copy(in.begin(), in.end(), out.begin());
+        return;
+    }
+
+    // Passes alternate between out and buffer, so the last one writes to out.
+    if (passes.size() > 1)
+        buffer.resize(max(buffer.size(), size));
+    const T* src = in.data();
+    T* dst = passes.size() % 2 ? out.data() : buffer.data();
+    for (const auto d : passes) {
+        auto* offsets = counts.data() + d * BUCKETS;
+        size_t offset{ 0 };
+        for (size_t b = 0; b < BUCKETS; ++b) {
+            const auto count = offsets[b];
+            offsets[b] = offset;
+            offset += count;
+        }
+        for (size_t i = 0; i < size; ++i)
+            dst[offsets[digit(src[i], d)]++] = src[i];
+        src = dst;
+        dst = dst == out.data() ? buffer.data() : out.data();
+    }
+}
+
+template<typename T>
+inline void Algorithms<T>::sortTo(const vector<T>& in, vector<T>& out, vector<T>&, void*)
+{
+    out.assign(in.begin(), in.end());
+    sort(out.begin(), out.end());
+}
+
+template<typename T>
+inline vector<T> Algorithms<T>::intersectionSorted(const vector<T>& v1, const vector<T>& v2)
+{
+    if (v1.empty() || v2.empty())
+        return {};
+
+    const vector<T>& big = v1.size() >= v2.size() ? v1 : v2;
+    const vector<T>& small = v1.size() < v2.size() ? v1 : v2;
+    if (big.size() / small.size() >= GALLOP_RATIO)
+        return gallopIntersection(small, big);
+    return mergeIntersection(v1, v2, static_cast<typename IntersectionKernels::KernelType<T>::type*>(nullptr));
+}
+
+template<typename T>
+inline vector<T> Algorithms<T>::gallopIntersection(const vector<T>& small, const vector<T>& big)
+{
     vector<T> res;
-    res.reserve(v1.size() / 10); // @todo find better allocation strategy.
+    const auto size = big.size();
+    size_t pos{ 0 };
+    for (size_t i = 0; i < small.size() && pos < size;) {
+        const T& value = small[i];
+        size_t count{ 1 };
+        while (i + count < small.size() && small[i + count] == value)
+            count++;
+        i += count;
+
+        // Steps double until the element not less than value is passed, then it is searched within the last step.
+        if (big[pos] < value) {
+            size_t last{ pos }, step{ 1 };
+            while (pos + step < size && big[pos + step] < value) {
+                last = pos + step;
+                step <<= 1;
+            }
+            pos = lower_bound(big.begin() + last + 1, big.begin() + min(pos + step, size), value) - big.begin();
+        }
+
+        // Repetitions of value are paired while both sets have them.
+        for (; count && pos < size && big[pos] == value; --count, ++pos)
+            res.push_back(value);
+    }
+    return res;
+}
+
+template<typename T>
+template<typename K>
+inline vector<T> Algorithms<T>::mergeIntersection(const vector<T>& v1, const vector<T>& v2, K*)
+{
+    static_assert(sizeof(K) == sizeof(T), "Kernel must have elements of the same size");
+    const auto a = reinterpret_cast<const K*>(v1.data());
+    const auto b = reinterpret_cast<const K*>(v2.data());
+    const auto size1 = v1.size();
+    const auto size2 = v2.size();
+    size_t i{}, j{};
+    vector<T> res;
+    // The kernel writes whole blocks, so it is given room for several blocks and the result is trimmed after it.
+    while (i < size1 && j < size2) {
+        const auto size = res.size();
+        res.resize(size + MERGE_CHUNK);
+        res.resize(IntersectionKernels::intersect(a, i, size1, b, j, size2, reinterpret_cast<K*>(res.data()), size, res.size()));
+    }
+    return res;
+}
+
+template<typename T>
+inline vector<T> Algorithms<T>::mergeIntersection(const vector<T>& v1, const vector<T>& v2, void*)
+{
+    size_t i{}, j{};
+    vector<T> res;
+    res.reserve(min(v1.size(), v2.size()) / 10); // @todo find better allocation strategy.
     const auto size1 = v1.size();
     const auto size2 = v2.size();
-    while(i < size1 && j < size2) {
-        if (v1.at(i) == v2.at(j)) {
-            res.push_back(v1.at(i));
+    while (i < size1 && j < size2) {
+        if (v1[i] == v2[j]) {
+            res.push_back(v1[i]);
             i++;
             j++;
         }
-        else if (v1.at(i) < v2.at(j)) {
+        else if (v1[i] < v2[j]) {
             i++;
         }
         else {
@@ -131,29 +476,24 @@ inline Segments<T> Algorithms<T>::segmentsUnion(Segments<T>& segs)
 
 template<typename T>
 template<typename Counter>
-inline unordered_map<T, Counter> Algorithms<T>::buildHash(typename vector<T>::const_iterator s, typename vector<T>::const_iterator e)
-{
-    unordered_map<T, Counter> res;
-    for (auto it = s; it < e; ++it) {
-        if (res.find(*it) == res.cend())
-            res.insert(make_pair(*it, 1));
-        else
-            res[*it]++;
-    }
+inline CountingTable<T, Counter> Algorithms<T>::buildHash(const T* s, const T* e)
+{
+    CountingTable<T, Counter> res(e - s);
+    for (auto it = s; it < e; ++it)
+        res.add(*it);
     return res;
 }
 
 template<typename T>
 template<typename Counter>
-inline vector<T> Algorithms<T>::intersection(typename vector<T>::const_iterator s1, typename vector<T>::const_iterator e1, unordered_map<T, Counter>& hashTable, Counter& elementsCount)
+inline vector<T> Algorithms<T>::intersection(const T* s1, const T* e1, CountingTable<T, Counter>& hashTable, size_t& elementsCount)
 {
     vector<T> res;
-    res.reserve(e1 - s1);
+    res.reserve(min<size_t>(e1 - s1, elementsCount));
     for (auto it = s1; it < e1; ++it) {
-        if (hashTable.find(*it) != hashTable.cend() && hashTable[*it])
+        if (hashTable.take(*it))
         {
             res.push_back(*it);
-            hashTable[*it]--;
             elementsCount--;
             if (!elementsCount)
                 return res;
@@ -163,4 +503,67 @@ inline vector<T> Algorithms<T>::intersection(typename vector<T>::const_iterator
     return res;
 }
 
+template<typename T>
+inline uint64_t Algorithms<T>::partitionHash(const T& value)
+{
+    // Finalizer of MurmurHash3: every bit of the hash affects the high bits, which choose the partition.
+    uint64_t h = static_cast<uint64_t>(hash<T>()(value));
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+template<typename T>
+inline void Algorithms<T>::partition(const vector<T>& v, size_t threads, unsigned bits, T* out, vector<size_t>& offsets)
+{
+    const size_t parts = size_t(1) << bits;
+    const size_t chunk = (v.size() + threads - 1) / threads;
+    auto part = [bits](const T& value) { return static_cast<size_t>(partitionHash(value) >> (64 - bits)); };
+
+    // Counts of the partitions in the chunk of every thread.
+    vector<size_t> counts(threads * parts);
+    parallelFor(threads, [&](size_t t) {
+        auto* count = counts.data() + t * parts;
+        const auto end = min(v.size(), (t + 1) * chunk);
+        for (size_t i = t * chunk; i < end; ++i)
+            count[part(v[i])]++;
+    });
+
+    // Partitions are consecutive, within them chunks of the threads are in order of the threads.
+    offsets.assign(parts + 1, 0);
+    size_t position{ 0 };
+    for (size_t p = 0; p < parts; ++p) {
+        offsets[p] = position;
+        for (size_t t = 0; t < threads; ++t) {
+            const auto count = counts[t * parts + p];
+            counts[t * parts + p] = position;
+            position += count;
+        }
+    }
+    offsets[parts] = position;
+
+    parallelFor(threads, [&](size_t t) {
+        auto* position = counts.data() + t * parts;
+        const auto end = min(v.size(), (t + 1) * chunk);
+        for (size_t i = t * chunk; i < end; ++i)
+            out[position[part(v[i])]++] = v[i];
+    });
+}
+
+template<typename T>
+template<typename F>
+inline void Algorithms<T>::parallelFor(size_t threads, const F& f)
+{
+    vector<future<void>> rest;
+    rest.reserve(threads - 1);
+    for (size_t t = 1; t < threads; ++t)
+        rest.push_back(async(launch::async, [&f, t]() { f(t); }));
+    f(0);
+    for (auto& r : rest)
+        r.get();
+}
+
 }
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+namespace Windscribe {
+
+/**
+* Flat hash table counting repetitions of the keys, open addressing with linear probing.
+* Keys and counts are kept in separate arrays (SoA), so the table has no nodes and no per-element allocations.
+* Count of the slot is the number of repetitions plus one, zero marks the empty slot, so taken keys stay in place.
+*/
+template<typename T, typename Counter = size_t, typename Hash = hash<T>>
+class CountingTable
+{
+public:
+    /** Creates table for expected number of keys, repetitions included.
+    * Table is sized for them, up to MAX_INITIAL_SLOTS slots, and grows if there are more distinct keys.
+    */
+    explicit CountingTable(size_t expected = 0)
+    {
+        size_t capacity{ MIN_SLOTS };
+        while (capacity < expected * 2 && capacity < MAX_INITIAL_SLOTS)
+            capacity <<= 1;
+        resize(capacity);
+    }
+
+    /** Adds one repetition of the key. */
+    void add(const T& key)
+    {
+        auto pos = slot(key);
+        if (!counts_[pos]) {
+            if ((size_ + 1) * 4 > counts_.size() * 3) {
+                resize(counts_.size() * 2);
+                pos = slot(key);
+            }
+            keys_[pos] = key;
+            counts_[pos] = 1;
+            size_++;
+        }
+        counts_[pos]++;
+    }
+
+    /** Removes one repetition of the key. Returns false if the key has no repetitions left. */
+    bool take(const T& key)
+    {
+        const auto pos = slot(key);
+        if (counts_[pos] <= 1)
+            return false;
+        counts_[pos]--;
+        return true;
+    }
+
+    /** Number of repetitions of the key left. */
+    Counter count(const T& key) const
+    {
+        const auto pos = slot(key);
+        return counts_[pos] ? counts_[pos] - 1 : 0;
+    }
+
+    /** Number of distinct keys. */
+    size_t size() const { return size_; }
+
+    /** Number of slots. */
+    size_t capacity() const { return counts_.size(); }
+
+private:
+    static const size_t MIN_SLOTS{ 16 };
+    static const size_t MAX_INITIAL_SLOTS{ 1 << 22 };
+
+    /** Slot of the key or the empty slot the key would be put to. */
+    size_t slot(const T& key) const
+    {
+        // Hash is mixed by Fibonacci hashing, so identity hashes of patterned integers do not collide in the low bits.
+        auto pos = static_cast<size_t>((static_cast<uint64_t>(Hash()(key)) * 0x9E3779B97F4A7C15ULL) >> shift_);
+        while (counts_[pos] && !(keys_[pos] == key))
+            pos = (pos + 1) & mask_;
+        return pos;
+    }
+
+    /** Rehashes the keys to capacity slots. Capacity is a power of 2. */
+    void resize(size_t capacity)
+    {
+        vector<T> keys(capacity);
+        vector<Counter> counts(capacity);
+        keys.swap(keys_);
+        counts.swap(counts_);
+        mask_ = capacity - 1;
+        shift_ = 64;
+        for (size_t c = capacity; c > 1; c >>= 1)
+            shift_--;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            if (counts[i]) {
+                const auto pos = slot(keys[i]);
+                keys_[pos] = move(keys[i]);
+                counts_[pos] = counts[i];
+            }
+        }
+    }
+
+    vector<T> keys_;
+    vector<Counter> counts_;
+    size_t mask_{ 0 };
+    unsigned shift_{ 64 };
+    size_t size_{ 0 };
+};
+
+}
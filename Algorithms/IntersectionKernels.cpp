@@ -0,0 +1,256 @@
+#include "IntersectionKernels.hpp"
+
+#include <limits>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define INTERSECTION_KERNELS_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang compile the vectorized kernels for their instruction set without flags for the whole file.
+// MSVC accepts the intrinsics of any instruction set anyway.
+#if defined(__GNUC__) || defined(__clang__)
+#define INTERSECTION_KERNELS_TARGET(isa) __attribute__((target(isa)))
+#else
+#define INTERSECTION_KERNELS_TARGET(isa)
+#endif
+
+using namespace Windscribe;
+using namespace Windscribe::IntersectionKernels;
+
+namespace {
+
+/** Index of the lowest set bit. Mask must not be zero. */
+unsigned trailingZeros(unsigned mask)
+{
+#ifdef _MSC_VER
+    unsigned long res;
+    _BitScanForward(&res, mask);
+    return static_cast<unsigned>(res);
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+/** Merge of the rest of the arrays which are shorter than the block or the whole arrays without vector instructions. */
+template<typename K>
+size_t scalarIntersect(const K* a, size_t& i, size_t na, const K* b, size_t& j, size_t nb, K* out, size_t n, size_t capacity)
+{
+    while (i < na && j < nb && n < capacity) {
+        const K x = a[i];
+        const K y = b[j];
+        if (x == y) {
+            out[n++] = x;
+            i++;
+            j++;
+        }
+        else if (x < y)
+            i++;
+        else
+            j++;
+    }
+    return n;
+}
+
+#ifdef INTERSECTION_KERNELS_X86
+
+/*
+* Every step of the vectorized kernels compares blocks of W elements at i and j without branches:
+* - elements of a block less than the first element of the other block have no pair, they are skipped at once;
+* - otherwise the first elements are equal, and the lanes equal up to the first difference are exactly the pairs
+*   the scalar merge would output, so repetitions are kept as they are. The block is stored whole, count of it is kept.
+* Unsigned elements are compared as signed after their sign bits are flipped by bias.
+*/
+
+INTERSECTION_KERNELS_TARGET("sse4.2")
+size_t intersectSse42(const int32_t* a, size_t& i, size_t na, const int32_t* b, size_t& j, size_t nb, int32_t* out, size_t n, size_t capacity, int32_t bias)
+{
+    const size_t W{ 4 };
+    const __m128i flip = _mm_set1_epi32(bias);
+    while (i + W <= na && j + W <= nb && n + W <= capacity) {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+        // Lanes less than the first element of the other block are the low ones, so they are counted as trailing zeros.
+        const unsigned lessA = trailingZeros(~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_set1_epi32(b[j] ^ bias), _mm_xor_si128(va, flip)))) | (1u << W));
+        const unsigned lessB = trailingZeros(~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_set1_epi32(a[i] ^ bias), _mm_xor_si128(vb, flip)))) | (1u << W));
+        const unsigned equal = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(va, vb)));
+        const unsigned count = lessA | lessB ? 0 : trailingZeros(~equal | (1u << W));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + n), va);
+        n += count;
+        i += lessA + count;
+        j += lessB + count;
+    }
+    return n;
+}
+
+INTERSECTION_KERNELS_TARGET("sse4.2")
+size_t intersectSse42(const int64_t* a, size_t& i, size_t na, const int64_t* b, size_t& j, size_t nb, int64_t* out, size_t n, size_t capacity, int64_t bias)
+{
+    const size_t W{ 2 };
+    const __m128i flip = _mm_set1_epi64x(bias);
+    while (i + W <= na && j + W <= nb && n + W <= capacity) {
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+        // Lanes less than the first element of the other block are the low ones, so they are counted as trailing zeros.
+        const unsigned lessA = trailingZeros(~_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(_mm_set1_epi64x(b[j] ^ bias), _mm_xor_si128(va, flip)))) | (1u << W));
+        const unsigned lessB = trailingZeros(~_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(_mm_set1_epi64x(a[i] ^ bias), _mm_xor_si128(vb, flip)))) | (1u << W));
+        const unsigned equal = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(va, vb)));
+        const unsigned count = lessA | lessB ? 0 : trailingZeros(~equal | (1u << W));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + n), va);
+        n += count;
+        i += lessA + count;
+        j += lessB + count;
+    }
+    return n;
+}
+
+INTERSECTION_KERNELS_TARGET("avx2")
+size_t intersectAvx2(const int32_t* a, size_t& i, size_t na, const int32_t* b, size_t& j, size_t nb, int32_t* out, size_t n, size_t capacity, int32_t bias)
+{
+    const size_t W{ 8 };
+    const __m256i flip = _mm256_set1_epi32(bias);
+    while (i + W <= na && j + W <= nb && n + W <= capacity) {
+        const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + j));
+        // Lanes less than the first element of the other block are the low ones, so they are counted as trailing zeros.
+        const unsigned lessA = trailingZeros(~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(b[j] ^ bias), _mm256_xor_si256(va, flip)))) | (1u << W));
+        const unsigned lessB = trailingZeros(~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(a[i] ^ bias), _mm256_xor_si256(vb, flip)))) | (1u << W));
+        const unsigned equal = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(va, vb)));
+        const unsigned count = lessA | lessB ? 0 : trailingZeros(~equal | (1u << W));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + n), va);
+        n += count;
+        i += lessA + count;
+        j += lessB + count;
+    }
+    return n;
+}
+
+INTERSECTION_KERNELS_TARGET("avx2")
+size_t intersectAvx2(const int64_t* a, size_t& i, size_t na, const int64_t* b, size_t& j, size_t nb, int64_t* out, size_t n, size_t capacity, int64_t bias)
+{
+    const size_t W{ 4 };
+    const __m256i flip = _mm256_set1_epi64x(bias);
+    while (i + W <= na && j + W <= nb && n + W <= capacity) {
+        const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + j));
+        // Lanes less than the first element of the other block are the low ones, so they are counted as trailing zeros.
+        const unsigned lessA = trailingZeros(~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_set1_epi64x(b[j] ^ bias), _mm256_xor_si256(va, flip)))) | (1u << W));
+        const unsigned lessB = trailingZeros(~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_set1_epi64x(a[i] ^ bias), _mm256_xor_si256(vb, flip)))) | (1u << W));
+        const unsigned equal = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(va, vb)));
+        const unsigned count = lessA | lessB ? 0 : trailingZeros(~equal | (1u << W));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + n), va);
+        n += count;
+        i += lessA + count;
+        j += lessB + count;
+    }
+    return n;
+}
+
+#endif
+
+/** Best instruction set supported by the CPU. */
+ISA supported()
+{
+#ifdef INTERSECTION_KERNELS_X86
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return ISA::AVX2;
+    if (__builtin_cpu_supports("sse4.2"))
+        return ISA::SSE42;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+    __cpuid(info, 1);
+    const bool sse42 = (info[2] & (1 << 20)) != 0;
+    // AVX registers must be enabled by the OS too.
+    const bool avx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+    if (avx && maxLeaf >= 7) {
+        __cpuidex(info, 7, 0);
+        if (info[1] & (1 << 5))
+            return ISA::AVX2;
+    }
+    if (sse42)
+        return ISA::SSE42;
+#endif
+#endif
+    return ISA::SCALAR;
+}
+
+ISA& selected()
+{
+    static ISA res = supported();
+    return res;
+}
+
+/** Runs the kernel of the selected instruction set and finishes the rest of the arrays by the scalar merge.
+* K is the signed type of the elements, E the type of the arrays, which differs from K for unsigned elements.
+*/
+template<typename K, typename E>
+size_t dispatch(const E* a, size_t& i, size_t na, const E* b, size_t& j, size_t nb, E* out, size_t n, size_t capacity)
+{
+#ifdef INTERSECTION_KERNELS_X86
+    const K bias = is_signed<E>::value ? 0 : numeric_limits<K>::min();
+    const auto sa = reinterpret_cast<const K*>(a);
+    const auto sb = reinterpret_cast<const K*>(b);
+    const auto sout = reinterpret_cast<K*>(out);
+    switch (selected()) {
+    case ISA::AVX2:
+        n = intersectAvx2(sa, i, na, sb, j, nb, sout, n, capacity, bias);
+        break;
+    case ISA::SSE42:
+        n = intersectSse42(sa, i, na, sb, j, nb, sout, n, capacity, bias);
+        break;
+    default:
+        break;
+    }
+#endif
+    return scalarIntersect(a, i, na, b, j, nb, out, n, capacity);
+}
+
+}
+
+ISA IntersectionKernels::isa()
+{
+    return selected();
+}
+
+ISA IntersectionKernels::setIsa(ISA isa)
+{
+    const auto best = supported();
+    selected() = static_cast<int>(isa) <= static_cast<int>(best) ? isa : best;
+    return selected();
+}
+
+const char* IntersectionKernels::toString(ISA isa)
+{
+    switch (isa) {
+    case ISA::AVX2:     return "avx2";
+    case ISA::SSE42:    return "sse4.2";
+    default:            return "scalar";
+    }
+}
+
+size_t IntersectionKernels::intersect(const int32_t* a, size_t& i, size_t na, const int32_t* b, size_t& j, size_t nb, int32_t* out, size_t n, size_t capacity)
+{
+    return dispatch<int32_t>(a, i, na, b, j, nb, out, n, capacity);
+}
+
+size_t IntersectionKernels::intersect(const uint32_t* a, size_t& i, size_t na, const uint32_t* b, size_t& j, size_t nb, uint32_t* out, size_t n, size_t capacity)
+{
+    return dispatch<int32_t>(a, i, na, b, j, nb, out, n, capacity);
+}
+
+size_t IntersectionKernels::intersect(const int64_t* a, size_t& i, size_t na, const int64_t* b, size_t& j, size_t nb, int64_t* out, size_t n, size_t capacity)
+{
+    return dispatch<int64_t>(a, i, na, b, j, nb, out, n, capacity);
+}
+
+size_t IntersectionKernels::intersect(const uint64_t* a, size_t& i, size_t na, const uint64_t* b, size_t& j, size_t nb, uint64_t* out, size_t n, size_t capacity)
+{
+    return dispatch<int64_t>(a, i, na, b, j, nb, out, n, capacity);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+using namespace std;
+
+namespace Windscribe {
+
+/**
+* Merge intersection of sorted arrays of integers taking into account repetitions.
+* Blocks of both arrays are compared by SSE4.2 or AVX2 instructions chosen by the CPU at run time, other CPUs use the scalar merge.
+*/
+namespace IntersectionKernels {
+
+/** Instruction set of the kernels. */
+enum class ISA {
+    SCALAR,
+    SSE42,
+    AVX2
+};
+
+/** Instruction set used by the kernels, the best one supported by the CPU unless setIsa() was called. */
+ISA isa();
+
+/** Uses isa if the CPU supports it or the best supported one below it. Returns the instruction set used. Not thread-safe. */
+ISA setIsa(ISA isa);
+
+const char* toString(ISA isa);
+
+/** Merges sorted a and b from positions i and j and writes every pair of equal elements to out from position n.
+* Stops when one of the arrays ends or out has capacity elements. Positions are advanced past the merged elements.
+* @return New number of elements in out.
+*/
+size_t intersect(const int32_t* a, size_t& i, size_t na, const int32_t* b, size_t& j, size_t nb, int32_t* out, size_t n, size_t capacity);
+size_t intersect(const uint32_t* a, size_t& i, size_t na, const uint32_t* b, size_t& j, size_t nb, uint32_t* out, size_t n, size_t capacity);
+size_t intersect(const int64_t* a, size_t& i, size_t na, const int64_t* b, size_t& j, size_t nb, int64_t* out, size_t n, size_t capacity);
+size_t intersect(const uint64_t* a, size_t& i, size_t na, const uint64_t* b, size_t& j, size_t nb, uint64_t* out, size_t n, size_t capacity);
+
+/** Integer type of the kernel for T of the same size and signedness, void if there is no kernel for T. */
+template<typename T, typename = void>
+struct KernelType { using type = void; };
+
+template<typename T>
+struct KernelType<T, enable_if_t<is_integral<T>::value && !is_same<T, bool>::value && sizeof(T) == 4>> {
+    using type = conditional_t<is_signed<T>::value, int32_t, uint32_t>;
+};
+
+template<typename T>
+struct KernelType<T, enable_if_t<is_integral<T>::value && !is_same<T, bool>::value && sizeof(T) == 8>> {
+    using type = conditional_t<is_signed<T>::value, int64_t, uint64_t>;
+};
+
+}
+
+}
@@ -0,0 +1,370 @@
+#include "DnsEngine.hpp"
+#include "DnsMessage.hpp"
+#include "DnsResolver.hpp"
+#include "DnsStubServer.hpp"
+#include "LatencyHistogram.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace Windscribe;
+
+/**
+* Load generator of DnsResolver against the in-process stub servers.
+*
+* Open loop sends lookups at the target rate whatever the resolver does, and measures latency from the time the lookup
+* was due, so stalls of the resolver show up in the tail instead of lowering the rate (no coordinated omission).
+* Closed loop keeps the given number of lookups in flight, each worker sends the next lookup when the previous is done.
+* Runs with the same options and seed send the same hosts and get the same delays and losses of the stub servers.
+*/
+
+namespace {
+
+using Clock = chrono::steady_clock;
+
+struct Config {
+    bool openLoop{ false };
+
+    /** Target rate of the open loop, lookups per second. */
+    double qps{ 10000 };
+
+    /** Threads sending lookups in the open loop. */
+    int threads{ 1 };
+
+    /** Lookups in flight in the closed loop. */
+    int concurrency{ 64 };
+
+    /** Poisson arrivals in the open loop, otherwise lookups are evenly spaced. */
+    bool poisson{ true };
+
+    chrono::milliseconds duration{ 5000 };
+
+    /** Lookups of the warmup are not measured. */
+    chrono::milliseconds warmup{ 1000 };
+
+    /** Number of distinct hosts. */
+    size_t hosts{ 1000 };
+
+    /** Number of stub servers every lookup is sent to. */
+    int servers{ 1 };
+
+    /** Answer delay of the stub servers: base plus exponential tail with the given mean. */
+    chrono::microseconds delay{ 0 };
+    chrono::microseconds tail{ 0 };
+
+    /** Share of the queries dropped by the stub servers. */
+    double loss{ 0 };
+
+    uint32_t seed{ 1 };
+    bool cache{ false };
+
+    /** TTL of the answers of the stub servers in seconds. */
+    uint32_t ttl{ 300 };
+
+    /** Percent of TTL left when the hot cached answer is refreshed and seconds the stale answer is served. */
+    uint32_t prefetch{ 10 };
+    uint32_t stale{ 0 };
+    DnsResolver::MODE mode{ DnsResolver::MODE::FIRST_ANSWER };
+    DnsResolver::QUERY_TYPES types{ DnsResolver::QUERY_TYPES::A };
+    chrono::milliseconds timeout{ 5000 };
+    chrono::milliseconds retransmit{ 400 };
+
+    /** Print metrics of the resolver after the run. */
+    bool metrics{ false };
+};
+
+void usage()
+{
+    cout << "Usage: DnsBenchmark [options]\n"
+        "  --open | --closed          open loop at --qps or closed loop with --concurrency (default closed)\n"
+        "  --qps N                    target lookups per second of the open loop (10000)\n"
+        "  --threads N                sending threads of the open loop (1)\n"
+        "  --uniform                  evenly spaced lookups of the open loop instead of Poisson arrivals\n"
+        "  --concurrency N            lookups in flight of the closed loop (64)\n"
+        "  --duration MS              measured time (5000)\n"
+        "  --warmup MS                time before measurement (1000)\n"
+        "  --hosts N                  distinct hosts (1000)\n"
+        "  --servers N                stub servers queried by every lookup (1)\n"
+        "  --delay US                 base answer delay of the stub servers (0)\n"
+        "  --tail US                  mean of the exponential part of the answer delay (0)\n"
+        "  --loss RATE                share of the queries dropped by the stub servers (0)\n"
+        "  --seed N                   seed of hosts, delays and losses (1)\n"
+        "  --cache                    enable the cache of the resolver\n"
+        "  --ttl S                    TTL of the answers of the stub servers (300)\n"
+        "  --prefetch PCT             percent of TTL left when the hot cached answer is refreshed, 0 - never (10)\n"
+        "  --stale S                  seconds the expired cached answer is served while refreshed (0)\n"
+        "  --mode all|first|staggered when lookups are finished (first)\n"
+        "  --types a|aaaa|both        records queried (a)\n"
+        "  --timeout MS               lookup timeout (5000)\n"
+        "  --retransmit MS            first UDP retransmission timeout (400)\n"
+        "  --metrics                  print metrics of the resolver\n";
+}
+
+bool parse(int argc, char** argv, Config& config)
+{
+    for (int i = 1; i < argc; ++i) {
+        const string arg = argv[i];
+        auto value = [&]() -> const char* { return i + 1 < argc ? argv[++i] : nullptr; };
+        const char* v{ nullptr };
+        if (arg == "--open")
+            config.openLoop = true;
+        else if (arg == "--closed")
+            config.openLoop = false;
+        else if (arg == "--uniform")
+            config.poisson = false;
+        else if (arg == "--cache")
+            config.cache = true;
+        else if (arg == "--metrics")
+            config.metrics = true;
+        else if (!(v = value()))
+            return false;
+        else if (arg == "--qps")
+            config.qps = atof(v);
+        else if (arg == "--threads")
+            config.threads = max(1, atoi(v));
+        else if (arg == "--concurrency")
+            config.concurrency = max(1, atoi(v));
+        else if (arg == "--duration")
+            config.duration = chrono::milliseconds(atoll(v));
+        else if (arg == "--warmup")
+            config.warmup = chrono::milliseconds(atoll(v));
+        else if (arg == "--hosts")
+            config.hosts = max<size_t>(1, strtoull(v, nullptr, 10));
+        else if (arg == "--servers")
+            config.servers = max(1, atoi(v));
+        else if (arg == "--delay")
+            config.delay = chrono::microseconds(atoll(v));
+        else if (arg == "--tail")
+            config.tail = chrono::microseconds(atoll(v));
+        else if (arg == "--loss")
+            config.loss = atof(v);
+        else if (arg == "--seed")
+            config.seed = static_cast<uint32_t>(strtoul(v, nullptr, 10));
+        else if (arg == "--ttl")
+            config.ttl = static_cast<uint32_t>(strtoul(v, nullptr, 10));
+        else if (arg == "--prefetch")
+            config.prefetch = static_cast<uint32_t>(strtoul(v, nullptr, 10));
+        else if (arg == "--stale")
+            config.stale = static_cast<uint32_t>(strtoul(v, nullptr, 10));
+        else if (arg == "--timeout")
+            config.timeout = chrono::milliseconds(atoll(v));
+        else if (arg == "--retransmit")
+            config.retransmit = chrono::milliseconds(atoll(v));
+        else if (arg == "--mode") {
+            const string mode = v;
+            if (mode == "all")
+                config.mode = DnsResolver::MODE::ALL;
+            else if (mode == "first")
+                config.mode = DnsResolver::MODE::FIRST_ANSWER;
+            else if (mode == "staggered")
+                config.mode = DnsResolver::MODE::STAGGERED;
+            else
+                return false;
+        }
+        else if (arg == "--types") {
+            const string types = v;
+            if (types == "a")
+                config.types = DnsResolver::QUERY_TYPES::A;
+            else if (types == "aaaa")
+                config.types = DnsResolver::QUERY_TYPES::AAAA;
+            else if (types == "both")
+                config.types = DnsResolver::QUERY_TYPES::A_AND_AAAA;
+            else
+                return false;
+        }
+        else
+            return false;
+    }
+    return config.qps > 0;
+}
+
+string hostName(size_t i)
+{
+    return "host" + to_string(i) + ".bench.test";
+}
+
+/** Results of the measured lookups. */
+class Recorder
+{
+public:
+    explicit Recorder(Clock::time_point measureFrom) : measureFrom_(measureFrom) {}
+
+    /** Records lookup started at start, which is the time it was due in the open loop. */
+    void record(Clock::time_point start, const DataPtr& data)
+    {
+        outstanding_.fetch_sub(1, memory_order_relaxed);
+        if (start < measureFrom_)
+            return;
+        latency_.record(chrono::duration_cast<chrono::microseconds>(Clock::now() - start));
+        codes_[static_cast<size_t>(result(data))].fetch_add(1, memory_order_relaxed);
+    }
+
+    void onSent(Clock::time_point start)
+    {
+        outstanding_.fetch_add(1, memory_order_relaxed);
+        if (start >= measureFrom_)
+            sent_.fetch_add(1, memory_order_relaxed);
+    }
+
+    uint64_t outstanding() const { return outstanding_.load(memory_order_relaxed); }
+    uint64_t sent() const { return sent_.load(memory_order_relaxed); }
+    uint64_t count(DnsResolver::RESULT_CODE code) const { return codes_[static_cast<size_t>(code)].load(memory_order_relaxed); }
+    LatencyHistogram::Snapshot latency() const { return latency_.snapshot(); }
+
+private:
+    /** Lookup succeeded if any server answered, otherwise it has the result of the first server. */
+    static DnsResolver::RESULT_CODE result(const DataPtr& data)
+    {
+        const auto& ips = data->ips();
+        for (const auto& ip : ips) {
+            if (ip.resCode == DnsResolver::RESULT_CODE::SUCCESS)
+                return ip.resCode;
+        }
+        return ips.empty() ? DnsResolver::RESULT_CODE::INTERNAL_ERROR : ips.front().resCode;
+    }
+
+    Clock::time_point measureFrom_;
+    LatencyHistogram latency_;
+    atomic<uint64_t> codes_[DnsMetrics::CODES]{};
+    atomic<uint64_t> outstanding_{ 0 };
+    atomic<uint64_t> sent_{ 0 };
+};
+
+/** Sends lookups at the rate of qps / threads until end. Each lookup is measured from the time it was due. */
+void openLoop(const Config& config, int index, DnsResolver& resolver, const vector<wstring>& hosts, const vector<wstring>& servers,
+    Recorder& recorder, Clock::time_point start, Clock::time_point end)
+{
+    mt19937 random(config.seed + index);
+    uniform_int_distribution<size_t> host(0, hosts.size() - 1);
+    const double rate = config.qps / config.threads;
+    exponential_distribution<double> poisson(rate);
+    auto interval = [&]() {
+        const double seconds = config.poisson ? poisson(random) : 1.0 / rate;
+        return chrono::duration_cast<Clock::duration>(chrono::duration<double>(seconds));
+    };
+
+    auto due = start + interval();
+    while (due < end) {
+        // Lookups already due are sent right away, the rate is kept even if the thread fell behind.
+        if (due > Clock::now())
+            this_thread::sleep_until(due);
+        const auto sent = due;
+        recorder.onSent(sent);
+        resolver.Lookup(hosts[host(random)], servers, [sent, &recorder](const DataPtr& data) { recorder.record(sent, data); });
+        due += interval();
+    }
+}
+
+/** Sends next lookup when the previous is done until end. */
+void closedLoop(const Config& config, int index, DnsResolver& resolver, const vector<wstring>& hosts, const vector<wstring>& servers,
+    Recorder& recorder, Clock::time_point end)
+{
+    mt19937 random(config.seed + index);
+    uniform_int_distribution<size_t> host(0, hosts.size() - 1);
+    DnsResolver::Completion completion;
+    while (Clock::now() < end) {
+        const auto sent = Clock::now();
+        recorder.onSent(sent);
+        completion.reset();
+        resolver.Lookup(hosts[host(random)], servers, completion);
+        recorder.record(sent, completion.get());
+    }
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    Config config;
+    if (!parse(argc, argv, config)) {
+        usage();
+        return 1;
+    }
+
+    DnsStubServer::Zone zone;
+    vector<wstring> hosts;
+    hosts.reserve(config.hosts);
+    for (size_t i = 0; i < config.hosts; ++i) {
+        const auto name = hostName(i);
+        zone.add(name, DnsMessage::TYPE_A, "10." + to_string(i >> 16 & 0xFF) + '.' + to_string(i >> 8 & 0xFF) + '.' + to_string(i & 0xFF), config.ttl);
+        zone.add(name, DnsMessage::TYPE_AAAA, "2001:db8::" + to_string(i % 10000), config.ttl);
+        hosts.emplace_back(name.begin(), name.end());
+    }
+
+    vector<unique_ptr<DnsStubServer>> stubs;
+    vector<wstring> servers;
+    for (int i = 0; i < config.servers; ++i) {
+        stubs.push_back(make_unique<DnsStubServer>(zone));
+        stubs.back()->setDelay(config.delay, config.tail);
+        stubs.back()->setLossRate(config.loss);
+        stubs.back()->setSeed(config.seed + i);
+        servers.push_back(stubs.back()->address());
+    }
+
+    DnsEngine::Options engineOptions;
+    engineOptions.retransmitTimeout = config.retransmit;
+    DnsResolver::Options options;
+    options.cacheCapacity = config.cache ? max<size_t>(65536, config.hosts * 2) : 0;
+    options.prefetchPercent = config.prefetch;
+    options.staleCacheTtl = config.stale;
+    options.mode = config.mode;
+    options.queryTypes = config.types;
+    options.timeout = config.timeout;
+    DnsResolver resolver(make_unique<DnsEngine>(engineOptions), options);
+
+    const auto start = Clock::now();
+    const auto measureFrom = start + config.warmup;
+    const auto end = measureFrom + config.duration;
+    Recorder recorder(measureFrom);
+
+    vector<thread> threads;
+    const int count = config.openLoop ? config.threads : config.concurrency;
+    for (int i = 0; i < count; ++i) {
+        if (config.openLoop)
+            threads.emplace_back(openLoop, cref(config), i, ref(resolver), cref(hosts), cref(servers), ref(recorder), start, end);
+        else
+            threads.emplace_back(closedLoop, cref(config), i, ref(resolver), cref(hosts), cref(servers), ref(recorder), end);
+    }
+    for (auto& t : threads)
+        t.join();
+
+    // Lookups still in flight are waited for, so the slowest of them are in the tail.
+    const auto drainEnd = Clock::now() + config.timeout + chrono::seconds(1);
+    while (recorder.outstanding() && Clock::now() < drainEnd)
+        this_thread::sleep_for(chrono::milliseconds(1));
+
+    const auto latency = recorder.latency();
+    const auto seconds = chrono::duration<double>(config.duration).count();
+    if (config.openLoop)
+        cout << "open loop qps=" << config.qps << " threads=" << config.threads;
+    else
+        cout << "closed loop concurrency=" << config.concurrency;
+    cout << " duration=" << config.duration.count() << "ms hosts=" << config.hosts << " servers=" << config.servers
+        << " delay=" << config.delay.count() << "us tail=" << config.tail.count() << "us loss=" << config.loss
+        << " seed=" << config.seed << '\n';
+    cout << "sent " << recorder.sent() << " completed " << latency.count << " lost " << recorder.outstanding()
+        << " throughput " << latency.count / seconds << "/s\n";
+    cout << "results";
+    for (size_t code = 0; code < DnsMetrics::CODES; ++code) {
+        const auto resCode = static_cast<DnsResolver::RESULT_CODE>(code);
+        if (recorder.count(resCode))
+            cout << ' ' << DnsResolver::toString(resCode) << '=' << recorder.count(resCode);
+    }
+    cout << '\n';
+    cout << "latency us: min " << latency.min << " mean " << static_cast<uint64_t>(latency.mean())
+        << " p50 " << latency.percentile(0.5) << " p90 " << latency.percentile(0.9) << " p99 " << latency.percentile(0.99)
+        << " p999 " << latency.percentile(0.999) << " max " << latency.max << '\n';
+
+    if (config.metrics)
+        resolver.metrics().write(cout);
+    return recorder.outstanding() ? 2 : 0;
+}
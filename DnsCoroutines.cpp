@@ -0,0 +1,77 @@
+#include "DnsMessage.hpp"
+#include "DnsResolver.hpp"
+#include "DnsStubServer.hpp"
+
+#include <exception>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifndef DNS_RESOLVER_COROUTINES
+#error "DnsResolver::Awaitable is not available: build with C++20 coroutines"
+#endif
+
+using namespace std;
+using namespace Windscribe;
+
+/**
+* Lookups awaited by the coroutine against the in-process stub server: resolved host, cached host and unknown host.
+* Exits with non-zero code if any lookup gets unexpected result.
+*/
+
+namespace {
+
+/** Coroutine started right away, which destroys itself when it finishes. */
+struct Task {
+    struct promise_type {
+        Task get_return_object() noexcept { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { terminate(); }
+    };
+};
+
+/** Checks that the lookup got the expected result and address. */
+bool check(const DnsResolver::DataPtr& data, const wstring& host, DnsResolver::RESULT_CODE code, const string& address) {
+    bool ok = data && !data->ips().empty() && data->ips()[0].resCode == code;
+    if (ok && !address.empty())
+        ok = data->ips()[0].addresses.size() == 1 && data->ips()[0].addresses[0].toString() == address;
+    wcout << host << L": " << (ok ? L"ok" : L"FAILED") << endl;
+    return ok;
+}
+
+Task lookups(DnsResolver& resolver, const vector<wstring>& dns, promise<bool>& done) {
+    using RC = DnsResolver::RESULT_CODE;
+    const wstring resolved{ L"coroutine.test" }, unknown{ L"unknown.test" };
+    bool ok = check(co_await resolver.resolve(resolved, dns), resolved, RC::SUCCESS, "10.1.2.3");
+
+    // Cached answer completes the lookup before the coroutine is suspended.
+    ok = check(co_await resolver.resolve(resolved, dns), resolved, RC::SUCCESS, "10.1.2.3") && ok;
+    ok = check(co_await resolver.resolve(unknown, dns), unknown, RC::NOT_RESOLVED, "") && ok;
+    done.set_value(ok);
+}
+
+} // namespace
+
+int main() {
+    DnsStubServer::Zone zone;
+    zone.add("coroutine.test", DnsMessage::TYPE_A, "10.1.2.3");
+    DnsStubServer stub(move(zone));
+
+    // Outlive the resolver, which finishes the pending lookups when it is destroyed.
+    const vector<wstring> dns{ stub.address() };
+    promise<bool> done;
+    auto result = done.get_future();
+
+    DnsResolver::Options options;
+    options.queryTypes = DnsResolver::QUERY_TYPES::A;
+    DnsResolver resolver(options);
+    lookups(resolver, dns, done);
+    if (result.wait_for(chrono::seconds(10)) != future_status::ready) {
+        wcout << L"lookups did not finish" << endl;
+        return 1;
+    }
+    return result.get() ? 0 : 1;
+}
@@ -0,0 +1,70 @@
+#include "DnsMessage.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+using namespace std;
+using namespace Windscribe;
+
+/**
+* libFuzzer harness of the in-place DNS message decoding: DnsMessage::Reader, NameView and DnsMessage::parse().
+* Built with -DBUILD_DNS_FUZZER=ON by clang, run as DnsMessageFuzzer [corpus dir].
+* Besides the sanitizer errors it aborts if iterations of the same message disagree or the names are not consistent.
+*/
+
+namespace {
+
+const size_t NAME_CAPACITY{ DnsMessage::MAX_NAME_SIZE };
+
+/** Reads the name in every way NameView offers and checks they agree. */
+void checkName(const DnsMessage::NameView& name) {
+    char buf[NAME_CAPACITY];
+    const auto size = name.copy(buf, sizeof(buf));
+    const auto str = name.toString();
+
+    // Reader checks the names, so they are never longer than MAX_NAME_SIZE.
+    if (size == SIZE_MAX || size != str.size() || str.compare(0, string::npos, buf, size) != 0)
+        abort();
+    if (!(name == name))
+        abort();
+
+    // Labels may contain dots, so the dotted name does not always compare equal.
+    (void)name.equals(str);
+}
+
+/** Iterates the records from the current position. Returns number of records read. */
+size_t readRecords(DnsMessage::Reader& reader) {
+    DnsMessage::RecordView rec;
+    size_t records{ 0 };
+    while (reader.next(rec)) {
+        records++;
+        checkName(rec.name);
+        if (rec.type == DnsMessage::TYPE_CNAME) {
+            checkName(rec.target);
+            (void)(rec.target == reader.qname());
+        }
+        (void)(rec.name == reader.qname());
+        if (rec.rdataSize && !rec.rdata)
+            abort();
+    }
+    return records;
+}
+
+} // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    DnsMessage::Reader reader;
+    if (reader.reset(data, size)) {
+        checkName(reader.qname());
+        const auto records = readRecords(reader);
+        const auto malformed = reader.malformed();
+        reader.rewind();
+        if (readRecords(reader) != records || reader.malformed() != malformed)
+            abort();
+    }
+
+    DnsMessage::Message msg;
+    DnsMessage::parse(data, size, msg);
+    return 0;
+}
@@ -0,0 +1,340 @@
+#include "DnsCache.hpp"
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/locale.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <tuple>
+#include <vector>
+
+using namespace Windscribe;
+
+namespace {
+
+/** Snapshot file: header, entries, addresses and names of all entries, so it is used right from the mapped memory.
+* Numbers are in the byte order of the host, files of other hosts fail the magic check.
+*/
+const uint32_t SNAPSHOT_MAGIC{ 0x43534E44 }; // "DNSC"
+const uint32_t SNAPSHOT_VERSION{ 1 };
+
+struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t entries;
+    uint64_t addresses;
+    uint64_t namesSize;
+};
+
+struct SnapshotEntry {
+    /** Wall clock times in milliseconds since the epoch. */
+    int64_t expires;
+    int64_t prefetch;
+
+    /** Offsets of UTF-8 host and server in the names and of the first address. */
+    uint32_t host;
+    uint32_t server;
+    uint32_t addresses;
+    uint32_t hits;
+    uint16_t hostSize;
+    uint16_t serverSize;
+    uint16_t addressCount;
+    uint16_t type;
+    uint8_t code;
+    uint8_t reserved[7];
+};
+
+struct SnapshotAddress {
+    uint8_t family;
+    uint8_t bytes[IpAddress::V6_SIZE];
+};
+
+static_assert(sizeof(SnapshotHeader) == 32 && sizeof(SnapshotEntry) == 48 && sizeof(SnapshotAddress) == 17, "Snapshot layout must not depend on the compiler");
+
+using SystemClock = chrono::system_clock;
+
+int64_t toWallClock(DnsCache::Clock::time_point time, DnsCache::Clock::time_point now, SystemClock::time_point wallNow)
+{
+    return chrono::duration_cast<chrono::milliseconds>((wallNow + chrono::duration_cast<SystemClock::duration>(time - now)).time_since_epoch()).count();
+}
+
+DnsCache::Clock::time_point fromWallClock(int64_t time, DnsCache::Clock::time_point now, SystemClock::time_point wallNow)
+{
+    return now + chrono::duration_cast<DnsCache::Clock::duration>(SystemClock::time_point(chrono::milliseconds(time)) - wallNow);
+}
+
+}
+
+DnsCache::DnsCache() : DnsCache(Options()) {}
+
+DnsCache::DnsCache(const Options& options)
+    : options_(options)
+{
+    while (shardsCount_ < options_.shards)
+        shardsCount_ <<= 1;
+    shardCapacity_ = max<size_t>(1, options_.capacity / shardsCount_);
+    shards_.reset(new Shard[shardsCount_]);
+}
+
+size_t DnsCache::hash(const wstring& host, const wstring& server, uint16_t type)
+{
+    const std::hash<wstring> hasher;
+    size_t h = hasher(host);
+    h ^= hasher(server) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    h ^= type + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    return h;
+}
+
+bool DnsCache::get(const wstring& host, const wstring& server, uint16_t type, DnsResolver::ResIp& res, bool* refresh)
+{
+    if (refresh)
+        *refresh = false;
+    const auto h = hash(host, server, type);
+    auto& sh = shard(h);
+    {
+        lock_guard<mutex> lock(sh.mut);
+        const auto it = sh.entries.find(h);
+        if (it != sh.entries.cend()) {
+            auto& entry = it->second;
+            if (entry.type == type && entry.host == host && entry.server == server) {
+                const auto now = Clock::now();
+                const bool stale = now >= entry.expires;
+                if (!stale || (refresh && now < entry.expires + chrono::seconds(options_.staleTtl))) {
+                    entry.hits++;
+                    // Hot answer is refreshed before it expires, stale one as long as it is answered.
+                    const bool due = stale || (options_.prefetchPercent && entry.hits >= options_.prefetchHits && now >= entry.prefetch);
+                    if (refresh && due && now >= entry.refreshing) {
+                        entry.refreshing = now + options_.refreshTimeout;
+                        *refresh = true;
+                        refreshes_.fetch_add(1, memory_order_relaxed);
+                    }
+                    res = entry.res;
+                    hits_.fetch_add(1, memory_order_relaxed);
+                    if (stale)
+                        staleHits_.fetch_add(1, memory_order_relaxed);
+                    return true;
+                }
+                if (now >= entry.expires + chrono::seconds(options_.staleTtl))
+                    sh.entries.erase(it);
+            }
+        }
+    }
+    misses_.fetch_add(1, memory_order_relaxed);
+    return false;
+}
+
+void DnsCache::put(const wstring& host, const wstring& server, uint16_t type, const DnsResolver::ResIp& res, uint32_t ttl)
+{
+    const bool negative = res.resCode != DnsResolver::RESULT_CODE::SUCCESS;
+    ttl = min(ttl, negative ? options_.maxNegativeTtl : options_.maxTtl);
+    if (!ttl)
+        return;
+
+    const auto now = Clock::now();
+    const auto h = hash(host, server, type);
+    auto& sh = shard(h);
+    lock_guard<mutex> lock(sh.mut);
+    auto& entry = slot(sh, h, now);
+    entry.host = host;
+    entry.server = server;
+    entry.type = type;
+    entry.res = res;
+    entry.expires = now + chrono::seconds(ttl);
+    entry.prefetch = entry.expires - chrono::milliseconds(static_cast<int64_t>(ttl) * 10 * min<uint32_t>(options_.prefetchPercent, 100));
+    entry.refreshing = {};
+    entry.hits = 0;
+}
+
+DnsCache::Entry& DnsCache::slot(Shard& sh, size_t hash, Clock::time_point now)
+{
+    if (sh.entries.size() < shardCapacity_ || sh.entries.count(hash))
+        return sh.entries[hash];
+
+    // Sampling keeps the insert O(1) under the lock. Candidates are compared by expiry, hot ones are kept while others are found.
+    const auto stale = chrono::seconds(options_.staleTtl);
+    auto rank = [&](const Entry& e) {
+        const bool expired = e.expires + stale <= now;
+        const bool hot = e.hits >= options_.prefetchHits;
+        return make_tuple(!expired, hot, e.expires);
+    };
+    const auto buckets = sh.entries.bucket_count();
+    const Entry* victim{ nullptr };
+    size_t victimHash{ 0 };
+    for (int sample = 0; sample < EVICTION_SAMPLES; ++sample) {
+        // xorshift64
+        sh.random ^= sh.random << 13;
+        sh.random ^= sh.random >> 7;
+        sh.random ^= sh.random << 17;
+
+        // The shard is full, so the empty buckets are a fraction and the walk to the next entry is short.
+        auto bucket = static_cast<size_t>(sh.random % buckets);
+        while (!sh.entries.bucket_size(bucket))
+            bucket = (bucket + 1) % buckets;
+        for (auto it = sh.entries.begin(bucket); it != sh.entries.end(bucket); ++it) {
+            if (!victim || rank(it->second) < rank(*victim)) {
+                victim = &it->second;
+                victimHash = it->first;
+            }
+        }
+    }
+    sh.entries.erase(victimHash);
+    return sh.entries[hash];
+}
+
+void DnsCache::clear()
+{
+    for (size_t i = 0; i < shardsCount_; ++i) {
+        lock_guard<mutex> lock(shards_[i].mut);
+        shards_[i].entries.clear();
+    }
+}
+
+size_t DnsCache::size() const
+{
+    size_t res{ 0 };
+    for (size_t i = 0; i < shardsCount_; ++i) {
+        lock_guard<mutex> lock(shards_[i].mut);
+        res += shards_[i].entries.size();
+    }
+    return res;
+}
+
+bool DnsCache::save(const string& path) const
+{
+    const auto now = Clock::now();
+    const auto wallNow = SystemClock::now();
+    const auto stale = chrono::seconds(options_.staleTtl);
+    vector<SnapshotEntry> entries;
+    vector<SnapshotAddress> addresses;
+    string names;
+    for (size_t i = 0; i < shardsCount_; ++i) {
+        lock_guard<mutex> lock(shards_[i].mut);
+        for (const auto& it : shards_[i].entries) {
+            const auto& entry = it.second;
+            if (entry.expires + stale <= now)
+                continue;
+            const auto host = boost::locale::conv::utf_to_utf<char>(entry.host);
+            const auto server = boost::locale::conv::utf_to_utf<char>(entry.server);
+            if (host.size() > UINT16_MAX || server.size() > UINT16_MAX || entry.res.addresses.size() > UINT16_MAX)
+                continue;
+            SnapshotEntry rec{};
+            rec.expires = toWallClock(entry.expires, now, wallNow);
+            rec.prefetch = toWallClock(entry.prefetch, now, wallNow);
+            rec.host = static_cast<uint32_t>(names.size());
+            rec.hostSize = static_cast<uint16_t>(host.size());
+            names += host;
+            rec.server = static_cast<uint32_t>(names.size());
+            rec.serverSize = static_cast<uint16_t>(server.size());
+            names += server;
+            rec.addresses = static_cast<uint32_t>(addresses.size());
+            rec.addressCount = static_cast<uint16_t>(entry.res.addresses.size());
+            for (const auto& address : entry.res.addresses) {
+                SnapshotAddress a{};
+                a.family = static_cast<uint8_t>(address.family());
+                memcpy(a.bytes, address.data(), address.size());
+                addresses.push_back(a);
+            }
+            rec.hits = entry.hits;
+            rec.type = entry.type;
+            rec.code = static_cast<uint8_t>(entry.res.resCode);
+            entries.push_back(rec);
+        }
+    }
+
+    const SnapshotHeader header{ SNAPSHOT_MAGIC, SNAPSHOT_VERSION, entries.size(), addresses.size(), names.size() };
+    // Written to the temporary file and renamed, so processes loading the snapshot never see it partially written.
+    const auto tmp = path + ".tmp";
+    {
+        ofstream out(tmp, ios::binary | ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(SnapshotEntry));
+        out.write(reinterpret_cast<const char*>(addresses.data()), addresses.size() * sizeof(SnapshotAddress));
+        out.write(names.data(), names.size());
+        if (!out.flush()) {
+            out.close();
+            remove(tmp.c_str());
+            return false;
+        }
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        // Windows does not replace the existing file by rename.
+        remove(path.c_str());
+        if (rename(tmp.c_str(), path.c_str()) != 0) {
+            remove(tmp.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t DnsCache::load(const string& path)
+{
+    using namespace boost::interprocess;
+    file_mapping file;
+    mapped_region region;
+    try {
+        file = file_mapping(path.c_str(), read_only);
+        region = mapped_region(file, read_only);
+    }
+    catch (const interprocess_exception&) {
+        return 0;
+    }
+
+    const auto base = static_cast<const char*>(region.get_address());
+    const auto size = region.get_size();
+    if (size < sizeof(SnapshotHeader))
+        return 0;
+    SnapshotHeader header;
+    memcpy(&header, base, sizeof(header));
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION || header.entries > size || header.addresses > size
+        || sizeof(header) + header.entries * sizeof(SnapshotEntry) + header.addresses * sizeof(SnapshotAddress) + header.namesSize != size)
+        return 0;
+    const auto entries = reinterpret_cast<const SnapshotEntry*>(base + sizeof(header));
+    const auto addresses = reinterpret_cast<const SnapshotAddress*>(entries + header.entries);
+    const auto names = reinterpret_cast<const char*>(addresses + header.addresses);
+
+    const auto now = Clock::now();
+    const auto wallNow = SystemClock::now();
+    const auto stale = chrono::seconds(options_.staleTtl);
+    size_t res{ 0 };
+    DnsResolver::ResIp ip;
+    for (uint64_t i = 0; i < header.entries; ++i) {
+        const auto& rec = entries[i];
+        if (static_cast<uint64_t>(rec.host) + rec.hostSize > header.namesSize || static_cast<uint64_t>(rec.server) + rec.serverSize > header.namesSize
+            || static_cast<uint64_t>(rec.addresses) + rec.addressCount > header.addresses || rec.code > static_cast<uint8_t>(DnsResolver::RESULT_CODE::TIMEOUT))
+            return res; // corrupted, entries added so far are valid
+        const auto expires = fromWallClock(rec.expires, now, wallNow);
+        if (expires + stale <= now)
+            continue;
+        ip.reset(static_cast<DnsResolver::RESULT_CODE>(rec.code));
+        for (uint16_t j = 0; j < rec.addressCount; ++j) {
+            const auto& a = addresses[rec.addresses + j];
+            const auto family = static_cast<IpAddress::FAMILY>(a.family);
+            ip.addresses.emplace_back(a.bytes, family == IpAddress::FAMILY::V4 ? IpAddress::V4_SIZE : family == IpAddress::FAMILY::V6 ? IpAddress::V6_SIZE : 0);
+        }
+        auto host = boost::locale::conv::utf_to_utf<wchar_t>(names + rec.host, names + rec.host + rec.hostSize);
+        auto server = boost::locale::conv::utf_to_utf<wchar_t>(names + rec.server, names + rec.server + rec.serverSize);
+
+        const auto h = hash(host, server, rec.type);
+        auto& sh = shard(h);
+        lock_guard<mutex> lock(sh.mut);
+        // Answers stored after the snapshot was written are newer.
+        const auto it = sh.entries.find(h);
+        if (it != sh.entries.cend() && it->second.expires >= expires)
+            continue;
+        auto& entry = slot(sh, h, now);
+        entry.host = move(host);
+        entry.server = move(server);
+        entry.type = rec.type;
+        entry.res = ip;
+        entry.expires = expires;
+        entry.prefetch = fromWallClock(rec.prefetch, now, wallNow);
+        entry.refreshing = {};
+        entry.hits = rec.hits;
+        res++;
+    }
+    return res;
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "DnsResolver.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+namespace Windscribe {
+
+/**
+* Concurrent TTL-aware answer cache keyed by (host, server, record type).
+* Keeps both positive answers and negative ones (NOT_RESOLVED). Entries are spread over
+* independently locked shards, so many threads can use the cache without contending on one mutex.
+* Counts hits of every answer, so the answers of the hot names are refreshed before they expire,
+* and keeps expired answers for a while to answer them while they are refreshed (serve-stale).
+*/
+class DnsCache
+{
+public:
+
+    struct Options {
+        /** Number of shards. Rounded up to the power of 2. */
+        size_t shards{ 64 };
+
+        /** Maximum number of entries in the whole cache. */
+        size_t capacity{ 65536 };
+
+        /** Upper bound of TTL of the positive answers in seconds. */
+        uint32_t maxTtl{ 86400 };
+
+        /** Upper bound of TTL of the negative answers in seconds. */
+        uint32_t maxNegativeTtl{ 30 };
+
+        /** Percent of TTL left when the answer of the hot name is due for refresh. Zero disables prefetch. */
+        uint32_t prefetchPercent{ 10 };
+
+        /** Number of hits since the answer was stored which make its name hot. */
+        uint32_t prefetchHits{ 3 };
+
+        /** Seconds the expired answer is kept and answered while it is refreshed. Zero disables serve-stale. */
+        uint32_t staleTtl{ 0 };
+
+        /** Time the refresh is expected to finish by. The answer is due for refresh again if it is not updated in time. */
+        chrono::milliseconds refreshTimeout{ 5000 };
+    };
+
+    using Clock = chrono::steady_clock;
+
+    DnsCache();
+    explicit DnsCache(const Options& options);
+
+    /** Finds not expired answer.
+    * @param res Cached answer. resCode is SUCCESS for positive answer and NOT_RESOLVED for negative one.
+    * @param refresh If not null, set to true if the caller should query the server again and put() its answer:
+    * the answer is hot and close to expiry or it is stale. Only one caller is asked per refreshTimeout.
+    * Stale answers are found only by the callers which refresh.
+    * @return true if answer was found.
+    */
+    bool get(const wstring& host, const wstring& server, uint16_t type, DnsResolver::ResIp& res, bool* refresh = nullptr);
+
+    /** Stores answer for ttl seconds. Answers with zero ttl are not stored. */
+    void put(const wstring& host, const wstring& server, uint16_t type, const DnsResolver::ResIp& res, uint32_t ttl);
+
+    /** Removes all entries. */
+    void clear();
+
+    /** Writes the entries, including stale ones, to the snapshot file replacing it. Expiry times are stored as wall clock time.
+    * @return false if the file can't be written.
+    */
+    bool save(const string& path) const;
+
+    /** Adds the entries of the snapshot file written by save(). The file is mapped into memory, not parsed.
+    * TTLs are reduced by the time passed since the snapshot was written, entries expired meanwhile are skipped.
+    * @return Number of entries added. Zero if the file can't be read or is not a valid snapshot.
+    */
+    size_t load(const string& path);
+
+    /** Number of entries including expired but not evicted yet. */
+    size_t size() const;
+
+    uint64_t hits() const { return hits_.load(memory_order_relaxed); }
+    uint64_t misses() const { return misses_.load(memory_order_relaxed); }
+
+    /** Refreshes requested by get(). */
+    uint64_t refreshes() const { return refreshes_.load(memory_order_relaxed); }
+
+    /** Hits of the expired answers. They are counted in hits() too. */
+    uint64_t staleHits() const { return staleHits_.load(memory_order_relaxed); }
+
+private:
+    struct Entry {
+        wstring host;
+        wstring server;
+        uint16_t type{ 0 };
+        DnsResolver::ResIp res;
+        Clock::time_point expires;
+
+        /** Time the hot answer is due for refresh. */
+        Clock::time_point prefetch;
+
+        /** Time the refresh requested last is expected to finish by. */
+        Clock::time_point refreshing;
+
+        /** Hits since the answer was stored. */
+        uint32_t hits{ 0 };
+    };
+
+    /** Entries are indexed by the hash of the key and verified on lookup, so lookup does not build key objects.
+    * Keys with the same hash replace each other.
+    */
+    struct Shard {
+        mutable mutex mut;
+        unordered_map<size_t, Entry> entries;
+
+        /** State of the generator choosing the buckets sampled for eviction. */
+        uint64_t random{ 0x9e3779b97f4a7c15ULL };
+    };
+
+    /** Entries sampled when the full shard makes room for a new one. */
+    static const int EVICTION_SAMPLES{ 5 };
+
+    static size_t hash(const wstring& host, const wstring& server, uint16_t type);
+
+    /** Returns entry of the shard for the hash, making room for it if the shard is full. Shard must be locked.
+    * The evicted entry is the best of EVICTION_SAMPLES random ones: expired, otherwise not hot and expiring the soonest.
+    */
+    Entry& slot(Shard& sh, size_t hash, Clock::time_point now);
+
+    Shard& shard(size_t hash) { return shards_[hash & (shardsCount_ - 1)]; }
+
+    Options options_;
+    size_t shardsCount_{ 1 };
+    size_t shardCapacity_{ 1 };
+    unique_ptr<Shard[]> shards_;
+
+    atomic<uint64_t> hits_{ 0 };
+    atomic<uint64_t> misses_{ 0 };
+    atomic<uint64_t> refreshes_{ 0 };
+    atomic<uint64_t> staleHits_{ 0 };
+};
+
+}
@@ -0,0 +1,878 @@
+#ifdef __linux__
+
+#include "DnsEngine.hpp"
+#include "DnsMessage.hpp"
+#include "DnsTrace.hpp"
+
+#include <boost/locale.hpp>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <system_error>
+
+using namespace Windscribe;
+
+namespace {
+
+/** Standard DNS port. */
+const uint16_t DNS_PORT{ 53 };
+
+/** Maximum size of the DNS message (TCP frames are limited by 16-bit length). */
+const size_t MAX_MESSAGE_SIZE{ 65535 };
+
+/** Server used if there is no nameserver in /etc/resolv.conf. */
+const char* const FALLBACK_SERVER{ "127.0.0.1" };
+
+/** Socket buffers of the upstream socket. In-flight queries to the server share it, so default size is not enough. */
+const int UPSTREAM_BUFFER_SIZE{ 1024 * 1024 };
+
+/** Number of UDP sockets, so source ports, per upstream. Query is sent from the random one. */
+const uint32_t SOURCE_PORTS{ 4 };
+
+/** Maximum number of queries waiting for the answer on one socket. Queries above it fail with INTERNAL_ERROR.
+* A quarter of the transaction IDs, so the random ID is free at the first or second try.
+*/
+const size_t MAX_PENDING_PER_SOCKET{ 16384 };
+
+/** Number of random transaction IDs read from the kernel at once. */
+const size_t RANDOM_BATCH{ 1024 };
+
+/** Maximum number of CNAMEs followed for one query, within the answer and by repeated queries. */
+const int MAX_CNAME_CHAIN{ 8 };
+
+/** Maximum number of epoll events processed in one iteration. */
+const int MAX_EVENTS{ 64 };
+
+/** Maximum number of queries started in one iteration. Answers are read between bursts, so they do not overflow the socket. */
+const size_t MAX_SEND_BURST{ 256 };
+
+/** Resolution of the timing wheel and number of its buckets. Timers further than 5 seconds wait for the next round. */
+const chrono::milliseconds WHEEL_TICK{ 10 };
+const size_t WHEEL_SIZE{ 512 };
+
+/** Kinds of the file descriptors registered in epoll. Kind is stored in the high half of epoll_data.u64. */
+enum EVENT_KIND : uint64_t {
+    EVENT_WAKE = 0,
+    EVENT_UPSTREAM = 1,
+    EVENT_TCP = 2
+};
+
+}
+
+const uint32_t DnsEngine::NO_SLOT;
+
+namespace {
+
+uint64_t tag(EVENT_KIND kind, uint32_t index)
+{
+    return (static_cast<uint64_t>(kind) << 32) | index;
+}
+
+/** Parses "ip", "ip:port" or "[ipv6]:port" into socket address. */
+bool parseAddress(const string& str, sockaddr_storage& addr, socklen_t& len)
+{
+    string host = str;
+    uint16_t port = DNS_PORT;
+    if (!str.empty() && str.front() == '[') {
+        const auto close = str.find(']');
+        if (close == string::npos)
+            return false;
+        host = str.substr(1, close - 1);
+        if (close + 1 < str.size()) {
+            if (str[close + 1] != ':')
+                return false;
+            port = static_cast<uint16_t>(stoul(str.substr(close + 2)));
+        }
+    }
+    else if (count(str.begin(), str.end(), ':') == 1) {
+        const auto colon = str.find(':');
+        host = str.substr(0, colon);
+        port = static_cast<uint16_t>(stoul(str.substr(colon + 1)));
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    auto* v4 = reinterpret_cast<sockaddr_in*>(&addr);
+    if (inet_pton(AF_INET, host.c_str(), &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(port);
+        len = sizeof(sockaddr_in);
+        return true;
+    }
+    auto* v6 = reinterpret_cast<sockaddr_in6*>(&addr);
+    if (inet_pton(AF_INET6, host.c_str(), &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(port);
+        len = sizeof(sockaddr_in6);
+        return true;
+    }
+    return false;
+}
+
+/** Returns first nameserver from /etc/resolv.conf. */
+string systemServer()
+{
+    ifstream conf("/etc/resolv.conf");
+    string line;
+    while (getline(conf, line)) {
+        istringstream in(line);
+        string key, value;
+        if (in >> key >> value && key == "nameserver")
+            return value.find(':') == string::npos ? value : "[" + value + "]";
+    }
+    return FALLBACK_SERVER;
+}
+
+}
+
+DnsEngine::DnsEngine() : DnsEngine(Options()) {}
+
+DnsEngine::DnsEngine(const Options& options)
+    : systemServer_(systemServer()), options_(options), wheel_(WHEEL_SIZE), wheelStart_(chrono::steady_clock::now()),
+    buffer_(MAX_MESSAGE_SIZE)
+{
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epollFd_ < 0 || wakeFd_ < 0)
+        throw system_error(errno, generic_category(), "DnsEngine");
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = tag(EVENT_WAKE, 0);
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeFd_, &ev);
+    thread_ = thread(&DnsEngine::run, this);
+}
+
+DnsEngine::~DnsEngine()
+{
+    stop_ = true;
+    const uint64_t one{ 1 };
+    (void)write(wakeFd_, &one, sizeof(one));
+    thread_.join();
+
+    // Nobody will answer to queries left, report them as failed.
+    for (uint32_t i = 0; i < slots_.size(); ++i) {
+        if (slots_[i].data)
+            finish(i, DnsResolver::RESULT_CODE::INTERNAL_ERROR);
+    }
+    {
+        lock_guard<mutex> lock(mutex_);
+        starting_.insert(starting_.end(), make_move_iterator(submitted_.begin()), make_move_iterator(submitted_.end()));
+        submitted_.clear();
+    }
+    for (; startingPos_ < starting_.size(); ++startingPos_)
+        starting_[startingPos_].data->onError(starting_[startingPos_].ind, DnsResolver::RESULT_CODE::INTERNAL_ERROR);
+    for (; !delayed_.empty(); delayed_.pop())
+        delayed_.top().data->onError(delayed_.top().ind, DnsResolver::RESULT_CODE::INTERNAL_ERROR);
+
+    for (const auto& up : upstreams_) {
+        for (const auto& socket : up.sockets)
+            close(socket.fd);
+    }
+    close(wakeFd_);
+    close(epollFd_);
+}
+
+void DnsEngine::Query(const wstring&, const wstring&, DataPtr data, int ind)
+{
+    bool wake{ false };
+    {
+        lock_guard<mutex> lock(mutex_);
+        wake = submitted_.empty() && cancelled_.empty();
+        submitted_.push_back({ move(data), ind, {} });
+    }
+
+    // I/O thread takes all submitted queries at once, so it is enough to wake it up for the first one.
+    if (wake) {
+        const uint64_t one{ 1 };
+        (void)write(wakeFd_, &one, sizeof(one));
+    }
+}
+
+void DnsEngine::Query(vector<Request>& requests)
+{
+    if (requests.empty())
+        return;
+
+    const auto now = chrono::steady_clock::now();
+    bool wake{ false };
+    {
+        lock_guard<mutex> lock(mutex_);
+        wake = submitted_.empty() && cancelled_.empty();
+        for (auto& req : requests) {
+            submitted_.push_back({ move(req.data), req.ind, {} });
+            if (req.delay.count() > 0)
+                submitted_.back().due = now + req.delay;
+        }
+    }
+    if (wake) {
+        const uint64_t one{ 1 };
+        (void)write(wakeFd_, &one, sizeof(one));
+    }
+}
+
+void DnsEngine::Cancel(const DataPtr& data, int ind)
+{
+    bool wake{ false };
+    {
+        lock_guard<mutex> lock(mutex_);
+        wake = submitted_.empty() && cancelled_.empty();
+        cancelled_.push_back({ data.get(), ind });
+    }
+    if (wake) {
+        const uint64_t one{ 1 };
+        (void)write(wakeFd_, &one, sizeof(one));
+    }
+}
+
+void DnsEngine::Expedite(const DataPtr& data, int ind)
+{
+    // Submitted without delay, the delayed submission of the query is skipped by start().
+    Query(data->host(), data->server(ind), data, ind);
+}
+
+void DnsEngine::run()
+{
+    epoll_event events[MAX_EVENTS];
+    while (!stop_) {
+        const bool starting = startingPos_ < starting_.size();
+        const int n = epoll_wait(epollFd_, events, MAX_EVENTS, starting ? 0 : timeout());
+        if (n < 0 && errno != EINTR)
+            break;
+        for (int i = 0; i < n; ++i) {
+            const auto kind = events[i].data.u64 >> 32;
+            const auto index = static_cast<uint32_t>(events[i].data.u64);
+            switch (kind) {
+            case EVENT_WAKE: {
+                uint64_t value;
+                (void)read(wakeFd_, &value, sizeof(value));
+                cancelSubmitted();
+                startSubmitted();
+                break;
+            }
+            case EVENT_UPSTREAM:
+                onUpstreamEvent(index / SOURCE_PORTS, index % SOURCE_PORTS);
+                break;
+            case EVENT_TCP:
+                onTcpEvent(index, events[i].events);
+                break;
+            }
+        }
+        if (starting)
+            startSubmitted();
+        if (!delayed_.empty())
+            startDelayed();
+        if (timersCount_)
+            expireTimers();
+        if (!unsent_.empty())
+            flush(); // queries restarted for CNAME targets
+    }
+}
+
+int DnsEngine::timeout() const
+{
+    if (delayed_.empty() && !timersCount_)
+        return -1;
+    const auto now = chrono::steady_clock::now();
+    auto next = chrono::steady_clock::time_point::max();
+    if (!delayed_.empty())
+        next = delayed_.top().due;
+    if (timersCount_)
+        next = min(next, wheelStart_ + WHEEL_TICK * static_cast<int64_t>(tick_ + 1));
+    if (next <= now)
+        return 0;
+    // Round up, so the loop does not wake up right before the due time.
+    return static_cast<int>(chrono::duration_cast<chrono::milliseconds>(next - now).count() + 1);
+}
+
+uint64_t DnsEngine::tickOf(chrono::steady_clock::time_point time) const
+{
+    return time <= wheelStart_ ? 0 : static_cast<uint64_t>((time - wheelStart_) / WHEEL_TICK);
+}
+
+void DnsEngine::schedule(uint32_t index, chrono::steady_clock::time_point time)
+{
+    auto& slot = slots_[index];
+    slot.timerTick = max(tickOf(time), tick_ + 1);
+    wheel_[slot.timerTick % WHEEL_SIZE].push_back({ index, slot.generation, slot.timerTick });
+    timersCount_++;
+}
+
+void DnsEngine::expireTimers()
+{
+    const auto target = tickOf(chrono::steady_clock::now());
+    if (target <= tick_)
+        return;
+
+    // Every bucket is visited at most once, even if the loop did not run for more than a round.
+    // tick_ follows visited buckets, so timers scheduled by onTimer() never get to the bucket already visited.
+    const auto first = tick_;
+    const auto steps = min<uint64_t>(target - first, WHEEL_SIZE);
+    vector<Timer> bucket;
+    for (uint64_t step = 1; step <= steps; ++step) {
+        tick_ = step == steps ? target : first + step;
+        bucket.clear();
+        bucket.swap(wheel_[(first + step) % WHEEL_SIZE]);
+        timersCount_ -= bucket.size();
+        for (const auto& timer : bucket) {
+            const auto& slot = slots_[timer.slot];
+            if (timer.generation != slot.generation || timer.tick != slot.timerTick || !slot.data)
+                continue; // stale
+            if (timer.tick > target) {
+                wheel_[timer.tick % WHEEL_SIZE].push_back(timer); // next round
+                timersCount_++;
+                continue;
+            }
+            onTimer(timer.slot);
+        }
+    }
+    flush();
+}
+
+void DnsEngine::onTimer(uint32_t index)
+{
+    auto& slot = slots_[index];
+    const auto now = chrono::steady_clock::now();
+    if (tickOf(slot.deadline) <= tick_ || slot.tcpFd >= 0 || slot.retransmits >= options_.maxRetransmits) {
+        finish(index, DnsResolver::RESULT_CODE::TIMEOUT);
+        return;
+    }
+    slot.retransmits++;
+    slot.rto *= 2;
+    queue(index);
+    schedule(index, min(now + slot.rto, slot.deadline));
+}
+
+void DnsEngine::startDelayed()
+{
+    const auto now = chrono::steady_clock::now();
+    while (!delayed_.empty() && delayed_.top().due <= now) {
+        auto sub = move(const_cast<Submission&>(delayed_.top()));
+        delayed_.pop();
+        sub.due = {};
+        start(sub);
+    }
+    flush();
+}
+
+void DnsEngine::cancelSubmitted()
+{
+    vector<QueryKey> cancelled;
+    {
+        lock_guard<mutex> lock(mutex_);
+        cancelled.swap(cancelled_);
+    }
+    for (const auto& key : cancelled) {
+        const auto it = cancellable_.find(key);
+        if (it != cancellable_.cend())
+            release(it->second);
+    }
+}
+
+void DnsEngine::startSubmitted()
+{
+    auto takeSubmitted = [this]() {
+        // Data are reused after their lookups complete, so cancellations queued before must not match the new queries.
+        cancelSubmitted();
+        starting_.clear();
+        startingPos_ = 0;
+        lock_guard<mutex> lock(mutex_);
+        starting_.swap(submitted_);
+    };
+
+    if (startingPos_ == starting_.size())
+        takeSubmitted();
+    const auto end = min(starting_.size(), startingPos_ + MAX_SEND_BURST);
+    for (; startingPos_ < end; ++startingPos_)
+        start(starting_[startingPos_]);
+    flush();
+
+    // Callers do not wake up the thread while submitted_ is not empty, so take queries submitted during the burst now.
+    if (startingPos_ == starting_.size())
+        takeSubmitted();
+}
+
+int DnsEngine::upstream(const wstring& server)
+{
+    const auto it = upstreamIndex_.find(server);
+    if (it != upstreamIndex_.cend())
+        return static_cast<int>(it->second);
+
+    Upstream up;
+    bool valid{ false };
+    try {
+        up.name = server.empty() ? systemServer_ : boost::locale::conv::utf_to_utf<char>(server);
+        valid = parseAddress(up.name, up.addr, up.addrLen);
+    }
+    catch (const exception&) {
+    }
+    if (!valid)
+        return -1;
+
+    // Every socket is connected, so the kernel binds it to its own random ephemeral port.
+    const auto index = static_cast<uint32_t>(upstreams_.size());
+    up.sockets.resize(SOURCE_PORTS);
+    for (uint32_t i = 0; i < SOURCE_PORTS; ++i) {
+        auto& fd = up.sockets[i].fd;
+        fd = socket(up.addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd >= 0) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &UPSTREAM_BUFFER_SIZE, sizeof(UPSTREAM_BUFFER_SIZE));
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &UPSTREAM_BUFFER_SIZE, sizeof(UPSTREAM_BUFFER_SIZE));
+        }
+        if (fd < 0 || connect(fd, reinterpret_cast<const sockaddr*>(&up.addr), up.addrLen) < 0) {
+            for (const auto& socket : up.sockets) {
+                if (socket.fd >= 0)
+                    close(socket.fd);
+            }
+            return -1;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = tag(EVENT_UPSTREAM, index * SOURCE_PORTS + i);
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev);
+    }
+    upstreams_.emplace_back(move(up));
+    upstreamIndex_.emplace(server, index);
+    return static_cast<int>(index);
+}
+
+uint32_t DnsEngine::allocateSlot()
+{
+    if (freeSlots_.empty()) {
+        slots_.emplace_back();
+        return static_cast<uint32_t>(slots_.size() - 1);
+    }
+    const auto index = freeSlots_.back();
+    freeSlots_.pop_back();
+    return index;
+}
+
+void DnsEngine::start(Submission& sub)
+{
+    // Nobody waits for the result anymore.
+    if (sub.data->isDone(sub.ind))
+        return;
+    if (sub.due != chrono::steady_clock::time_point()) {
+        delayed_.push(move(sub));
+        return;
+    }
+    // Delayed query was expedited and started already.
+    if (!sub.data->markSent(sub.ind))
+        return;
+    const auto now = chrono::steady_clock::now();
+    if (now >= sub.data->deadline()) {
+        sub.data->onError(sub.ind, DnsResolver::RESULT_CODE::TIMEOUT);
+        return;
+    }
+
+    const int up = upstream(sub.data->server(sub.ind));
+    if (up < 0) {
+        DNS_TRACE_ERROR(INVALID_SERVER, sub.data.get(), sub.ind, 0);
+        sub.data->onError(sub.ind, DnsResolver::RESULT_CODE::INTERNAL_ERROR);
+        return;
+    }
+    // Socket is chosen at random among the ones which are not full.
+    auto& upstream = upstreams_[up];
+    const auto first = random() % SOURCE_PORTS;
+    auto socket = first;
+    while (upstream.sockets[socket].pendingCount >= MAX_PENDING_PER_SOCKET) {
+        socket = (socket + 1) % SOURCE_PORTS;
+        if (socket == first) {
+            DNS_TRACE_ERROR(UPSTREAM_BUSY, up, upstream.sockets.size() * MAX_PENDING_PER_SOCKET, 0);
+            sub.data->onError(sub.ind, DnsResolver::RESULT_CODE::INTERNAL_ERROR);
+            return;
+        }
+    }
+    auto& sock = upstream.sockets[socket];
+
+    const auto id = newId(sock);
+    const auto index = allocateSlot();
+    auto& slot = slots_[index];
+    slot.type = sub.data->queryType(sub.ind);
+    slot.hops = 0;
+    slot.ttl = UINT32_MAX;
+    if (!DnsMessage::normalize(sub.data->host(), slot.name) || !DnsMessage::buildQuery(id, slot.name, slot.type, slot.request)) {
+        freeSlots_.push_back(index);
+        DNS_TRACE_ERROR(INVALID_HOST, sub.data.get(), sub.ind, 0);
+        sub.data->onError(sub.ind, DnsResolver::RESULT_CODE::NOT_RESOLVED);
+        return;
+    }
+    slot.data = move(sub.data);
+    slot.ind = sub.ind;
+    slot.upstream = static_cast<uint32_t>(up);
+    slot.socket = socket;
+    slot.id = id;
+    slot.deadline = slot.data->deadline();
+    slot.rto = options_.retransmitTimeout;
+    slot.retransmits = 0;
+    schedule(index, min(now + slot.rto, slot.deadline));
+    sock.pending[id] = index;
+    sock.pendingCount++;
+    if (slot.data->cancellable())
+        cancellable_.emplace(QueryKey{ slot.data.get(), slot.ind }, index);
+    inFlight_.fetch_add(1, memory_order_relaxed);
+    queue(index);
+}
+
+uint16_t DnsEngine::newId(const Socket& socket)
+{
+    // At most a quarter of IDs are used, so it takes 4/3 tries on average.
+    uint16_t id;
+    do {
+        id = random();
+    } while (socket.pending[id] != NO_SLOT);
+    return id;
+}
+
+uint16_t DnsEngine::random()
+{
+    if (randomsPos_ == randoms_.size()) {
+        randoms_.resize(RANDOM_BATCH);
+        auto* buf = reinterpret_cast<uint8_t*>(randoms_.data());
+        const size_t size = randoms_.size() * sizeof(uint16_t);
+        size_t filled{ 0 };
+        while (filled < size) {
+            const auto n = getrandom(buf + filled, size - filled, 0);
+            if (n > 0)
+                filled += n;
+            else if (errno != EINTR)
+                break;
+        }
+        // Without getrandom() the bits are taken from random_device, which reads the same kernel source.
+        if (filled < size) {
+            random_device device;
+            for (auto& value : randoms_)
+                value = static_cast<uint16_t>(device());
+        }
+        randomsPos_ = 0;
+    }
+    return randoms_[randomsPos_++];
+}
+
+void DnsEngine::queue(uint32_t index)
+{
+    auto& slot = slots_[index];
+    if (slot.unsent)
+        return;
+    slot.unsent = true;
+    unsent_.push_back(index);
+}
+
+void DnsEngine::flush()
+{
+    // Slots released since they were queued are dropped. Slot reused meanwhile was not queued again, its entry is kept.
+    size_t kept{ 0 };
+    for (const auto index : unsent_) {
+        auto& slot = slots_[index];
+        slot.unsent = false;
+        if (slot.data)
+            unsent_[kept++] = index;
+    }
+    unsent_.resize(kept);
+
+    // Group queries by socket keeping the order of the queries sent from the same socket.
+    // Usually they are grouped already, then the sort and its temporary buffer are skipped.
+    const auto port = [this](uint32_t index) { return static_cast<uint64_t>(slots_[index].upstream) * SOURCE_PORTS + slots_[index].socket; };
+    const auto byPort = [&port](uint32_t a, uint32_t b) { return port(a) < port(b); };
+    if (!is_sorted(unsent_.begin(), unsent_.end(), byPort))
+        stable_sort(unsent_.begin(), unsent_.end(), byPort);
+
+    size_t first{ 0 };
+    while (first < unsent_.size()) {
+        const auto up = slots_[unsent_[first]].upstream;
+        const auto socket = slots_[unsent_[first]].socket;
+        auto last = first;
+        while (last < unsent_.size() && port(unsent_[last]) == port(unsent_[first]))
+            ++last;
+
+        const auto count = last - first;
+        messages_.assign(count, mmsghdr{});
+        iovecs_.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            auto& request = slots_[unsent_[first + i]].request;
+            iovecs_[i].iov_base = request.data();
+            iovecs_[i].iov_len = request.size();
+            messages_[i].msg_hdr.msg_iov = &iovecs_[i];
+            messages_[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        size_t sent{ 0 };
+        while (sent < count) {
+            const int n = sendmmsg(upstreams_[up].sockets[socket].fd, messages_.data() + sent, static_cast<unsigned>(count - sent), 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                // Query the error is reported for is failed, the rest are tried again.
+                DNS_TRACE_ERROR(UDP_SEND_FAILED, up, errno, 0);
+                if (slots_[unsent_[first + sent]].data)
+                    finish(unsent_[first + sent], DnsResolver::RESULT_CODE::NOT_RESOLVED);
+                sent++;
+                continue;
+            }
+            sent += n;
+        }
+        first = last;
+    }
+    unsent_.clear();
+}
+
+void DnsEngine::onUpstreamEvent(uint32_t index, uint32_t socket)
+{
+    auto& sock = upstreams_[index].sockets[socket];
+    while (true) {
+        const auto n = recv(sock.fd, buffer_.data(), buffer_.size(), 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
+                continue;
+            // ICMP error on the connected socket: the server is unreachable for all queries.
+            DNS_TRACE_ERROR(UDP_RECV_FAILED, index, errno, 0);
+            failUpstream(index, socket);
+            continue;
+        }
+
+        DnsMessage::Reader reader;
+        if (!reader.reset(buffer_.data(), n) || !reader.response())
+            continue;
+        const auto slot = sock.pending[reader.id()];
+        if (slot == NO_SLOT)
+            continue; // late or foreign answer
+        if (slots_[slot].tcpFd >= 0)
+            continue; // already repeated over TCP
+        if (reader.qtype() != slots_[slot].type || !reader.qname().equals(slots_[slot].name))
+            continue;
+        if (reader.truncated()) {
+            startTcp(slot);
+            continue;
+        }
+        onAnswer(slot, buffer_.data(), n);
+    }
+}
+
+void DnsEngine::startTcp(uint32_t index)
+{
+    auto& slot = slots_[index];
+    const auto& up = upstreams_[slot.upstream];
+    slot.sent = 0;
+    slot.response.clear();
+    const auto size = slot.request.size();
+    slot.request.insert(slot.request.begin(), { static_cast<uint8_t>(size >> 8), static_cast<uint8_t>(size & 0xFF) });
+
+    slot.tcpFd = socket(up.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (slot.tcpFd < 0
+        || (connect(slot.tcpFd, reinterpret_cast<const sockaddr*>(&up.addr), up.addrLen) < 0 && errno != EINPROGRESS)) {
+        DNS_TRACE_ERROR(TCP_CONNECT_FAILED, index, errno, 0);
+        finish(index, DnsResolver::RESULT_CODE::NOT_RESOLVED);
+        return;
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLOUT;
+    ev.data.u64 = tag(EVENT_TCP, index);
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, slot.tcpFd, &ev);
+
+    // TCP exchange is not retransmitted, it gets the time left of all UDP retransmissions.
+    const auto tcpTimeout = options_.retransmitTimeout * ((1 << (options_.maxRetransmits + 1)) - 1);
+    schedule(index, min(chrono::steady_clock::now() + tcpTimeout, slot.deadline));
+}
+
+void DnsEngine::onTcpEvent(uint32_t index, uint32_t events)
+{
+    auto& slot = slots_[index];
+    if (events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLIN)) {
+        DNS_TRACE_ERROR(TCP_FAILED, index, 0, 0);
+        finish(index, DnsResolver::RESULT_CODE::NOT_RESOLVED);
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        while (slot.sent < slot.request.size()) {
+            const auto n = send(slot.tcpFd, slot.request.data() + slot.sent, slot.request.size() - slot.sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return;
+                finish(index, DnsResolver::RESULT_CODE::NOT_RESOLVED);
+                return;
+            }
+            slot.sent += n;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = tag(EVENT_TCP, index);
+        epoll_ctl(epollFd_, EPOLL_CTL_MOD, slot.tcpFd, &ev);
+        return;
+    }
+
+    while (true) {
+        const auto n = recv(slot.tcpFd, buffer_.data(), buffer_.size(), 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            finish(index, DnsResolver::RESULT_CODE::NOT_RESOLVED);
+            return;
+        }
+        slot.response.insert(slot.response.end(), buffer_.data(), buffer_.data() + n);
+        if (slot.response.size() >= 2) {
+            const size_t size = (slot.response[0] << 8) | slot.response[1];
+            if (slot.response.size() >= size + 2) {
+                onAnswer(index, slot.response.data() + 2, size);
+                return;
+            }
+        }
+    }
+}
+
+void DnsEngine::onAnswer(uint32_t index, const uint8_t* buf, size_t size)
+{
+    // The answer is read in place, records are walked several times instead of being copied.
+    auto& slot = slots_[index];
+    DnsMessage::Reader reader;
+    if (!reader.reset(buf, size) || reader.id() != slot.id || !reader.qname().equals(slot.name)) {
+        finish(index, DnsResolver::RESULT_CODE::NOT_RESOLVED);
+        return;
+    }
+    if (reader.rcode() != DnsMessage::RCODE_NOERROR && reader.rcode() != DnsMessage::RCODE_NXDOMAIN) {
+        finish(index, DnsResolver::RESULT_CODE::NOT_RESOLVED); // server failure is not cached
+        return;
+    }
+
+    // CNAME chain is followed from the queried name, records of other owners are ignored.
+    DnsMessage::NameView name = reader.qname();
+    DnsMessage::RecordView rec;
+    auto ttl = slot.ttl;
+    int hops = slot.hops;
+    for (bool found = true; found && hops < MAX_CNAME_CHAIN;) {
+        found = false;
+        reader.rewind();
+        while (reader.next(rec) && reader.section() == DnsMessage::SECTION_ANSWER) {
+            if (rec.type == DnsMessage::TYPE_CNAME && rec.name == name) {
+                ttl = min(ttl, rec.ttl);
+                name = rec.target;
+                found = true;
+                hops++;
+                break;
+            }
+        }
+    }
+
+    // All addresses of the final name are returned. TTL of the answer is the smallest TTL of the chain and the addresses.
+    // Negative TTL is taken from SOA record of the authority section (RFC 2308).
+    const size_t addressSize = slot.type == DnsMessage::TYPE_A ? IpAddress::V4_SIZE : IpAddress::V6_SIZE;
+    addresses_.clear();
+    uint32_t negativeTtl{ 0 };
+    reader.rewind();
+    while (reader.next(rec) && reader.section() != DnsMessage::SECTION_ADDITIONAL) {
+        if (reader.section() == DnsMessage::SECTION_AUTHORITY) {
+            if (rec.type == DnsMessage::TYPE_SOA)
+                negativeTtl = min(rec.ttl, rec.minimum);
+        }
+        else if (rec.type == slot.type && rec.rdataSize == addressSize && rec.name == name) {
+            ttl = min(ttl, rec.ttl);
+            addresses_.emplace_back(rec.rdata, rec.rdataSize);
+        }
+    }
+    if (reader.malformed() && reader.section() != DnsMessage::SECTION_ADDITIONAL) {
+        finish(index, DnsResolver::RESULT_CODE::NOT_RESOLVED);
+        return;
+    }
+    if (!addresses_.empty()) {
+        finish(index, DnsResolver::RESULT_CODE::SUCCESS, ttl);
+        return;
+    }
+
+    // Server did not follow the chain (no SOA means it is not NODATA of the target), so the target is queried.
+    if (hops > slot.hops && reader.rcode() == DnsMessage::RCODE_NOERROR && !negativeTtl && hops < MAX_CNAME_CHAIN) {
+        slot.hops = hops;
+        restart(index, name.toString(), ttl);
+        return;
+    }
+    finish(index, DnsResolver::RESULT_CODE::NOT_RESOLVED, min(ttl, negativeTtl ? negativeTtl : DEFAULT_NEGATIVE_TTL));
+}
+
+void DnsEngine::restart(uint32_t index, string&& name, uint32_t ttl)
+{
+    auto& slot = slots_[index];
+    auto& socket = upstreams_[slot.upstream].sockets[slot.socket];
+    const auto id = newId(socket);
+    if (!DnsMessage::buildQuery(id, name, slot.type, slot.request)) {
+        finish(index, DnsResolver::RESULT_CODE::NOT_RESOLVED);
+        return;
+    }
+    if (slot.tcpFd >= 0) {
+        epoll_ctl(epollFd_, EPOLL_CTL_DEL, slot.tcpFd, nullptr);
+        close(slot.tcpFd);
+        slot.tcpFd = -1;
+    }
+    socket.pending[slot.id] = NO_SLOT;
+    socket.pending[id] = index;
+    slot.id = id;
+    slot.name = move(name);
+    slot.ttl = ttl;
+    slot.rto = options_.retransmitTimeout;
+    slot.retransmits = 0;
+    schedule(index, min(chrono::steady_clock::now() + slot.rto, slot.deadline));
+    queue(index);
+}
+
+void DnsEngine::failUpstream(uint32_t index, uint32_t socket)
+{
+    vector<uint32_t> failed;
+    const auto& sock = upstreams_[index].sockets[socket];
+    const auto& pending = sock.pending;
+    for (size_t id = 0; id < pending.size() && failed.size() < sock.pendingCount; ++id) {
+        if (pending[id] != NO_SLOT && slots_[pending[id]].tcpFd < 0)
+            failed.push_back(pending[id]);
+    }
+    for (const auto slot : failed)
+        finish(slot, DnsResolver::RESULT_CODE::NOT_RESOLVED);
+}
+
+void DnsEngine::finish(uint32_t index, DnsResolver::RESULT_CODE code, uint32_t ttl)
+{
+    const auto ind = slots_[index].ind;
+    auto data = release(index);
+    if (code == DnsResolver::RESULT_CODE::SUCCESS)
+        data->onIpResolved(ind, addresses_.data(), addresses_.size(), ttl);
+    else
+        data->onError(ind, code, ttl);
+}
+
+DataPtr DnsEngine::release(uint32_t index)
+{
+    auto& slot = slots_[index];
+    if (slot.tcpFd >= 0) {
+        epoll_ctl(epollFd_, EPOLL_CTL_DEL, slot.tcpFd, nullptr);
+        close(slot.tcpFd);
+        slot.tcpFd = -1;
+    }
+    auto& socket = upstreams_[slot.upstream].sockets[slot.socket];
+    socket.pending[slot.id] = NO_SLOT;
+    socket.pendingCount--;
+    if (slot.data->cancellable())
+        cancellable_.erase(QueryKey{ slot.data.get(), slot.ind });
+    inFlight_.fetch_sub(1, memory_order_relaxed);
+
+    auto data = move(slot.data);
+    slot.data = nullptr;
+    slot.generation++;
+    freeSlots_.push_back(index);
+    return data;
+}
+
+unique_ptr<DnsTransport> DnsTransport::createDefault()
+{
+    return make_unique<DnsEngine>();
+}
+
+#endif
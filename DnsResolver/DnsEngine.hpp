@@ -0,0 +1,271 @@
+#pragma once
+
+#ifdef __linux__
+
+#include "DnsTransport.hpp"
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace Windscribe {
+
+/**
+* Long-lived resolver engine built on epoll.
+* Keeps a few UDP sockets per upstream DNS server, each with its own source port, and multiplexes all in-flight queries
+* on them by DNS transaction ID. Sockets and IDs are chosen at random by the kernel CSPRNG, so answers are hard to spoof.
+* All sockets are served and all Data objects are completed by the single I/O thread.
+* Truncated answers are repeated over TCP.
+* CNAME chains are followed: if the answer ends in a CNAME without addresses, the query is repeated for its target.
+* Lost UDP queries are retransmitted with exponential backoff until the deadline of the lookup.
+* Timeouts are kept in the hashed timing wheel, so they cost O(1) per query.
+*/
+class DnsEngine : public DnsTransport
+{
+public:
+
+    struct Options {
+        /** Time to wait for the answer before the first retransmission. Doubled after every retransmission. */
+        chrono::milliseconds retransmitTimeout{ 400 };
+
+        /** Number of retransmissions after which the query times out. */
+        int maxRetransmits{ 3 };
+    };
+
+    DnsEngine();
+    explicit DnsEngine(const Options& options);
+    ~DnsEngine() override;
+
+    DnsEngine(const DnsEngine&) = delete;
+    DnsEngine& operator=(const DnsEngine&) = delete;
+
+    void Query(const wstring& host, const wstring& dns, DataPtr data, int ind) override;
+
+    /** Submits all requests under one lock and wakes up the I/O thread once. */
+    void Query(vector<Request>& requests) override;
+
+    void Cancel(const DataPtr& data, int ind) override;
+
+    void Expedite(const DataPtr& data, int ind) override;
+
+    size_t inFlight() const override { return inFlight_.load(memory_order_relaxed); }
+
+private:
+    /** Marks transaction ID not used by any slot. */
+    static const uint32_t NO_SLOT{ UINT32_MAX };
+
+    /** Query submitted by the caller thread and not started yet. Host and server are taken from data. */
+    struct Submission {
+        DataPtr data;
+        int ind{ 0 };
+
+        /** Time the query is started at. Default value means right away. */
+        chrono::steady_clock::time_point due;
+    };
+
+    /** Orders delayed submissions by due time, the earliest on top. */
+    struct LaterDue {
+        bool operator()(const Submission& a, const Submission& b) const { return a.due > b.due; }
+    };
+
+    /** UDP socket of the upstream bound to its own source port. */
+    struct Socket {
+        int fd{ -1 };
+
+        /** Transaction ID -> index of the slot waiting for the answer or NO_SLOT. Flat, so lookups do not allocate. */
+        vector<uint32_t> pending = vector<uint32_t>(UINT16_MAX + 1, NO_SLOT);
+        size_t pendingCount{ 0 };
+    };
+
+    /** Upstream DNS server and its UDP sockets shared by all queries to it. */
+    struct Upstream {
+        string name;
+        sockaddr_storage addr{};
+        socklen_t addrLen{ 0 };
+        vector<Socket> sockets;
+    };
+
+    /** State of the single in-flight query. Slots are reused, so buffers keep their capacity. */
+    struct Slot {
+        DataPtr data;
+        int ind{ 0 };
+        uint32_t upstream{ 0 };
+        uint32_t socket{ 0 };
+        uint16_t id{ 0 };
+        uint16_t type{ 0 };
+        string name;
+        vector<uint8_t> request;
+
+        /** Number of CNAMEs the query was restarted for and the smallest TTL of them. */
+        int hops{ 0 };
+        uint32_t ttl{ UINT32_MAX };
+
+        /** State of the TCP exchange after truncated UDP answer. */
+        int tcpFd{ -1 };
+        size_t sent{ 0 };
+        vector<uint8_t> response;
+
+        /** Deadline of the lookup, current retransmission timeout and number of retransmissions done. */
+        chrono::steady_clock::time_point deadline;
+        chrono::milliseconds rto{ 0 };
+        int retransmits{ 0 };
+
+        /** Tick of the timer of the slot. Entries of the wheel with other tick are stale. */
+        uint64_t timerTick{ 0 };
+
+        /** Incremented when the slot is released, so entries of the wheel left from the previous query are stale. */
+        uint32_t generation{ 0 };
+
+        /** True while the slot is in unsent_, so it is queued once however many times it is restarted or retransmitted. */
+        bool unsent{ false };
+    };
+
+    /** Entry of the timing wheel. */
+    struct Timer {
+        uint32_t slot;
+        uint32_t generation;
+        uint64_t tick;
+    };
+
+    /** I/O thread loop. */
+    void run();
+
+    /** Starts next burst of queries submitted by the callers. */
+    void startSubmitted();
+
+    /** Starts delayed queries which are due. */
+    void startDelayed();
+
+    /** Releases slots of the queries cancelled by the callers. */
+    void cancelSubmitted();
+
+    /** Returns epoll timeout in milliseconds until the next delayed query or the next tick of the wheel. */
+    int timeout() const;
+
+    /** Returns tick of the wheel the time belongs to. */
+    uint64_t tickOf(chrono::steady_clock::time_point time) const;
+
+    /** Schedules timer of the slot. Previous timer of the slot becomes stale. */
+    void schedule(uint32_t slot, chrono::steady_clock::time_point time);
+
+    /** Fires timers of the ticks passed since the last call. */
+    void expireTimers();
+
+    /** Retransmits query of the slot or times it out. */
+    void onTimer(uint32_t slot);
+
+    /** Prepares single query. Query is sent by flush(). */
+    void start(Submission& sub);
+
+    /** Adds the slot to the queries sent by the next flush() unless it is there already. */
+    void queue(uint32_t slot);
+
+    /** Sends all prepared queries. Queries to the same upstream are sent by one sendmmsg() call.
+    * Slots released after they were queued are skipped.
+    */
+    void flush();
+
+    /** Returns index of the upstream for the server address or -1 if address is invalid. */
+    int upstream(const wstring& server);
+
+    /** Reads all available answers of the socket of the upstream. */
+    void onUpstreamEvent(uint32_t upstream, uint32_t socket);
+
+    /** Repeats query over TCP after truncated UDP answer. */
+    void startTcp(uint32_t slot);
+
+    void onTcpEvent(uint32_t slot, uint32_t events);
+
+    /** Handles complete answer of the slot. */
+    void onAnswer(uint32_t slot, const uint8_t* buf, size_t size);
+
+    /** Repeats query of the slot for the target of the CNAME chain over UDP.
+    * @param ttl The smallest TTL of the chain followed so far.
+    */
+    void restart(uint32_t slot, string&& name, uint32_t ttl);
+
+    /** Returns random transaction ID not used by other queries sent from the socket. The socket must not be full. */
+    uint16_t newId(const Socket& socket);
+
+    /** Returns 16 random bits of the kernel CSPRNG. Bits are read in batches, so most calls make no system call. */
+    uint16_t random();
+
+    /** Fails all queries waiting for the answer on the socket of the upstream. */
+    void failUpstream(uint32_t upstream, uint32_t socket);
+
+    /** Releases the slot and reports the result.
+    * Addresses of the successful query are taken from addresses_.
+    */
+    void finish(uint32_t slot, DnsResolver::RESULT_CODE code, uint32_t ttl = 0);
+
+    /** Releases the slot without reporting the result. Returns Data of the slot. */
+    DataPtr release(uint32_t slot);
+
+    uint32_t allocateSlot();
+
+    int epollFd_{ -1 };
+    int wakeFd_{ -1 };
+    string systemServer_;
+
+    /** Queries submitted by the callers but not started yet. */
+    mutex mutex_;
+    vector<Submission> submitted_;
+
+    /** Buffer swapped with submitted_ by the I/O thread and position of the next query to start in it. */
+    vector<Submission> starting_;
+    size_t startingPos_{ 0 };
+
+    /** Queries cancelled by the callers. Guarded by mutex_. */
+    vector<QueryKey> cancelled_;
+
+    /** Queries waiting for their due time. */
+    priority_queue<Submission, vector<Submission>, LaterDue> delayed_;
+
+    Options options_;
+
+    /** Hashed timing wheel: bucket per tick, timers further than the wheel size wait for the next round. */
+    vector<vector<Timer>> wheel_;
+    chrono::steady_clock::time_point wheelStart_;
+    uint64_t tick_{ 0 };
+    size_t timersCount_{ 0 };
+
+    /** Slots of the cancellable queries in flight. */
+    unordered_map<QueryKey, uint32_t, QueryKeyHash> cancellable_;
+
+    /** State below is accessed only by the I/O thread. */
+    vector<Upstream> upstreams_;
+    unordered_map<wstring, uint32_t> upstreamIndex_;
+    vector<Slot> slots_;
+    vector<uint32_t> freeSlots_;
+    vector<uint8_t> buffer_;
+
+    /** Random numbers read from the kernel and position of the next one. */
+    vector<uint16_t> randoms_;
+    size_t randomsPos_{ 0 };
+
+    /** Addresses of the answer being handled. Kept to reuse the buffer. */
+    vector<IpAddress> addresses_;
+
+    /** Slots prepared by start() and not sent yet. */
+    vector<uint32_t> unsent_;
+    vector<mmsghdr> messages_;
+    vector<iovec> iovecs_;
+
+    atomic<size_t> inFlight_{ 0 };
+    atomic_bool stop_{ false };
+    thread thread_;
+};
+
+}
+
+#endif
@@ -0,0 +1,142 @@
+#include "DnsHosts.hpp"
+#include "DnsMessage.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+using namespace Windscribe;
+
+namespace {
+
+/** Addresses of one type kept per name. The rest are ignored. */
+const size_t MAX_ADDRESSES{ numeric_limits<uint16_t>::max() };
+
+}
+
+bool DnsHosts::Builder::add(const string& name, const IpAddress& address)
+{
+    if (address.family() == IpAddress::FAMILY::NONE)
+        return false;
+    const auto normalized = DnsMessage::normalize(name);
+    if (normalized.empty() || normalized.size() > numeric_limits<uint16_t>::max())
+        return false;
+    for (const auto c : normalized) {
+        if (static_cast<unsigned char>(c) > 0x7F)
+            return false;
+    }
+    auto& entry = entries_[normalized];
+    auto& list = address.family() == IpAddress::FAMILY::V4 ? entry.v4 : entry.v6;
+    if (list.size() < MAX_ADDRESSES && std::find(list.begin(), list.end(), address) == list.end())
+        list.push_back(address);
+    return true;
+}
+
+size_t DnsHosts::Builder::parse(istream& in)
+{
+    size_t invalid{ 0 };
+    string line, text, name;
+    while (getline(in, line)) {
+        const auto comment = line.find('#');
+        if (comment != string::npos)
+            line.resize(comment);
+        istringstream words(line);
+        if (!(words >> text))
+            continue; // empty or comment line
+        IpAddress address;
+        bool valid = IpAddress::parse(text, address);
+        bool named{ false };
+        while (valid && words >> name) {
+            valid = add(name, address);
+            named = true;
+        }
+        if (!valid || !named)
+            invalid++;
+    }
+    return invalid;
+}
+
+unique_ptr<const DnsHosts> DnsHosts::Builder::build()
+{
+    unique_ptr<DnsHosts> res(new DnsHosts());
+    size_t capacity{ 16 };
+    while (capacity < entries_.size() * 2)
+        capacity <<= 1;
+    res->slots_.resize(capacity);
+    res->size_ = entries_.size();
+
+    size_t namesSize{ 0 }, addressesSize{ 0 };
+    for (const auto& entry : entries_) {
+        namesSize += entry.first.size();
+        addressesSize += entry.second.v4.size() + entry.second.v6.size();
+    }
+    res->names_.reserve(namesSize);
+    res->addresses_.reserve(addressesSize);
+
+    for (const auto& entry : entries_) {
+        const auto& name = entry.first;
+        const auto h = hash(name.data(), name.size());
+        auto pos = h & (capacity - 1);
+        while (res->slots_[pos].nameSize)
+            pos = (pos + 1) & (capacity - 1);
+        auto& slot = res->slots_[pos];
+        slot.hash = h;
+        slot.name = static_cast<uint32_t>(res->names_.size());
+        slot.nameSize = static_cast<uint16_t>(name.size());
+        slot.addresses = static_cast<uint32_t>(res->addresses_.size());
+        slot.v4Count = static_cast<uint16_t>(entry.second.v4.size());
+        slot.v6Count = static_cast<uint16_t>(entry.second.v6.size());
+        res->names_ += name;
+        res->addresses_.insert(res->addresses_.end(), entry.second.v4.begin(), entry.second.v4.end());
+        res->addresses_.insert(res->addresses_.end(), entry.second.v6.begin(), entry.second.v6.end());
+    }
+    entries_.clear();
+    return res;
+}
+
+unique_ptr<const DnsHosts> DnsHosts::load(const string& path)
+{
+    ifstream in(path);
+    if (!in)
+        return nullptr;
+    Builder builder;
+    builder.parse(in);
+    return builder.build();
+}
+
+uint64_t DnsHosts::hash(const char* name, size_t size)
+{
+    // FNV-1a: names are short, so it is faster than hashing by blocks.
+    uint64_t res{ 0xcbf29ce484222325ULL };
+    for (size_t i = 0; i < size; ++i) {
+        res ^= static_cast<uint8_t>(name[i]);
+        res *= 0x100000001b3ULL;
+    }
+    return res;
+}
+
+bool DnsHosts::find(const string& name, uint16_t type, const IpAddress*& addresses, size_t& count) const
+{
+    if (!size_ || name.empty())
+        return false;
+    const auto h = hash(name.data(), name.size());
+    const auto mask = slots_.size() - 1;
+    for (auto pos = h & mask;; pos = (pos + 1) & mask) {
+        const auto& slot = slots_[pos];
+        if (!slot.nameSize)
+            return false;
+        if (slot.hash != h || slot.nameSize != name.size() || memcmp(names_.data() + slot.name, name.data(), name.size()) != 0)
+            continue;
+        if (type == DnsMessage::TYPE_AAAA) {
+            addresses = addresses_.data() + slot.addresses + slot.v4Count;
+            count = slot.v6Count;
+        }
+        else {
+            addresses = addresses_.data() + slot.addresses;
+            count = type == DnsMessage::TYPE_A ? slot.v4Count : 0;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "IpAddress.hpp"
+
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace Windscribe {
+
+/**
+* Immutable index of the static addresses of hosts files and zones, consulted before any query is sent.
+* Names are normalized and stored once in one buffer, addresses of every name are consecutive.
+* Slots of the open addressing table keep the hash and offsets only, so lookup compares few slots and does not allocate.
+*/
+class DnsHosts
+{
+public:
+    /** Collects names and addresses, then builds the index. */
+    class Builder
+    {
+    public:
+        /** Adds address of the name. Returns false if the name is empty or not ASCII. */
+        bool add(const string& name, const IpAddress& address);
+
+        /** Adds entries of the hosts file: address followed by names separated by spaces, # starts comment.
+        * @return Number of lines which are not valid and are skipped.
+        */
+        size_t parse(istream& in);
+
+        /** Builds the index and clears the builder. */
+        unique_ptr<const DnsHosts> build();
+
+    private:
+        struct Addresses {
+            vector<IpAddress> v4;
+            vector<IpAddress> v6;
+        };
+
+        unordered_map<string, Addresses> entries_;
+    };
+
+    /** Loads the hosts file. Returns nullptr if the file can't be read. */
+    static unique_ptr<const DnsHosts> load(const string& path);
+
+    /** Finds addresses of the name.
+    * @param name Normalized name, see DnsMessage::normalize().
+    * @param type DnsMessage::TYPE_A or TYPE_AAAA.
+    * @param addresses Addresses of the type, count of them. Count is zero if the name has addresses of the other type only.
+    * @return false if the name is not in the index.
+    */
+    bool find(const string& name, uint16_t type, const IpAddress*& addresses, size_t& count) const;
+
+    /** Number of names. */
+    size_t size() const { return size_; }
+
+private:
+    struct Slot {
+        uint64_t hash{ 0 };
+        uint32_t name{ 0 };
+
+        /** Zero size marks the empty slot, names are never empty. */
+        uint16_t nameSize{ 0 };
+        uint16_t v4Count{ 0 };
+        uint32_t addresses{ 0 };
+        uint16_t v6Count{ 0 };
+    };
+
+    DnsHosts() = default;
+
+    static uint64_t hash(const char* name, size_t size);
+
+    vector<Slot> slots_;
+    string names_;
+    vector<IpAddress> addresses_;
+    size_t size_{ 0 };
+};
+
+}
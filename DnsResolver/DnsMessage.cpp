@@ -0,0 +1,544 @@
+#include "DnsMessage.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace Windscribe;
+
+namespace {
+
+/** Maximum number of compression pointers followed in one name. Protects from loops. */
+const int MAX_POINTERS{ 16 };
+
+uint16_t get16(const uint8_t* p)
+{
+    return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+uint32_t get32(const uint8_t* p)
+{
+    return (static_cast<uint32_t>(get16(p)) << 16) | get16(p + 2);
+}
+
+void set16(uint8_t* p, uint16_t v)
+{
+    p[0] = static_cast<uint8_t>(v >> 8);
+    p[1] = static_cast<uint8_t>(v & 0xFF);
+}
+
+char lower(uint8_t c)
+{
+    return static_cast<char>(c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+}
+
+/** Letters, digits, hyphen and underscore used by service names (RFC 2782). */
+bool validLabelChar(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+}
+
+/** Walks labels of the name following compression pointers. */
+struct Labels {
+    const uint8_t* buf;
+    size_t size;
+    size_t cur;
+    int pointers{ 0 };
+    bool error{ false };
+
+    /** Returns the next label. Returns false at the end of the name or if the name is malformed, see error.
+    * Default NameView, e.g. the question of the message without one, is the empty name.
+    */
+    bool next(const uint8_t*& label, uint8_t& len) {
+        if (!buf)
+            return false;
+        while (true) {
+            if (cur >= size)
+                return fail();
+            const uint8_t b = buf[cur];
+            if ((b & 0xC0) == 0xC0) {
+                if (cur + 1 >= size || ++pointers > MAX_POINTERS)
+                    return fail();
+                cur = ((b & 0x3F) << 8) | buf[cur + 1];
+                continue;
+            }
+            if (b & 0xC0)
+                return fail();
+            if (b == 0)
+                return false;
+            if (cur + 1 + b > size)
+                return fail();
+            label = buf + cur + 1;
+            len = b;
+            cur += b + 1;
+            return true;
+        }
+    }
+
+    bool fail() {
+        error = true;
+        return false;
+    }
+};
+
+/** Checks possibly compressed name starting at pos. On success pos points right after the name. */
+bool skipName(const uint8_t* buf, size_t size, size_t& pos)
+{
+    size_t cur{ pos };
+    size_t next{ 0 };
+    size_t encoded{ 1 };
+    int pointers{ 0 };
+    while (true) {
+        if (cur >= size)
+            return false;
+        const uint8_t len = buf[cur];
+        if ((len & 0xC0) == 0xC0) {
+            if (cur + 1 >= size || ++pointers > MAX_POINTERS)
+                return false;
+            if (!next)
+                next = cur + 2;
+            cur = ((len & 0x3F) << 8) | buf[cur + 1];
+            continue;
+        }
+        if (len & 0xC0)
+            return false;
+        if (len == 0) {
+            pos = next ? next : cur + 1;
+            return true;
+        }
+        encoded += len + 1;
+        if (cur + 1 + len > size || encoded > DnsMessage::MAX_NAME_SIZE)
+            return false;
+        cur += len + 1;
+    }
+}
+
+/** Checks labels of the dotted name without trailing dot. */
+bool validName(const char* name, size_t size)
+{
+    if (size + 2 > DnsMessage::MAX_NAME_SIZE)
+        return false;
+    size_t label{ 0 };
+    for (size_t i = 0; i < size; ++i) {
+        if (name[i] == '.') {
+            if (!label)
+                return false;
+            label = 0;
+            continue;
+        }
+        if (!validLabelChar(name[i]) || ++label > DnsMessage::MAX_LABEL_SIZE)
+            return false;
+    }
+    return size == 0 || label != 0;
+}
+
+}
+
+bool DnsMessage::NameView::equals(const char* name, size_t size) const
+{
+    if (size && name[size - 1] == '.')
+        --size;
+    Labels labels{ buf_, size_, offset_ };
+    const uint8_t* label{ nullptr };
+    uint8_t len{ 0 };
+    size_t pos{ 0 };
+    bool first{ true };
+    while (labels.next(label, len)) {
+        if (!first) {
+            if (pos >= size || name[pos] != '.')
+                return false;
+            ++pos;
+        }
+        first = false;
+        if (pos + len > size)
+            return false;
+        for (uint8_t i = 0; i < len; ++i) {
+            if (lower(label[i]) != lower(static_cast<uint8_t>(name[pos + i])))
+                return false;
+        }
+        pos += len;
+    }
+    return !labels.error && pos == size;
+}
+
+bool DnsMessage::NameView::operator==(const NameView& other) const
+{
+    Labels a{ buf_, size_, offset_ };
+    Labels b{ other.buf_, other.size_, other.offset_ };
+    const uint8_t* labelA{ nullptr };
+    const uint8_t* labelB{ nullptr };
+    uint8_t lenA{ 0 }, lenB{ 0 };
+    while (true) {
+        const bool hasA = a.next(labelA, lenA);
+        const bool hasB = b.next(labelB, lenB);
+        if (!hasA || !hasB)
+            return !hasA && !hasB && !a.error && !b.error;
+        if (lenA != lenB)
+            return false;
+        for (uint8_t i = 0; i < lenA; ++i) {
+            if (lower(labelA[i]) != lower(labelB[i]))
+                return false;
+        }
+    }
+}
+
+size_t DnsMessage::NameView::copy(char* out, size_t capacity) const
+{
+    Labels labels{ buf_, size_, offset_ };
+    const uint8_t* label{ nullptr };
+    uint8_t len{ 0 };
+    size_t pos{ 0 };
+    while (labels.next(label, len)) {
+        if (pos + len + (pos ? 1 : 0) > capacity)
+            return SIZE_MAX;
+        if (pos)
+            out[pos++] = '.';
+        for (uint8_t i = 0; i < len; ++i)
+            out[pos++] = lower(label[i]);
+    }
+    return labels.error ? SIZE_MAX : pos;
+}
+
+string DnsMessage::NameView::toString() const
+{
+    char buf[MAX_NAME_SIZE];
+    const auto size = copy(buf, sizeof(buf));
+    return size == SIZE_MAX ? string() : string(buf, size);
+}
+
+bool DnsMessage::Reader::reset(const uint8_t* buf, size_t size)
+{
+    buf_ = buf;
+    size_ = size;
+    qname_ = NameView();
+    qtype_ = 0;
+    if (size < HEADER_SIZE)
+        return false;
+
+    id_ = get16(buf);
+    flags_ = get16(buf + 2);
+    const auto qdCount = get16(buf + 4);
+    for (int i = 0; i < 3; ++i)
+        counts_[i] = get16(buf + 6 + 2 * i);
+
+    pos_ = HEADER_SIZE;
+    if (qdCount != 1) {
+        if (qdCount != 0 || !truncated())
+            return false;
+    }
+    else {
+        const auto start = pos_;
+        if (!skipName(buf, size, pos_) || pos_ + 4 > size)
+            return false;
+        qname_ = NameView(buf, size, start);
+        qtype_ = get16(buf + pos_);
+        pos_ += 4;
+    }
+    recordsStart_ = pos_;
+    rewind();
+    return true;
+}
+
+void DnsMessage::Reader::rewind()
+{
+    pos_ = recordsStart_;
+    section_ = SECTION_ANSWER;
+    left_ = counts_[SECTION_ANSWER];
+    malformed_ = false;
+}
+
+bool DnsMessage::Reader::next(RecordView& rec)
+{
+    if (malformed_)
+        return false;
+    while (!left_) {
+        if (section_ == SECTION_ADDITIONAL)
+            return false;
+        section_ = static_cast<SECTION>(section_ + 1);
+        left_ = counts_[section_];
+    }
+
+    auto fail = [this]() {
+        malformed_ = true;
+        return false;
+    };
+    const auto start = pos_;
+    if (!skipName(buf_, size_, pos_) || pos_ + 10 > size_)
+        return fail();
+    rec.name = NameView(buf_, size_, start);
+    rec.type = get16(buf_ + pos_);
+    rec.rclass = get16(buf_ + pos_ + 2);
+    rec.ttl = get32(buf_ + pos_ + 4);
+    rec.rdataSize = get16(buf_ + pos_ + 8);
+    pos_ += 10;
+    const size_t end = pos_ + rec.rdataSize;
+    if (end > size_)
+        return fail();
+    rec.rdata = buf_ + pos_;
+    rec.target = NameView();
+    rec.minimum = 0;
+
+    // Names inside the data must end within the data.
+    size_t namePos{ pos_ };
+    if (rec.type == TYPE_CNAME) {
+        if (!skipName(buf_, end, namePos))
+            return fail();
+        rec.target = NameView(buf_, end, pos_);
+    }
+    else if (rec.type == TYPE_SOA) {
+        // MNAME and RNAME are followed by SERIAL, REFRESH, RETRY, EXPIRE and MINIMUM.
+        if (!skipName(buf_, end, namePos) || !skipName(buf_, end, namePos) || namePos + 20 > end)
+            return fail();
+        rec.minimum = get32(buf_ + namePos + 16);
+    }
+    pos_ = end;
+    left_--;
+    return true;
+}
+
+bool DnsMessage::Writer::put16(uint16_t v)
+{
+    if (pos_ + 2 > capacity_)
+        return false;
+    set16(buf_ + pos_, v);
+    pos_ += 2;
+    return true;
+}
+
+bool DnsMessage::Writer::put32(uint32_t v)
+{
+    if (pos_ + 4 > capacity_)
+        return false;
+    set16(buf_ + pos_, static_cast<uint16_t>(v >> 16));
+    set16(buf_ + pos_ + 2, static_cast<uint16_t>(v & 0xFFFF));
+    pos_ += 4;
+    return true;
+}
+
+bool DnsMessage::Writer::name(const char* name, size_t size)
+{
+    if (size && name[size - 1] == '.')
+        --size;
+    if (!validName(name, size))
+        return false;
+
+    // The longest suffix already written is replaced by the pointer to it.
+    size_t suffix{ size };
+    uint16_t pointer{ 0 };
+    for (size_t start = 0; start < size && suffix == size; ) {
+        for (int i = 0; i < labelsCount_; ++i) {
+            if (NameView(buf_, pos_, labels_[i]).equals(name + start, size - start)) {
+                suffix = start;
+                pointer = labels_[i];
+                break;
+            }
+        }
+        const auto dot = static_cast<const char*>(memchr(name + start, '.', size - start));
+        start = dot ? dot - name + 1 : size;
+    }
+
+    const size_t encoded = suffix == size ? size + (size ? 2 : 1) : suffix + 2;
+    if (pos_ + encoded > capacity_)
+        return false;
+    size_t start{ 0 };
+    while (start < suffix) {
+        const auto dot = static_cast<const char*>(memchr(name + start, '.', size - start));
+        const size_t end = dot ? dot - name : size;
+        if (pos_ < 0x4000 && labelsCount_ < MAX_LABELS)
+            labels_[labelsCount_++] = static_cast<uint16_t>(pos_);
+        buf_[pos_++] = static_cast<uint8_t>(end - start);
+        memcpy(buf_ + pos_, name + start, end - start);
+        pos_ += end - start;
+        start = end + 1;
+    }
+    if (suffix == size)
+        buf_[pos_++] = 0;
+    else
+        put16(0xC000 | pointer);
+    return true;
+}
+
+bool DnsMessage::Writer::header(uint16_t id, uint16_t flags, uint8_t rcode)
+{
+    pos_ = 0;
+    labelsCount_ = 0;
+    answers_ = 0;
+    if (capacity_ < HEADER_SIZE)
+        return false;
+    put16(id);
+    put16(static_cast<uint16_t>((flags & ~0x0F) | (rcode & 0x0F)));
+    for (int i = 0; i < 4; ++i)
+        put16(0);
+    questionEnd_ = pos_;
+    return true;
+}
+
+bool DnsMessage::Writer::question(const char* name, size_t size, uint16_t type)
+{
+    const auto pos = pos_;
+    const auto labels = labelsCount_;
+    if (!this->name(name, size) || !put16(type) || !put16(CLASS_IN)) {
+        pos_ = pos;
+        labelsCount_ = labels;
+        return false;
+    }
+    set16(buf_ + 4, get16(buf_ + 4) + 1);
+    questionEnd_ = pos_;
+    return true;
+}
+
+bool DnsMessage::Writer::recordHeader(const string& name, uint16_t type, uint32_t ttl)
+{
+    return this->name(name.data(), name.size()) && put16(type) && put16(CLASS_IN) && put32(ttl);
+}
+
+bool DnsMessage::Writer::answer(const string& name, uint16_t type, uint32_t ttl, const uint8_t* rdata, size_t rdataSize)
+{
+    const auto pos = pos_;
+    const auto labels = labelsCount_;
+    if (rdataSize > UINT16_MAX || !recordHeader(name, type, ttl) || !put16(static_cast<uint16_t>(rdataSize)) || pos_ + rdataSize > capacity_) {
+        pos_ = pos;
+        labelsCount_ = labels;
+        return false;
+    }
+    if (rdataSize)
+        memcpy(buf_ + pos_, rdata, rdataSize);
+    pos_ += rdataSize;
+    set16(buf_ + 6, ++answers_);
+    return true;
+}
+
+bool DnsMessage::Writer::cname(const string& name, uint32_t ttl, const string& target)
+{
+    const auto pos = pos_;
+    const auto labels = labelsCount_;
+    size_t lenPos{ 0 };
+    if (!recordHeader(name, TYPE_CNAME, ttl) || (lenPos = pos_, !put16(0)) || !this->name(target.data(), target.size())) {
+        pos_ = pos;
+        labelsCount_ = labels;
+        return false;
+    }
+    set16(buf_ + lenPos, static_cast<uint16_t>(pos_ - lenPos - 2));
+    set16(buf_ + 6, ++answers_);
+    return true;
+}
+
+void DnsMessage::Writer::truncate()
+{
+    pos_ = questionEnd_;
+    answers_ = 0;
+    set16(buf_ + 6, 0);
+    buf_[2] |= FLAG_TRUNCATED >> 8;
+    while (labelsCount_ && labels_[labelsCount_ - 1] >= pos_)
+        labelsCount_--;
+}
+
+bool DnsMessage::build(const Message& msg, vector<uint8_t>& out, size_t maxSize)
+{
+    // Answers are written in full and dropped if they do not fit maxSize, the question is always kept.
+    size_t bound{ MAX_QUERY_SIZE };
+    for (const auto& rec : msg.answers)
+        bound += MAX_NAME_SIZE + 10 + (rec.type == TYPE_CNAME ? MAX_NAME_SIZE : rec.address.size());
+    out.resize(bound);
+
+    uint16_t flags{ 0 };
+    if (msg.response)
+        flags |= FLAG_RESPONSE | FLAG_RECURSION_AVAILABLE;
+    if (msg.truncated)
+        flags |= FLAG_TRUNCATED;
+    if (msg.recursionDesired)
+        flags |= FLAG_RECURSION_DESIRED;
+    Writer writer(out.data(), out.size());
+    if (!writer.header(msg.id, flags, msg.rcode) || !writer.question(msg.qname, msg.qtype))
+        return false;
+    for (const auto& rec : msg.answers) {
+        const bool written = rec.type == TYPE_CNAME
+            ? writer.cname(rec.name, rec.ttl, rec.target)
+            : writer.answer(rec.name, rec.type, rec.ttl, rec.address.data(), rec.address.size());
+        if (!written)
+            return false;
+    }
+    if (writer.size() > maxSize)
+        writer.truncate();
+    out.resize(writer.size());
+    return true;
+}
+
+size_t DnsMessage::writeQuery(uint16_t id, const char* name, size_t size, uint16_t type, uint8_t* out, size_t capacity)
+{
+    Writer writer(out, capacity);
+    if (!writer.header(id, FLAG_RECURSION_DESIRED) || !writer.question(name, size, type))
+        return 0;
+    return writer.size();
+}
+
+bool DnsMessage::buildQuery(uint16_t id, const string& name, uint16_t type, vector<uint8_t>& out)
+{
+    out.resize(MAX_QUERY_SIZE);
+    const auto size = writeQuery(id, name.data(), name.size(), type, out.data(), out.size());
+    out.resize(size);
+    return size != 0;
+}
+
+bool DnsMessage::parse(const uint8_t* buf, size_t size, Message& msg)
+{
+    Reader reader;
+    if (!reader.reset(buf, size))
+        return false;
+
+    msg.id = reader.id();
+    msg.response = reader.response();
+    msg.truncated = reader.truncated();
+    msg.recursionDesired = reader.recursionDesired();
+    msg.rcode = reader.rcode();
+    msg.qname = reader.qname().toString();
+    msg.qtype = reader.qtype();
+    msg.answers.clear();
+    msg.negativeTtl = 0;
+
+    RecordView rec;
+    while (reader.next(rec) && reader.section() != SECTION_ADDITIONAL) {
+        if (reader.section() == SECTION_AUTHORITY) {
+            if (rec.type == TYPE_SOA)
+                msg.negativeTtl = min(rec.ttl, rec.minimum);
+            continue;
+        }
+        // Unknown record types and addresses of wrong size are skipped.
+        Record res;
+        if ((rec.type == TYPE_A && rec.rdataSize == 4) || (rec.type == TYPE_AAAA && rec.rdataSize == 16))
+            res.address.assign(rec.rdata, rec.rdata + rec.rdataSize);
+        else if (rec.type == TYPE_CNAME)
+            res.target = rec.target.toString();
+        else
+            continue;
+        res.name = rec.name.toString();
+        res.type = rec.type;
+        res.ttl = rec.ttl;
+        msg.answers.emplace_back(move(res));
+    }
+    // Additional section is not used, so it does not have to be well formed.
+    return !reader.malformed() || reader.section() == SECTION_ADDITIONAL;
+}
+
+string DnsMessage::normalize(const string& name)
+{
+    string res;
+    res.reserve(name.size());
+    for (const auto c : name)
+        res += lower(static_cast<uint8_t>(c));
+    if (!res.empty() && res.back() == '.')
+        res.pop_back();
+    return res;
+}
+
+bool DnsMessage::normalize(const wstring& name, string& out)
+{
+    out.resize(name.size());
+    for (size_t i = 0; i < name.size(); ++i) {
+        if (name[i] < 0 || name[i] > 0x7F)
+            return false;
+        out[i] = lower(static_cast<uint8_t>(name[i]));
+    }
+    if (!out.empty() && out.back() == '.')
+        out.pop_back();
+    return true;
+}
@@ -0,0 +1,267 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace Windscribe {
+
+/**
+* Minimal DNS wire format (RFC 1035) used by the native transport and by the stub server.
+* Reader and Writer work directly on the caller's buffer and never allocate, so they are used on the hot path.
+* Message, build() and parse() are the convenient allocating API on top of them.
+* Reader accepts any bytes: every length and compression pointer is checked against the buffer.
+*/
+class DnsMessage
+{
+public:
+
+    /** Record types supported by the resolver. */
+    enum TYPE : uint16_t {
+        TYPE_A = 1,
+        TYPE_CNAME = 5,
+        TYPE_SOA = 6,
+        TYPE_AAAA = 28
+    };
+
+    /** Response codes of the DNS header. */
+    enum RCODE : uint8_t {
+        RCODE_NOERROR = 0,
+        RCODE_FORMERR = 1,
+        RCODE_SERVFAIL = 2,
+        RCODE_NXDOMAIN = 3
+    };
+
+    static const uint16_t CLASS_IN{ 1 };
+    static const size_t HEADER_SIZE{ 12 };
+
+    /** Maximum size of the answer over UDP without EDNS. */
+    static const size_t MAX_UDP_SIZE{ 512 };
+
+    /** Maximum length of the label and of the whole encoded name. */
+    static const size_t MAX_LABEL_SIZE{ 63 };
+    static const size_t MAX_NAME_SIZE{ 255 };
+
+    /** Maximum size of the query with one question. */
+    static const size_t MAX_QUERY_SIZE{ HEADER_SIZE + MAX_NAME_SIZE + 4 };
+
+    /** Flags of the DNS header. */
+    static const uint16_t FLAG_RESPONSE{ 0x8000 };
+    static const uint16_t FLAG_TRUNCATED{ 0x0200 };
+    static const uint16_t FLAG_RECURSION_DESIRED{ 0x0100 };
+    static const uint16_t FLAG_RECURSION_AVAILABLE{ 0x0080 };
+
+    /** Name inside the message buffer, possibly compressed. Valid while the buffer is alive.
+    * Names are only created by Reader, which checks them, so they are always well formed.
+    */
+    class NameView
+    {
+    public:
+        NameView() = default;
+        NameView(const uint8_t* buf, size_t size, size_t offset) : buf_(buf), size_(size), offset_(offset) {}
+
+        /** Compares with the dotted name ignoring case and the trailing dot. */
+        bool equals(const char* name, size_t size) const;
+        bool equals(const string& name) const { return equals(name.data(), name.size()); }
+
+        /** Compares names ignoring case. Names may be in different buffers. */
+        bool operator==(const NameView& other) const;
+        bool operator!=(const NameView& other) const { return !(*this == other); }
+
+        /** Writes lower-cased dotted name without trailing dot to out.
+        * @return Length of the name or SIZE_MAX if it does not fit in capacity bytes.
+        */
+        size_t copy(char* out, size_t capacity) const;
+
+        /** Lower-cased dotted name without trailing dot. Allocates. */
+        string toString() const;
+
+    private:
+        const uint8_t* buf_{ nullptr };
+        size_t size_{ 0 };
+        size_t offset_{ 0 };
+    };
+
+    /** Resource record inside the message buffer. */
+    struct RecordView {
+        NameView name;
+        uint16_t type{};
+        uint16_t rclass{};
+        uint32_t ttl{};
+        const uint8_t* rdata{ nullptr };
+        uint16_t rdataSize{ 0 };
+
+        /** Target name for CNAME records. */
+        NameView target;
+
+        /** MINIMUM field for SOA records. */
+        uint32_t minimum{ 0 };
+    };
+
+    /** Sections of the message iterated by Reader. */
+    enum SECTION : uint8_t {
+        SECTION_ANSWER,
+        SECTION_AUTHORITY,
+        SECTION_ADDITIONAL
+    };
+
+    /** Decodes message in place. Does not allocate and does not copy the buffer. */
+    class Reader
+    {
+    public:
+        /** Decodes header and question. The question may be absent only in truncated messages.
+        * @return false if message is malformed.
+        */
+        bool reset(const uint8_t* buf, size_t size);
+
+        uint16_t id() const { return id_; }
+        uint16_t flags() const { return flags_; }
+        bool response() const { return (flags_ & FLAG_RESPONSE) != 0; }
+        bool truncated() const { return (flags_ & FLAG_TRUNCATED) != 0; }
+        bool recursionDesired() const { return (flags_ & FLAG_RECURSION_DESIRED) != 0; }
+        uint8_t rcode() const { return static_cast<uint8_t>(flags_ & 0x0F); }
+
+        /** Question of the message. Empty name and zero type if there is no question. */
+        const NameView& qname() const { return qname_; }
+        uint16_t qtype() const { return qtype_; }
+
+        /** Reads the next record of the answer, authority and additional sections.
+        * @return false after the last record or if the record is malformed, see malformed().
+        */
+        bool next(RecordView& rec);
+
+        /** Section of the record returned by the last next(). */
+        SECTION section() const { return section_; }
+
+        /** Returns true if next() stopped at malformed record. */
+        bool malformed() const { return malformed_; }
+
+        /** Starts iteration of the records from the first record of the answer section. */
+        void rewind();
+
+    private:
+        const uint8_t* buf_{ nullptr };
+        size_t size_{ 0 };
+        size_t pos_{ 0 };
+        size_t recordsStart_{ 0 };
+        uint16_t id_{ 0 };
+        uint16_t flags_{ 0 };
+        NameView qname_;
+        uint16_t qtype_{ 0 };
+
+        /** Number of records in every section and number of records left in the current one. */
+        uint16_t counts_[3]{};
+        uint16_t left_{ 0 };
+        SECTION section_{ SECTION_ANSWER };
+        bool malformed_{ false };
+    };
+
+    /** Encodes message into the caller's buffer. Names of the records are compressed against the names written before.
+    * Every call fails without changes of the message if the result does not fit the buffer or the name is not valid host name.
+    */
+    class Writer
+    {
+    public:
+        Writer(uint8_t* buf, size_t capacity) : buf_(buf), capacity_(capacity) {}
+
+        /** Writes header. Must be called first. */
+        bool header(uint16_t id, uint16_t flags, uint8_t rcode = RCODE_NOERROR);
+
+        bool question(const char* name, size_t size, uint16_t type);
+        bool question(const string& name, uint16_t type) { return question(name.data(), name.size(), type); }
+
+        /** Adds record with raw data to the answer section. */
+        bool answer(const string& name, uint16_t type, uint32_t ttl, const uint8_t* rdata, size_t rdataSize);
+
+        /** Adds CNAME record to the answer section. The target is compressed too. */
+        bool cname(const string& name, uint32_t ttl, const string& target);
+
+        /** Drops records and sets TC bit. */
+        void truncate();
+
+        /** Size of the message written. */
+        size_t size() const { return pos_; }
+
+    private:
+        /** Appends encoded name. On failure nothing is appended. */
+        bool name(const char* name, size_t size);
+
+        bool put16(uint16_t v);
+        bool put32(uint32_t v);
+
+        /** Writes owner name, type, class and TTL of the record. */
+        bool recordHeader(const string& name, uint16_t type, uint32_t ttl);
+
+        /** Number of the label offsets remembered for compression. */
+        static const int MAX_LABELS{ 32 };
+
+        uint8_t* buf_;
+        size_t capacity_;
+        size_t pos_{ 0 };
+        size_t questionEnd_{ 0 };
+        uint16_t answers_{ 0 };
+
+        /** Offsets of the labels written uncompressed. Later names point to them. */
+        uint16_t labels_[MAX_LABELS]{};
+        int labelsCount_{ 0 };
+    };
+
+    /** Resource record. */
+    struct Record {
+        string name;
+        uint16_t type{};
+        uint32_t ttl{};
+
+        /** Address bytes for A (4 bytes) and AAAA (16 bytes) records. */
+        vector<uint8_t> address;
+
+        /** Target name for CNAME records. */
+        string target;
+    };
+
+    /** Decoded DNS message with one question. */
+    struct Message {
+        uint16_t id{};
+        bool response{ false };
+        bool truncated{ false };
+        bool recursionDesired{ true };
+        uint8_t rcode{ RCODE_NOERROR };
+        string qname;
+        uint16_t qtype{ TYPE_A };
+        vector<Record> answers;
+
+        /** TTL of the negative answer taken from SOA record of the authority section (RFC 2308). Zero if there is no SOA. */
+        uint32_t negativeTtl{ 0 };
+    };
+
+    /** Encodes message into out. If encoded answer exceeds maxSize, answers are dropped and TC bit is set.
+    * @return false if some name is not a valid host name.
+    */
+    static bool build(const Message& msg, vector<uint8_t>& out, size_t maxSize = SIZE_MAX);
+
+    /** Encodes query for the name. Capacity of out is reused, so queries are encoded without allocations. */
+    static bool buildQuery(uint16_t id, const string& name, uint16_t type, vector<uint8_t>& out);
+
+    /** Encodes query for the name to out of capacity bytes, MAX_QUERY_SIZE is always enough.
+    * @return Size of the query or 0 if the name is not valid host name.
+    */
+    static size_t writeQuery(uint16_t id, const char* name, size_t size, uint16_t type, uint8_t* out, size_t capacity);
+
+    /** Decodes message. Unknown record types of the answer section are skipped.
+    * @return false if message is malformed.
+    */
+    static bool parse(const uint8_t* buf, size_t size, Message& msg);
+
+    /** Returns lower-cased name without trailing dot. */
+    static string normalize(const string& name);
+
+    /** Writes lower-cased name without trailing dot to out reusing its buffer.
+    * @return false if name has non-ASCII characters.
+    */
+    static bool normalize(const wstring& name, string& out);
+};
+
+}
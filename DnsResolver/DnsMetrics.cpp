@@ -0,0 +1,146 @@
+#include "DnsMetrics.hpp"
+#include "DnsResolver.hpp"
+
+#include <boost/locale.hpp>
+
+#include <mutex>
+
+using namespace Windscribe;
+
+namespace {
+
+static_assert(static_cast<size_t>(DnsResolver::RESULT_CODE::TIMEOUT) + 1 == DnsMetrics::CODES, "Every result code needs its counter");
+
+/** Quantiles written for the latency histograms. */
+const double QUANTILES[] = { 0.5, 0.9, 0.99, 0.999 };
+
+/** Label value of the server. Empty server is the system configured one. */
+string serverLabel(const wstring& server)
+{
+    if (server.empty())
+        return "system";
+    string res;
+    for (const auto c : boost::locale::conv::utf_to_utf<char>(server)) {
+        if (c == '"' || c == '\\')
+            res += '\\';
+        res += c;
+    }
+    return res;
+}
+
+void writeHeader(ostream& out, const char* name, const char* type, const char* help)
+{
+    out << "# HELP " << name << ' ' << help << '\n';
+    out << "# TYPE " << name << ' ' << type << '\n';
+}
+
+/** Writes samples of the summary. Labels are written before the quantile, separated by comma if not empty. */
+void writeSummary(ostream& out, const char* name, const string& labels, const LatencyHistogram::Snapshot& latency)
+{
+    const auto separator = labels.empty() ? "" : ",";
+    for (const auto q : QUANTILES)
+        out << name << '{' << labels << separator << "quantile=\"" << q << "\"} " << latency.percentile(q) << '\n';
+    const auto braced = labels.empty() ? string() : '{' + labels + '}';
+    out << name << "_sum" << braced << ' ' << latency.sum << '\n';
+    out << name << "_count" << braced << ' ' << latency.count << '\n';
+}
+
+}
+
+DnsMetrics::Entry& DnsMetrics::entry(const wstring& server)
+{
+    {
+        shared_lock<shared_timed_mutex> lock(mut_);
+        const auto it = entries_.find(server);
+        if (it != entries_.cend())
+            return *it->second;
+    }
+    unique_lock<shared_timed_mutex> lock(mut_);
+    auto& res = entries_[server];
+    if (!res)
+        res = make_unique<Entry>();
+    return *res;
+}
+
+void DnsMetrics::onFinish(chrono::microseconds latency)
+{
+    lookupLatency_.record(latency);
+    finished_.fetch_add(1, memory_order_relaxed);
+}
+
+void DnsMetrics::onResult(const wstring& server, size_t code)
+{
+    if (code < CODES)
+        entry(server).results[code].fetch_add(1, memory_order_relaxed);
+}
+
+void DnsMetrics::onAnswer(const wstring& server, chrono::microseconds latency)
+{
+    entry(server).latency.record(latency);
+}
+
+DnsMetrics::Snapshot DnsMetrics::snapshot() const
+{
+    Snapshot res;
+    // Finished are read first, so lookups in flight are never negative.
+    res.finished = finished_.load(memory_order_relaxed);
+    res.coalesced = coalesced_.load(memory_order_relaxed);
+    res.lookups = lookups_.load(memory_order_relaxed);
+    res.lookupsInFlight = res.lookups - min(res.lookups, res.finished + res.coalesced);
+    res.lookupLatency = lookupLatency_.snapshot();
+
+    shared_lock<shared_timed_mutex> lock(mut_);
+    res.servers.reserve(entries_.size());
+    for (const auto& it : entries_) {
+        Server server;
+        server.server = it.first;
+        server.latency = it.second->latency.snapshot();
+        for (size_t code = 0; code < CODES; ++code) {
+            server.results[code] = it.second->results[code].load(memory_order_relaxed);
+            res.results[code] += server.results[code];
+        }
+        res.answerLatency.merge(server.latency);
+        res.servers.push_back(move(server));
+    }
+    return res;
+}
+
+void DnsMetrics::Snapshot::write(ostream& out) const
+{
+    writeHeader(out, "dns_lookups_total", "counter", "Lookups started.");
+    out << "dns_lookups_total " << lookups << '\n';
+    writeHeader(out, "dns_lookups_coalesced_total", "counter", "Lookups attached to the identical lookup in flight.");
+    out << "dns_lookups_coalesced_total " << coalesced << '\n';
+    writeHeader(out, "dns_lookups_in_flight", "gauge", "Lookups started and not finished.");
+    out << "dns_lookups_in_flight " << lookupsInFlight << '\n';
+    writeHeader(out, "dns_queries_in_flight", "gauge", "Queries sent and not answered.");
+    out << "dns_queries_in_flight " << queriesInFlight << '\n';
+
+    writeHeader(out, "dns_cache_hits_total", "counter", "Queries answered from the cache.");
+    out << "dns_cache_hits_total " << cacheHits << '\n';
+    writeHeader(out, "dns_cache_misses_total", "counter", "Queries not found in the cache.");
+    out << "dns_cache_misses_total " << cacheMisses << '\n';
+    writeHeader(out, "dns_cache_hit_ratio", "gauge", "Share of the queries answered from the cache.");
+    out << "dns_cache_hit_ratio " << cacheHitRate() << '\n';
+    writeHeader(out, "dns_cache_refreshes_total", "counter", "Cached answers refreshed before expiry or while stale.");
+    out << "dns_cache_refreshes_total " << cacheRefreshes << '\n';
+    writeHeader(out, "dns_cache_stale_hits_total", "counter", "Queries answered by the expired answers while they are refreshed.");
+    out << "dns_cache_stale_hits_total " << cacheStaleHits << '\n';
+
+    writeHeader(out, "dns_query_results_total", "counter", "Results of the queries per server and code.");
+    for (const auto& server : servers) {
+        const auto label = serverLabel(server.server);
+        for (size_t code = 0; code < CODES; ++code) {
+            if (server.results[code]) {
+                out << "dns_query_results_total{server=\"" << label << "\",code=\""
+                    << DnsResolver::toString(static_cast<DnsResolver::RESULT_CODE>(code)) << "\"} " << server.results[code] << '\n';
+            }
+        }
+    }
+
+    writeHeader(out, "dns_lookup_latency_us", "summary", "Time from the start of the lookup to its result.");
+    writeSummary(out, "dns_lookup_latency_us", string(), lookupLatency);
+    writeHeader(out, "dns_answer_latency_us", "summary", "Time from the start of the lookup to the answer of the server.");
+    for (const auto& server : servers)
+        writeSummary(out, "dns_answer_latency_us", "server=\"" + serverLabel(server.server) + '"', server.latency);
+}
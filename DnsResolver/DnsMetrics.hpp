@@ -0,0 +1,116 @@
+#pragma once
+
+#include "LatencyHistogram.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace Windscribe {
+
+/**
+* Metrics of the resolver: latency histograms and result counters per server and in total, lookups in flight.
+* Results are counted by index of DnsResolver::RESULT_CODE, so the metrics do not depend on the resolver.
+* Recording takes no locks once the server is seen, like DnsServerStats.
+*/
+class DnsMetrics
+{
+public:
+    /** Number of result codes counted. */
+    static const size_t CODES{ 6 };
+
+    /** Metrics of one server. */
+    struct Server {
+        wstring server;
+
+        /** Time from the start of the lookup to the answer of the server. */
+        LatencyHistogram::Snapshot latency;
+
+        /** Results reported by the transport per code. */
+        uint64_t results[CODES]{};
+    };
+
+    struct Snapshot {
+        /** Time from the start of the lookup to its result, including lookups answered from the cache. */
+        LatencyHistogram::Snapshot lookupLatency;
+
+        /** Answers of all servers. */
+        LatencyHistogram::Snapshot answerLatency;
+
+        /** Results of all servers per code. */
+        uint64_t results[CODES]{};
+
+        /** Lookups started, lookups attached to the identical lookup in flight and lookups finished. */
+        uint64_t lookups{ 0 };
+        uint64_t coalesced{ 0 };
+        uint64_t finished{ 0 };
+
+        /** Lookups started and not finished yet. */
+        uint64_t lookupsInFlight{ 0 };
+
+        /** Queries sent by the transport and not answered yet. */
+        uint64_t queriesInFlight{ 0 };
+
+        uint64_t cacheHits{ 0 };
+        uint64_t cacheMisses{ 0 };
+
+        /** Cached answers refreshed in background: hot ones before expiry and stale ones. */
+        uint64_t cacheRefreshes{ 0 };
+
+        /** Hits of the expired answers, counted in cacheHits too. */
+        uint64_t cacheStaleHits{ 0 };
+
+        vector<Server> servers;
+
+        double cacheHitRate() const { return cacheHits + cacheMisses ? static_cast<double>(cacheHits) / (cacheHits + cacheMisses) : 0; }
+
+        /** Writes metrics in the Prometheus text exposition format. Latencies are in microseconds. */
+        void write(ostream& out) const;
+    };
+
+    DnsMetrics() = default;
+    DnsMetrics(const DnsMetrics&) = delete;
+    DnsMetrics& operator=(const DnsMetrics&) = delete;
+
+    void onLookup() { lookups_.fetch_add(1, memory_order_relaxed); }
+    void onCoalesced() { coalesced_.fetch_add(1, memory_order_relaxed); }
+
+    /** Records lookup finished latency after its start. */
+    void onFinish(chrono::microseconds latency);
+
+    /** Records result of the query reported by the transport. */
+    void onResult(const wstring& server, size_t code);
+
+    /** Records answer of the server received latency after the start of the lookup. */
+    void onAnswer(const wstring& server, chrono::microseconds latency);
+
+    /** Metrics recorded so far. Counters of the cache and the transport are filled by the resolver. */
+    Snapshot snapshot() const;
+
+private:
+    struct Entry {
+        LatencyHistogram latency;
+        atomic<uint64_t> results[CODES]{};
+    };
+
+    /** Returns entry of the server, creating it if necessary. Entries are never removed. */
+    Entry& entry(const wstring& server);
+
+    LatencyHistogram lookupLatency_;
+    atomic<uint64_t> lookups_{ 0 };
+    atomic<uint64_t> coalesced_{ 0 };
+    atomic<uint64_t> finished_{ 0 };
+
+    mutable shared_timed_mutex mut_;
+    unordered_map<wstring, unique_ptr<Entry>> entries_;
+};
+
+}
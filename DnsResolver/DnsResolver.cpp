@@ -1,19 +1,40 @@
 #include "DnsResolver.hpp"
-#include "dnsresolver.hpp"
+#include "DnsCache.hpp"
+#include "DnsHosts.hpp"
+#include "DnsMessage.hpp"
+#include "DnsTrace.hpp"
+#include "DnsTransport.hpp"
+#include "ObjectPool.hpp"
+#include "RcuPtr.hpp"
 
 #include <boost/log/trivial.hpp>
 #include <boost/locale.hpp>
 
-#include <Ws2tcpip.h>
-#include <Mstcpip.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <windns.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
-#define MAX_ADDRESS_STRING_LENGTH   64
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <shared_mutex>
+#include <thread>
 
 using namespace Windscribe;
 
+namespace {
+
+/** Pool of Data objects shared by all resolvers.
+* Never destroyed, so Data referenced after the resolver is deleted can still return to it.
+*/
+ObjectPool<DnsResolver::Data>& dataPool()
+{
+    static auto pool = new ObjectPool<DnsResolver::Data>();
+    return *pool;
+}
+
+}
+
 DnsResolver::~DnsResolver() {}
 
 string Windscribe::DnsResolver::toString(RESULT_CODE code)
@@ -23,349 +44,1080 @@ string Windscribe::DnsResolver::toString(RESULT_CODE code)
     case RESULT_CODE::NOT_RESOLVED:        return "NOT_RESOLVED";
     case RESULT_CODE::INTERNAL_ERROR:      return "INTERNAL_ERROR";
     case RESULT_CODE::EMPTY_HOST:          return "EMPTY_HOST";
+    case RESULT_CODE::CANCELLED:           return "CANCELLED";
+    case RESULT_CODE::TIMEOUT:             return "TIMEOUT";
     default:                               return "unknown";
     }
 }
 
-void Windscribe::DnsResolver::log(const string& func, const string& msg)
-{
-    BOOST_LOG_TRIVIAL(debug) << this_thread::get_id() << " " << func << " " << msg;
-}
-
-/**
-* Code for DNS query is from https://github.com/microsoft/Windows-classic-samples/blob/master/Samples/DNSAsyncQuery/cpp/DnsQueryEx.cpp.
-*/
+/** Resolver implementation. Answers from the static hosts, from the cache or queries every DNS server through the transport. */
 struct DnsResolver::Impl
 {
-    ~Impl() {};
-    
-    /** @debug Used to track number of allocated contexts. */
-    static atomic_int contextsAllocated_;
+    Impl(unique_ptr<DnsTransport> transport, const Options& options)
+        : coalesce_(options.coalesceLookups), mode_(options.mode), staggerDelay_(options.staggerDelay), timeout_(options.timeout),
+        queryTypes_(options.queryTypes), selection_(options.selection), selectCount_(max<size_t>(1, options.selectCount)),
+        failoverDelay_(max(chrono::milliseconds(1), options.failoverDelay)),
+        hostsReloadInterval_(options.hostsReloadInterval), transport_(move(transport))
+    {
+        DnsServerStats::Options statsOptions;
+        statsOptions.failuresToDemote = options.failuresToDemote;
+        statsOptions.probeInterval = options.probeInterval;
+        stats_ = make_unique<DnsServerStats>(statsOptions);
+        if (options.collectMetrics)
+            metrics_ = make_unique<DnsMetrics>();
 
-    /** @debug Used to track number of deleted contexts. */
-    static atomic_int contextsDeleted_;
+        if (options.cacheCapacity) {
+            DnsCache::Options cacheOptions;
+            cacheOptions.capacity = options.cacheCapacity;
+            cacheOptions.maxTtl = options.maxCacheTtl;
+            cacheOptions.maxNegativeTtl = options.maxNegativeCacheTtl;
+            cacheOptions.prefetchPercent = options.prefetchPercent;
+            cacheOptions.prefetchHits = options.prefetchHits;
+            cacheOptions.staleTtl = options.staleCacheTtl;
+            if (options.timeout.count())
+                cacheOptions.refreshTimeout = options.timeout;
+            cache_ = make_unique<DnsCache>(cacheOptions);
+        }
 
-    /** Context for the DnsQueries. */
-    typedef struct _QueryContextStruct
-    {
-        ULONG               RefCount{ 0 };
-        WCHAR               QueryName[DNS_MAX_NAME_BUFFER_LENGTH];
-        WORD                QueryType;
-        ULONG               QueryOptions;
-        DNS_QUERY_RESULT    QueryResults;
-        DNS_QUERY_CANCEL    QueryCancelContext;
-        HANDLE              QueryCompletedEvent;
-
-        /** Member with Data.
-        * @note Do not forget make it nullptr before deleting parent structure.
-        */
-        DataPtr             Data;
-
-        /** Using this index context knows what Data::ips_ member it currently resolves.
-        * This parameter allows to change Data by different threads without blocking.
-        */
-        INT                 Ind{ 0 };
-    }QUERY_CONTEXT, * PQUERY_CONTEXT;
-
-    /** Extracts IP from the DNS resolution result and sets it to data at the ind. */
-    static void ExtractIp( PDNS_RECORD DnsRecord, DataPtr data, INT ind )
-    {
-        if (DnsRecord) {
-            struct in_addr Ipv4address;
-            WCHAR Ipv4String[MAX_ADDRESS_STRING_LENGTH] = L"\0";
-
-            Ipv4address.S_un.S_addr = DnsRecord->Data.A.IpAddress;
-            RtlIpv4AddressToStringW(&Ipv4address, Ipv4String);
-            data->onIpResolved(ind, move(Ipv4String));
-            log(__FUNCTION__, boost::locale::conv::utf_to_utf<char>(Ipv4String));
+        if (!options.hostsFile.empty())
+            loadHosts(options.hostsFile);
+
+        cacheFile_ = options.cacheFile;
+        if (cache_ && !cacheFile_.empty()) {
+            const auto loaded = cache_->load(cacheFile_);
+            DNS_TRACE_LOOKUP(CACHE_LOADED, loaded, 0, 0);
+            (void)loaded;
         }
-        else {
-            log(__FUNCTION__, "DnsQueryEx() failed!");
-            data->onError(ind, RESULT_CODE::NOT_RESOLVED);
+    }
+
+    ~Impl() {
+        if (cache_ && !cacheFile_.empty() && !cache_->save(cacheFile_))
+            DNS_TRACE_ERROR(CACHE_SAVE_FAILED, errno, 0, 0);
+        {
+            lock_guard<mutex> lock(hostsMutex_);
+            stopping_ = true;
         }
+        hostsCv_.notify_all();
+        if (hostsWatcher_.joinable())
+            hostsWatcher_.join();
     }
 
-    /**
-    *  Wrapper function that creates DNS_ADDR_ARRAY from IP address string.
-    */
-    DWORD CreateDnsServerList(_In_ PWSTR ServerIp, _Out_ PDNS_ADDR_ARRAY DnsServerList)
-    {
-        DWORD  Error = ERROR_SUCCESS;
-        SOCKADDR_STORAGE SockAddr;
-        INT AddressLength;
-        WSADATA wsaData;
+    /** Implements lookup of the host using dns servers and returning the result to caller using res. */
+    void Lookup(const wstring& host, const vector<wstring>& dns, promise<DataPtr> res) {
+        start(host, dns, [&res](Data::Waiter& waiter) { waiter.res = move(res); });
+    }
 
-        ZeroMemory(DnsServerList, sizeof(*DnsServerList));
+    void Lookup(const wstring& host, const vector<wstring>& dns, Completion& completion) {
+        start(host, dns, [&completion](Data::Waiter& waiter) { waiter.completion = &completion; });
+    }
 
-        Error = WSAStartup(MAKEWORD(2, 2), &wsaData);
-        if (Error != 0)
-        {
-            WSACleanup();
-            return Error;
-        }
+    void Lookup(const wstring& host, const vector<wstring>& dns, Callback&& callback) {
+        start(host, dns, [&callback](Data::Waiter& waiter) { waiter.callback = move(callback); });
+    }
 
-        AddressLength = sizeof(SockAddr);
-        Error = WSAStringToAddressW(ServerIp,
-            AF_INET,
-            NULL,
-            (LPSOCKADDR)&SockAddr,
-            &AddressLength);
-        if (Error != ERROR_SUCCESS)
+    /** Sets the receiver of the result by setWaiter. Waiter is not constructed separately, its promise would allocate. */
+    template<typename SetWaiter>
+    void start(const wstring& host, const vector<wstring>& dns, SetWaiter&& setWaiter) {
+        if (host.empty())
         {
-            AddressLength = sizeof(SockAddr);
-            Error = WSAStringToAddressW(ServerIp,
-                AF_INET6,
-                NULL,
-                (LPSOCKADDR)&SockAddr,
-                &AddressLength);
+            auto data = makeData(EMPTY_HOST_SERVERS, host);
+            setWaiter(data->waiter_);
+            DNS_TRACE_LOOKUP(EMPTY_HOST, data.get(), 0, 0);
+            data->onError(0, RESULT_CODE::EMPTY_HOST);
+            return;
         }
 
-        if (Error != ERROR_SUCCESS)
-        {
-            WSACleanup();
-            return Error;
-        }
+        auto data = makeData(dns, host);
+        setWaiter(data->waiter_);
+        DNS_TRACE_LOOKUP(LOOKUP, data.get(), dns.size(), 0);
+
+        // Requests are built in the buffer of the thread, so its capacity is reused by the next lookups.
+        static thread_local vector<DnsTransport::Request> requests;
+        prepare(data, requests);
+        transport_->Query(requests);
+        requests.clear();
+    }
 
-        DnsServerList->MaxCount = 1;
-        DnsServerList->AddrCount = 1;
-        CopyMemory(DnsServerList->AddrArray[0].MaxSa, &SockAddr, DNS_ADDR_MAX_SOCKADDR_LENGTH);
+    /** Implements lookup of all hosts of the batch. Queries of all hosts are passed to the transport at once. */
+    BatchPtr LookupBatch(const wstring* hosts, size_t count, const vector<wstring>& dns, Batch::Callback callback) {
+        DNS_TRACE_LOOKUP(BATCH, count, dns.size(), 0);
 
-        WSACleanup();
-        return Error;
+        auto batch = make_shared<Batch>(count, move(callback));
+        vector<DnsTransport::Request> requests;
+        requests.reserve(count * max<size_t>(dns.size(), 1));
+        for (size_t i = 0; i < count; ++i) {
+            auto data = makeData(hosts[i].empty() ? EMPTY_HOST_SERVERS : dns, hosts[i]);
+            data->waiter_.batch = batch;
+            data->waiter_.index = i;
+            if (hosts[i].empty()) {
+                data->onError(0, RESULT_CODE::EMPTY_HOST);
+                continue;
+            }
+            prepare(data, requests);
+        }
+        transport_->Query(requests);
+        return batch;
     }
 
-    /** Increments ref counter of the Context.
-    * @todo Possibly not necessary in the given implementation as we have one Context per DNS.
+    /** Sets answers of data found in the cache and adds queries for the rest of servers to requests.
+    * Nothing is added for data finished from the cache or attached to the identical lookup in flight,
+    * but queries refreshing the cached answers may be added anyway.
     */
-    VOID AddReferenceQueryContext(_Inout_ PQUERY_CONTEXT QueryContext)
-    {
-        InterlockedIncrement(&QueryContext->RefCount);
-    }
+    void prepare(const DataPtr& data, vector<DnsTransport::Request>& requests) {
+        data->impl_ = this;
+        data->mode_ = mode_;
+        data->setQueryTypes(queryTypes_);
+        data->start_ = chrono::steady_clock::now();
+        if (metrics_)
+            metrics_->onLookup();
+        if (timeout_.count())
+            data->deadline_ = data->start_ + timeout_;
+        if (fromHosts(data))
+            return;
+        const int count = data->maxCount_;
+        const int per = data->queriesPerServer();
 
-    /** Cleans up Context after DNS resolution. */
-    static VOID DeReferenceQueryContext(_Inout_ PQUERY_CONTEXT* QueryContext)
-    {
-        PQUERY_CONTEXT QC = *QueryContext;
+        // Answers found in the cache are set right away. If all of them are cached, data is already finished.
+        // In FIRST_ANSWER mode cached answer cancels the rest of servers, so they are skipped.
+        auto& missed = data->missed_;
+        missed.clear();
+        for (int ind = 0; ind < count; ++ind) {
+            if (!fromCache(data, ind, requests) && !data->isDone(ind))
+                missed.push_back(ind);
+        }
+        if (missed.empty())
+            return;
 
-        if (InterlockedDecrement(&QC->RefCount) == 0)
-        {
-            QC->Data = nullptr; // clean shared_ptr pointed to Data
-            contextsDeleted_.fetch_add(1, memory_order_relaxed);
-            log(__FUNCTION__, "Contexts deleted ---> " + to_string(contextsDeleted_));
-            if (QC->QueryCompletedEvent)
-            {
-                CloseHandle(QC->QueryCompletedEvent);
+        int selected{ INT_MAX };
+        if (selection_ == SELECTION::FASTEST && missed.size() > selectCount_ * per)
+            selected = select(data, missed);
+
+        // Queries of one server are sent together, so the server answers A and AAAA in one round trip.
+        // Standby servers are queried one by one after the selected ones.
+        // Delayed servers are remembered in order, so the next one is expedited if the servers before it fail.
+        const auto first = requests.size();
+        const auto stagger = mode_ == MODE::STAGGERED ? staggerDelay_ : chrono::milliseconds(0);
+        int position{ -1 }, lastServer{ -1 };
+        chrono::milliseconds delay{ 0 };
+        data->standby_ = SIZE_MAX;
+        for (const auto ind : missed) {
+            if (ind / per != lastServer) {
+                lastServer = ind / per;
+                position++;
+                if (position == selected)
+                    data->standby_ = data->waiting_.size();
+                delay = position < selected ? stagger * position : stagger * (selected - 1) + failoverDelay_ * (position - selected + 1);
+                if (delay.count())
+                    data->waiting_.push_back(lastServer);
             }
+            requests.push_back({ &data->host_, &data->server(ind), data, ind, delay });
+        }
+        data->standby_ = min(data->standby_, data->waiting_.size());
 
-            HeapFree(GetProcessHeap(), 0, QC);
-            *QueryContext = NULL;
+        if (coalesce_ && attach(data)) {
+            requests.resize(first);
+            data->waiting_.clear();
+            if (metrics_)
+                metrics_->onCoalesced();
         }
     }
 
-    /** Allocates context for the DNS resolution for the single DNS server. */
-    DWORD AllocateQueryContext(_Out_ PQUERY_CONTEXT* QueryContext)
-    {
-        DWORD Error = ERROR_SUCCESS;
+    /** Creates Data of the lookup, reusing the pooled one if possible. */
+    DataPtr makeData(const vector<wstring>& dns, const wstring& host) {
+        size_t hash{ 0 };
+        auto servers = intern(dns, hash);
+        auto data = dataPool().acquire();
+        if (!data)
+            data = new Data();
+        data->init(move(servers), hash, host);
+        return DataPtr(data);
+    }
 
-        *QueryContext = (PQUERY_CONTEXT)HeapAlloc(GetProcessHeap(),
-            HEAP_ZERO_MEMORY,
-            sizeof(QUERY_CONTEXT));
-        if (*QueryContext == NULL)
+    /** Returns the shared list equal to dns. Up to MAX_SERVER_LISTS lists are interned, the rest are copied per lookup. */
+    shared_ptr<const vector<wstring>> intern(const vector<wstring>& dns, size_t& hash) {
+        hash = Data::hashServers(dns);
+        auto find = [this, &dns, hash]() {
+            const auto range = serverLists_.equal_range(hash);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (*it->second == dns)
+                    return it->second;
+            }
+            return shared_ptr<const vector<wstring>>();
+        };
         {
-            return GetLastError();
+            shared_lock<shared_timed_mutex> lock(serverListsMutex_);
+            auto list = find();
+            if (list) {
+                serverListHits_.fetch_add(1, memory_order_relaxed);
+                return list;
+            }
         }
+        serverListMisses_.fetch_add(1, memory_order_relaxed);
+        unique_lock<shared_timed_mutex> lock(serverListsMutex_);
+        auto list = find();
+        if (list)
+            return list;
+        list = make_shared<const vector<wstring>>(dns);
+        if (serverLists_.size() < MAX_SERVER_LISTS)
+            serverLists_.emplace(hash, list);
+        return list;
+    }
 
-        (*QueryContext)->QueryResults.Version = DNS_QUERY_RESULTS_VERSION1;
+    /** Sets the answers of all queries of data from the static hosts and finishes it.
+    * Returns false if the host is not there. Takes no locks and does not allocate once buffers of data are grown.
+    */
+    bool fromHosts(const DataPtr& data) {
+        // Addresses are copied to data and the reader is released before settle(), which may call back the user.
+        // A callback reloading the hosts would wait for its own read epoch otherwise.
+        int settled{ 0 };
+        {
+            const auto hosts = hosts_.read();
+            if (!hosts || !hosts->size())
+                return false;
+            // Name is normalized in the buffer of the thread, so its capacity is reused.
+            static thread_local string name;
+            const IpAddress* addresses{ nullptr };
+            size_t count{ 0 };
+            if (!DnsMessage::normalize(data->host_, name) || !hosts->find(name, data->queryType(0), addresses, count))
+                return false;
 
-        (*QueryContext)->QueryCompletedEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+            // Nobody else sets results of data yet, so the results can be written before they are claimed.
+            for (int ind = 0; ind < data->maxCount_; ++ind) {
+                if (ind)
+                    hosts->find(name, data->queryType(ind), addresses, count);
+                auto& part = data->part(ind);
+                part.reset(count ? RESULT_CODE::SUCCESS : RESULT_CODE::NOT_RESOLVED);
+                part.addresses.assign(addresses, addresses + count);
+                if (data->claim(ind))
+                    settled++;
+            }
+        }
+        if (settled)
+            data->settle(settled);
+        return true;
+    }
 
-        if ((*QueryContext)->QueryCompletedEvent == NULL)
-        {
-            Error = GetLastError();
-            DeReferenceQueryContext(QueryContext);
-            *QueryContext = NULL;
+    /** Loads the hosts file and watches it for changes. */
+    bool loadHosts(const string& path) {
+        auto hosts = DnsHosts::load(path);
+        if (!hosts) {
+            DNS_TRACE_ERROR(HOSTS_FAILED, errno, 0, 0);
+            return false;
         }
-        return Error;
+        DNS_TRACE_LOOKUP(HOSTS_LOADED, hosts->size(), 0, 0);
+        hosts_.reset(move(hosts));
+
+        lock_guard<mutex> lock(hostsMutex_);
+        hostsPath_ = path;
+        hostsStamp_ = stamp(path);
+        if (hostsReloadInterval_.count() && !hostsWatcher_.joinable())
+            hostsWatcher_ = thread(&Impl::watchHosts, this);
+        return true;
     }
 
-    /** Callback function called by DNS as part of asynchronous query complete. */
-    static VOID WINAPI QueryCompleteCallback(_In_ PVOID Context, _Inout_ PDNS_QUERY_RESULT QueryResults)
-    {
-        PQUERY_CONTEXT QueryContext = (PQUERY_CONTEXT)Context;
+    /** Replaces the static hosts. The file loaded before is not watched anymore. */
+    void setHosts(unique_ptr<const DnsHosts> hosts) {
+        hosts_.reset(move(hosts));
+        lock_guard<mutex> lock(hostsMutex_);
+        hostsPath_.clear();
+    }
 
-        if (QueryResults->QueryStatus == ERROR_SUCCESS)
-        {
-            ExtractIp(QueryResults->pQueryRecords, QueryContext->Data, QueryContext->Ind);
-        }
-        else
-        {
-            log(__FUNCTION__, "DnsQueryEx() failed!");
-            QueryContext->Data->onError(QueryContext->Ind, RESULT_CODE::NOT_RESOLVED);
+    /** Modification time and size of the file, zeros if it does not exist. */
+    static pair<int64_t, int64_t> stamp(const string& path) {
+        struct stat st {};
+        if (stat(path.c_str(), &st) != 0)
+            return {};
+        return { static_cast<int64_t>(st.st_mtime), static_cast<int64_t>(st.st_size) };
+    }
+
+    /** Reloads the hosts file when its modification time or size changes. Readers keep using the old index until it is replaced. */
+    void watchHosts() {
+        unique_lock<mutex> lock(hostsMutex_);
+        while (!hostsCv_.wait_for(lock, hostsReloadInterval_, [this]() { return stopping_; })) {
+            if (hostsPath_.empty())
+                continue;
+            const auto current = stamp(hostsPath_);
+            if (current == hostsStamp_ || current == pair<int64_t, int64_t>())
+                continue;
+            const auto path = hostsPath_;
+            hostsStamp_ = current;
+            lock.unlock();
+            auto hosts = DnsHosts::load(path);
+            lock.lock();
+            // The file could be replaced by loadHosts() or setHosts() meanwhile.
+            if (hosts && hostsPath_ == path) {
+                DNS_TRACE_LOOKUP(HOSTS_LOADED, hosts->size(), 0, 0);
+                hosts_.reset(move(hosts));
+            }
         }
+    }
 
-        if (QueryResults->pQueryRecords)
-        {
-            DnsRecordListFree(QueryResults->pQueryRecords, DnsFreeRecordList);
+    /** Sets the answer of the query from the cache. Returns false if there is no cached answer.
+    * If the cache asks to refresh the answer, adds the query refreshing it to requests.
+    */
+    bool fromCache(const DataPtr& data, int ind, vector<DnsTransport::Request>& requests) {
+        // The answer is copied right to the result of the query, so its buffer is reused.
+        // Nobody else sets results of data yet, so the result can be written before it is claimed.
+        bool refresh{ false };
+        if (!cache_ || data->isDone(ind) || !cache_->get(data->host_, data->server(ind), data->queryType(ind), data->part(ind), &refresh))
+            return false;
+        if (refresh)
+            this->refresh(data->host_, data->server(ind), data->queryType(ind), requests);
+        // Set directly, so cached answers are not counted in the statistics of the server.
+        if (!data->claim(ind))
+            return true;
+        const bool success = data->part(ind).resCode == RESULT_CODE::SUCCESS;
+        data->settle(success && data->cancellable() ? 1 + data->cancelRest(ind) : 1);
+        return true;
+    }
+
+    /** Adds to requests the query of the record type of the host to the server, whose answer only updates the cache.
+    * It is not attached to the lookups in flight: they may query other types.
+    */
+    void refresh(const wstring& host, const wstring& server, uint16_t type, vector<DnsTransport::Request>& requests) {
+        auto data = makeData(server.empty() ? vector<wstring>() : vector<wstring>{ server }, host);
+        data->impl_ = this;
+        data->refresh_ = true;
+        data->setQueryTypes(type == DnsMessage::TYPE_AAAA ? QUERY_TYPES::AAAA : QUERY_TYPES::A);
+        data->start_ = chrono::steady_clock::now();
+        if (timeout_.count())
+            data->deadline_ = data->start_ + timeout_;
+        data->waiter_.callback = [](const DataPtr&) {};
+        DNS_TRACE_LOOKUP(REFRESH, data.get(), type, 0);
+        requests.push_back({ &data->host_, &data->server(0), data, 0, chrono::milliseconds(0) });
+    }
+
+    /** Orders queries in missed by the rank of their servers in the server statistics.
+    * Returns number of the servers queried right away, the rest are standby.
+    */
+    int select(const DataPtr& data, vector<int>& missed) {
+        const int per = data->queriesPerServer();
+        vector<int> servers;
+        for (const auto ind : missed) {
+            if (servers.empty() || servers.back() != ind / per)
+                servers.push_back(ind / per);
         }
+        const auto selected = stats_->select(*data->dns_, servers, selectCount_);
+        if (selected == servers.size())
+            return static_cast<int>(selected);
 
-        SetEvent(QueryContext->QueryCompletedEvent);
-        DeReferenceQueryContext(&QueryContext);
+        // Queries of every server stay together and in order.
+        vector<int> ordered;
+        ordered.reserve(missed.size());
+        for (const auto server : servers) {
+            for (const auto ind : missed) {
+                if (ind / per == server)
+                    ordered.push_back(ind);
+            }
+        }
+        missed.swap(ordered);
+        return static_cast<int>(selected);
     }
 
-    /** Implements lookup of the host using dns servers and returning the result to caller using res. */
-    void Lookup(const wstring& host, const vector<wstring>& dns, promise<DataPtr> res) {
-        log(__FUNCTION__, boost::locale::conv::utf_to_utf<char>(host));
+    /** Updates statistics of the server of the query at ind of data with the result reported by the transport. */
+    void onServerResult(const Data& data, int ind, RESULT_CODE code, uint32_t ttl) {
+        if (metrics_)
+            toMetrics(data, ind, code, ttl);
 
-        if (host.empty())
-        {
-            vector<wstring> dns = { L"" };
-            auto data = make_shared<Data>(dns, host, move(res));
-            data->onError(0, RESULT_CODE::EMPTY_HOST);
-            log(__FUNCTION__, "Empty host!");
+        // One sample per server and lookup, so failed A and AAAA queries do not demote the server twice as fast.
+        if (ind % data.queriesPerServer())
             return;
+        const auto& server = data.server(ind);
+        const auto sent = sentAt(data, ind);
+        switch (code) {
+        case RESULT_CODE::SUCCESS:
+        case RESULT_CODE::NOT_RESOLVED:
+            if (code == RESULT_CODE::NOT_RESOLVED && !ttl) {
+                stats_->onFailure(server); // not an answer, but server failure or network error
+                break;
+            }
+            if (sent == chrono::steady_clock::time_point())
+                stats_->onAnswer(server);
+            else
+                stats_->onAnswer(server, chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - sent));
+            break;
+        case RESULT_CODE::TIMEOUT:
+        case RESULT_CODE::INTERNAL_ERROR:
+            stats_->onFailure(server);
+            break;
+        default:
+            break;
         }
+    }
 
-        int ind = 0;
-        int maxCount = dns.empty() ? 1 : static_cast<int>(dns.size());
-        auto data = std::make_shared<DnsResolver::Data>(dns, host, move(res));
-
-        do {
-            DWORD Error{ ERROR_SUCCESS };
-            PQUERY_CONTEXT QueryContext{ nullptr };
-            DNS_QUERY_REQUEST DnsQueryRequest;
-            DNS_ADDR_ARRAY DnsServerList;
-
-            /**
-            *   Allocate QueryContext
-            */
-            Error = AllocateQueryContext(&QueryContext);
-            if (Error != ERROR_SUCCESS)
-            {
-                vector<wstring> dns = { L"" };
-                auto data = make_shared<Data>(dns, host, move(res));
-                data->onError(0, RESULT_CODE::INTERNAL_ERROR);
-                log(__FUNCTION__, "Context allocation failed!");
-                return;
-            }
-            memcpy(QueryContext->QueryName, const_cast<wchar_t*>(host.c_str()), host.size() * sizeof(wchar_t));
-            QueryContext->QueryType = DNS_TYPE_A;
-            QueryContext->QueryOptions = 0;
-            QueryContext->RefCount = 0;
-            QueryContext->Data = data;
-            QueryContext->Ind = ind;
-            contextsAllocated_.fetch_add(1, memory_order_relaxed);
-            log(__FUNCTION__, "Contexts allocated ---> " + to_string(contextsAllocated_));
-
-            /**
-            *   Initiate asynchronous DnsQuery: Note that QueryResults and
-            *   QueryCancelContext should be valid till query completes.
-            */
-            ZeroMemory(&DnsQueryRequest, sizeof(DnsQueryRequest));
-            DnsQueryRequest.Version = DNS_QUERY_REQUEST_VERSION1;
-            DnsQueryRequest.QueryName = QueryContext->QueryName;
-            DnsQueryRequest.QueryType = QueryContext->QueryType;
-            DnsQueryRequest.QueryOptions = (ULONG64)QueryContext->QueryOptions;
-            DnsQueryRequest.pQueryContext = QueryContext;
-            DnsQueryRequest.pQueryCompletionCallback = QueryCompleteCallback;
-
-            /**
-            *   Increase reference count in order to avoid context dereferencing in the middle.
-            */
-            AddReferenceQueryContext(QueryContext);
-
-            size_t ind = 0;
-            size_t maxCount = dns.empty() ? 1 : dns.size();
-        
-            /**
-            *   If user specifies server, construct DNS_ADDR_ARRAY
-            */
-            const wstring addr = dns.empty() ? L"" : dns[ind];
-            if (!addr.empty())
-            {
-                Error = CreateDnsServerList(const_cast<wchar_t*>(addr.c_str()), &DnsServerList);
-
-                if (Error != ERROR_SUCCESS)
-                {
-                    log(__FUNCTION__, "CreateDnsServerList() failed!");
+    /** Counts the failure of the server of the query at ind of data, which did not answer in FASTEST selection
+    * until the standby server did. Otherwise the unresponsive server stays selected and delays every lookup.
+    */
+    void onOvertaken(const Data& data, int ind) {
+        if (selection_ != SELECTION::FASTEST || ind % data.queriesPerServer())
+            return;
+        const auto sent = sentAt(data, ind);
+        if (sent != chrono::steady_clock::time_point() && chrono::steady_clock::now() - sent >= failoverDelay_)
+            stats_->onFailure(data.server(ind));
+    }
+
+    /** Records the result of the query at ind of data in the metrics. Every query is counted, not one per server. */
+    void toMetrics(const Data& data, int ind, RESULT_CODE code, uint32_t ttl) {
+        const auto& server = data.server(ind);
+        metrics_->onResult(server, static_cast<size_t>(code));
+        const bool answer = code == RESULT_CODE::SUCCESS || (code == RESULT_CODE::NOT_RESOLVED && ttl);
+        const auto sent = sentAt(data, ind);
+        if (answer && sent != chrono::steady_clock::time_point())
+            metrics_->onAnswer(server, chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - sent));
+    }
+
+    /** Time the query at ind of data was sent, default value if it is not known.
+    * Transports which do not report it send queries when the lookup starts unless they are delayed.
+    */
+    chrono::steady_clock::time_point sentAt(const Data& data, int ind) const {
+        if (static_cast<size_t>(ind) < data.sentAt_.size() && data.sentAt_[ind] != chrono::steady_clock::time_point())
+            return data.sentAt_[ind];
+        return mode_ == MODE::STAGGERED || selection_ == SELECTION::FASTEST ? chrono::steady_clock::time_point() : data.start_;
+    }
+
+    /** Records the latency of the finished lookup. Refreshes are not lookups of the users, they are not recorded. */
+    void onFinish(const Data& data) {
+        if (metrics_ && !data.refresh_)
+            metrics_->onFinish(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - data.start_));
+    }
+
+    /** Stores the answer of the query at ind of data to the cache. */
+    void toCache(const Data& data, int ind, uint32_t ttl) {
+        if (cache_ && ttl)
+            cache_->put(data.host_, data.server(ind), data.queryType(ind), data.part(ind), ttl);
+    }
+
+    /** Starts queries of the next server of data waiting for its turn right away. Servers started meanwhile are skipped. */
+    void expedite(const DataPtr& data) {
+        const int per = data->queriesPerServer();
+        const auto& waiting = data->waiting_;
+        for (size_t next; (next = data->nextWaiting_.fetch_add(1, memory_order_relaxed)) < waiting.size();) {
+            bool started{ false };
+            for (int ind = waiting[next] * per; ind < (waiting[next] + 1) * per; ++ind) {
+                if (!data->isDone(ind) && !data->isSent(ind)) {
+                    transport_->Expedite(data, ind);
+                    started = true;
                 }
+            }
+            if (started)
+                return;
+        }
+    }
 
-                DnsQueryRequest.pDnsServerList = &DnsServerList;
+    /** Cancels queries of the standby servers of data not queried yet, as the server of the query at ind answered. */
+    void dropStandby(const DataPtr& data, int ind) {
+        const int per = data->queriesPerServer();
+        int count{ 0 };
+        for (size_t next = data->standby_; next < data->waiting_.size(); ++next) {
+            const int server = data->waiting_[next];
+            if (server == ind / per)
+                continue;
+            for (int query = server * per; query < (server + 1) * per; ++query) {
+                if (data->isSent(query) || !data->claim(query))
+                    continue;
+                data->part(query).reset(RESULT_CODE::CANCELLED);
+                count++;
             }
+        }
+        if (count)
+            data->settle(count);
+    }
+
+    /** Cancels query at ind of data. */
+    void cancel(const DataPtr& data, int ind) {
+        transport_->Cancel(data, ind);
+    }
+
+    /** Attaches promise of data to the identical lookup in flight.
+    * If there is no such lookup, data becomes the one other lookups attach to.
+    * @return true if data was attached and should not be resolved.
+    */
+    bool attach(const DataPtr& data) {
+        size_t key = std::hash<wstring>()(data->host_);
+        key ^= data->dnsHash_ + 0x9e3779b97f4a7c15ULL + (key << 6) + (key >> 2);
 
-            log(__FUNCTION__, "Async DnsQueryEx() call for dns " + boost::locale::conv::utf_to_utf<char>(addr) + " host " + boost::locale::conv::utf_to_utf<char>(host));
-            Error = DnsQueryEx(&DnsQueryRequest,
-                &QueryContext->QueryResults,
-                &QueryContext->QueryCancelContext);
-
-            /**
-            *   If DnsQueryEx() returns  DNS_REQUEST_PENDING, Completion routine
-            *   will be invoked. If not (when completed inline) completion routine
-            *   will not be invoked.
-            */
-            if (Error != DNS_REQUEST_PENDING)
-            {
-                log(__FUNCTION__, "allback is called synchroneously.");
-                QueryCompleteCallback(QueryContext, &QueryContext->QueryResults);
+        auto& shard = inflight_[key & (INFLIGHT_SHARDS - 1)];
+        lock_guard<mutex> lock(shard.mut);
+        auto& bucket = shard.buckets[(key / INFLIGHT_SHARDS) & (INFLIGHT_BUCKETS - 1)];
+        for (Data* leader = bucket; leader; leader = leader->nextLeader_) {
+            if (leader->key_ == key && leader->host_ == data->host_ && (leader->dns_ == data->dns_ || *leader->dns_ == *data->dns_)) {
+                leader->followers_.emplace_back(move(data->waiter_));
+                return true;
             }
-        } while (++ind < maxCount);
+        }
+        data->key_ = key;
+        data->leader_ = true;
+        data->nextLeader_ = bucket;
+        bucket = data.get();
+        return false;
     }
+
+    /** Removes finished data from the lookups in flight and returns receivers of the lookups attached to it. */
+    vector<Data::Waiter> detach(Data& data) {
+        auto& shard = inflight_[data.key_ & (INFLIGHT_SHARDS - 1)];
+        lock_guard<mutex> lock(shard.mut);
+        auto* link = &shard.buckets[(data.key_ / INFLIGHT_SHARDS) & (INFLIGHT_BUCKETS - 1)];
+        while (*link && *link != &data)
+            link = &(*link)->nextLeader_;
+        if (*link)
+            *link = data.nextLeader_;
+        data.nextLeader_ = nullptr;
+        data.leader_ = false;
+        return move(data.followers_);
+    }
+
+    /** Server of the request to the system configured server. */
+    static const wstring NO_SERVER;
+
+    /** Servers of the lookup of the empty host. It fails right away with one EMPTY_HOST result. */
+    static const vector<wstring> EMPTY_HOST_SERVERS;
+
+    /** Maximum number of interned server lists. */
+    static const size_t MAX_SERVER_LISTS{ 1024 };
+
+    /** Number of shards of the in-flight table. Power of 2. */
+    static const size_t INFLIGHT_SHARDS{ 64 };
+
+    /** Number of buckets of the in-flight shard. Power of 2. */
+    static const size_t INFLIGHT_BUCKETS{ 256 };
+
+    /** Shard of the lookups in flight: hash of host and servers -> chain of leading Data. */
+    struct InflightShard {
+        mutex mut;
+        Data* buckets[INFLIGHT_BUCKETS]{};
+    };
+
+    /** Interned server lists: hash of the servers -> list. */
+    shared_timed_mutex serverListsMutex_;
+    unordered_multimap<size_t, shared_ptr<const vector<wstring>>> serverLists_;
+    atomic<uint64_t> serverListHits_{ 0 };
+    atomic<uint64_t> serverListMisses_{ 0 };
+
+    /** Health of the servers. */
+    unique_ptr<DnsServerStats> stats_;
+
+    /** Latencies and results, null if they are not collected. Declared before the transport, like the cache. */
+    unique_ptr<DnsMetrics> metrics_;
+
+    /** Cache of the answers. Declared before the transport, so it outlives queries completed on transport destruction. */
+    unique_ptr<DnsCache> cache_;
+
+    /** Snapshot of the cache written on destruction. */
+    string cacheFile_;
+
+    /** Lookups in flight which identical lookups can attach to. */
+    InflightShard inflight_[INFLIGHT_SHARDS];
+    bool coalesce_{ true };
+
+    MODE mode_{ MODE::ALL };
+    chrono::milliseconds staggerDelay_{ 0 };
+    chrono::milliseconds timeout_{ 0 };
+    QUERY_TYPES queryTypes_{ QUERY_TYPES::A };
+    SELECTION selection_{ SELECTION::ALL };
+    size_t selectCount_{ 1 };
+    chrono::milliseconds failoverDelay_{ 0 };
+
+    /** Static addresses answered before the cache. Replaced as a whole, so lookups read them without locks. */
+    RcuPtr<DnsHosts> hosts_;
+
+    /** Hosts file watched for changes, its modification time and size. Guarded by hostsMutex_. */
+    mutex hostsMutex_;
+    condition_variable hostsCv_;
+    string hostsPath_;
+    pair<int64_t, int64_t> hostsStamp_;
+    bool stopping_{ false };
+    chrono::milliseconds hostsReloadInterval_{ 0 };
+    thread hostsWatcher_;
+
+    /** Transport used to query DNS servers. */
+    unique_ptr<DnsTransport> transport_;
 };
 
-atomic_int DnsResolver::Impl::contextsAllocated_ = 0;
-atomic_int DnsResolver::Impl::contextsDeleted_ = 0;
+const wstring DnsResolver::Impl::NO_SERVER;
+const vector<wstring> DnsResolver::Impl::EMPTY_HOST_SERVERS{ L"" };
+const uint32_t DnsTransport::DEFAULT_NEGATIVE_TTL;
+
+DnsResolver::DnsResolver() : DnsResolver(DnsTransport::createDefault(), Options()) {}
+
+DnsResolver::DnsResolver(const Options& options) : DnsResolver(DnsTransport::createDefault(), options) {}
+
+DnsResolver::DnsResolver(unique_ptr<DnsTransport> transport) : DnsResolver(move(transport), Options()) {}
+
+DnsResolver::DnsResolver(unique_ptr<DnsTransport> transport, const Options& options)
+    : pImpl_(new Impl(move(transport), options)) {}
 
 void Windscribe::DnsResolver::Lookup(const wstring& host, const vector<wstring>& dns, promise<DataPtr> res)
 {
     pImpl_->Lookup(host, dns, move(res));
 }
 
+void Windscribe::DnsResolver::Lookup(const wstring& host, const vector<wstring>& dns, Completion& completion)
+{
+    pImpl_->Lookup(host, dns, completion);
+}
+
+void Windscribe::DnsResolver::Lookup(const wstring& host, const vector<wstring>& dns, Callback callback)
+{
+    pImpl_->Lookup(host, dns, move(callback));
+}
+
+DnsResolver::BatchPtr Windscribe::DnsResolver::LookupBatch(const wstring* hosts, size_t count, const vector<wstring>& dns, Batch::Callback callback)
+{
+    return pImpl_->LookupBatch(hosts, count, dns, move(callback));
+}
+
+DnsResolver::BatchPtr Windscribe::DnsResolver::LookupBatch(const vector<wstring>& hosts, const vector<wstring>& dns, Batch::Callback callback)
+{
+    return pImpl_->LookupBatch(hosts.data(), hosts.size(), dns, move(callback));
+}
+
+bool Windscribe::DnsResolver::loadHosts(const string& path)
+{
+    return pImpl_->loadHosts(path);
+}
+
+void Windscribe::DnsResolver::setHosts(unique_ptr<const DnsHosts> hosts)
+{
+    pImpl_->setHosts(move(hosts));
+}
+
+void Windscribe::DnsResolver::clearCache()
+{
+    if (pImpl_->cache_)
+        pImpl_->cache_->clear();
+}
+
+bool Windscribe::DnsResolver::saveCache(const string& path) const
+{
+    return pImpl_->cache_ && pImpl_->cache_->save(path);
+}
+
+size_t Windscribe::DnsResolver::loadCache(const string& path)
+{
+    return pImpl_->cache_ ? pImpl_->cache_->load(path) : 0;
+}
+
+vector<DnsServerStats::Snapshot> Windscribe::DnsResolver::serverStats() const
+{
+    return pImpl_->stats_->snapshot();
+}
+
+DnsMetrics::Snapshot Windscribe::DnsResolver::metrics() const
+{
+    auto res = pImpl_->metrics_ ? pImpl_->metrics_->snapshot() : DnsMetrics::Snapshot();
+    if (pImpl_->cache_) {
+        res.cacheHits = pImpl_->cache_->hits();
+        res.cacheMisses = pImpl_->cache_->misses();
+        res.cacheRefreshes = pImpl_->cache_->refreshes();
+        res.cacheStaleHits = pImpl_->cache_->staleHits();
+    }
+    res.queriesInFlight = pImpl_->transport_->inFlight();
+    return res;
+}
+
+DnsResolver::PoolStats Windscribe::DnsResolver::poolStats() const
+{
+    PoolStats res;
+    const auto data = dataPool().stats();
+    res.dataHits = data.hits;
+    res.dataMisses = data.misses;
+    res.dataIdle = data.idle;
+    res.serverListHits = pImpl_->serverListHits_.load(memory_order_relaxed);
+    res.serverListMisses = pImpl_->serverListMisses_.load(memory_order_relaxed);
+    shared_lock<shared_timed_mutex> lock(pImpl_->serverListsMutex_);
+    res.serverLists = pImpl_->serverLists_.size();
+    return res;
+}
+
 /** PIMPL stuff */
 void Windscribe::DnsResolver::ImplDeleter::operator()(DnsResolver::Impl* ptr) const { delete ptr; }
 
+Windscribe::DnsResolver::Batch::Batch(size_t size, Callback callback)
+    : results_(size), callback_(move(callback)), remaining_(size)
+{
+}
+
+void Windscribe::DnsResolver::Batch::wait() const
+{
+    unique_lock<mutex> lock(mut_);
+    cv_.wait(lock, [this]() { return done(); });
+}
+
+bool Windscribe::DnsResolver::Batch::waitFor(chrono::milliseconds timeout) const
+{
+    unique_lock<mutex> lock(mut_);
+    return cv_.wait_for(lock, timeout, [this]() { return done(); });
+}
+
+void Windscribe::DnsResolver::Batch::onResult(size_t index, const DataPtr& data)
+{
+    results_[index] = data;
+    if (callback_)
+        callback_(index, data);
+    if (remaining_.fetch_sub(1, memory_order_acq_rel) == 1) {
+        lock_guard<mutex> lock(mut_);
+        cv_.notify_all();
+    }
+}
+
+Windscribe::DnsResolver::Data::Data(const vector<wstring>& dns, const wstring& host, BatchPtr batch, size_t index)
+    : Data(dns, host, promise<DataPtr>())
+{
+    waiter_.batch = move(batch);
+    waiter_.index = index;
+}
+
+Windscribe::DnsResolver::Data::Data()
+{
+    DNS_TRACE_LOOKUP(DATA_CREATED, this, 0, 0);
+}
+
 Windscribe::DnsResolver::Data::Data(const vector<wstring>& dns, const wstring& host, promise<DataPtr> promise)
-    : host_(host), dns_(dns), promise_(move(promise))
+    : Data()
 {
-    createdCount.fetch_add(1, memory_order_relaxed);
-    log(__FUNCTION__, to_string(createdCount));
-    if (!dns.empty())
-        ips_.resize(dns.size());
-    else
-        ips_.resize(DEFAULT_DNS_SIZE); // @todo avoid hard-code.
+    waiter_.res = move(promise);
+    init(make_shared<const vector<wstring>>(dns), hashServers(dns), host);
+}
+
+void Windscribe::DnsResolver::Data::init(shared_ptr<const vector<wstring>> dns, size_t dnsHash, const wstring& host)
+{
+    lookup_++;
+    host_.assign(host);
+    dns_ = move(dns);
+    dnsHash_ = dnsHash;
+    ips_.resize(dns_->empty() ? DEFAULT_DNS_SIZE : dns_->size());
+    for (auto& ip : ips_)
+        ip.reset();
     maxCount_ = static_cast<int>(ips_.size());
+    resetOverflow();
+    types_ = QUERY_TYPES::A;
+    processedCount_.store(0, memory_order_relaxed);
+    mode_ = MODE::ALL;
+    deadline_ = chrono::steady_clock::time_point::max();
+    start_ = {};
+    done_.store(0, memory_order_relaxed);
+    sent_.store(0, memory_order_relaxed);
+    waiting_.clear();
+    standby_ = 0;
+    nextWaiting_.store(0, memory_order_relaxed);
+    impl_ = nullptr;
+    key_ = 0;
+    leader_ = false;
+    refresh_ = false;
+    nextLeader_ = nullptr;
+}
+
+void Windscribe::DnsResolver::Data::recycle()
+{
+    // Completed promise is released, so the next lookup moves its promise into the empty one.
+    promise<DataPtr> released(move(waiter_.res));
+    waiter_.completion = nullptr;
+    waiter_.callback = nullptr;
+    waiter_.batch.reset();
+    waiter_.index = 0;
+    followers_.clear();
+    dns_.reset();
+    impl_ = nullptr;
+}
+
+size_t Windscribe::DnsResolver::Data::hashServers(const vector<wstring>& dns)
+{
+    const std::hash<wstring> hasher;
+    size_t res{ dns.size() };
+    for (const auto& server : dns)
+        res ^= hasher(server) + 0x9e3779b97f4a7c15ULL + (res << 6) + (res >> 2);
+    return res;
+}
+
+const wstring& Windscribe::DnsResolver::Data::server(int ind) const
+{
+    return dns_->empty() ? Impl::NO_SERVER : (*dns_)[ind / queriesPerServer()];
 }
 
 Windscribe::DnsResolver::Data::~Data()
 {
-    deletedCount.fetch_add(1, memory_order_relaxed);
-    log(__FUNCTION__, to_string(deletedCount));
+    DNS_TRACE_LOOKUP(DATA_DELETED, this, 0, 0);
+}
+
+void Windscribe::DnsResolver::Data::onError(int ind, RESULT_CODE code, uint32_t ttl)
+{
+    DNS_TRACE_QUERY(QUERY_ERROR, this, ind, code);
+    if (impl_ && ind < maxCount_)
+        impl_->onServerResult(*this, ind, code, ttl);
+    if (ind < maxCount_ && code != RESULT_CODE::SUCCESS && claim(ind)) {
+        part(ind).reset(code);
+        if (impl_ && code == RESULT_CODE::NOT_RESOLVED)
+            impl_->toCache(*this, ind, ttl);
+        // The server failed, so the next one does not wait for its turn. The server answered, so standby servers are not needed.
+        // Done before settle(), which may finish Data.
+        if (impl_ && code != RESULT_CODE::CANCELLED && !waiting_.empty()) {
+            if (code == RESULT_CODE::NOT_RESOLVED && ttl && mode_ != MODE::STAGGERED) {
+                if (standby_ < waiting_.size())
+                    impl_->dropStandby(DataPtr(this), ind);
+            }
+            else if (serverDone(ind))
+                impl_->expedite(DataPtr(this));
+        }
+        settle(1);
+    }
+}
+
+void Windscribe::DnsResolver::Data::onIpResolved(int ind, vector<IpAddress>&& addresses, uint32_t ttl)
+{
+    onIpResolved(ind, addresses.data(), addresses.size(), ttl);
+}
+
+void Windscribe::DnsResolver::Data::onIpResolved(int ind, const IpAddress* addresses, size_t count, uint32_t ttl)
+{
+    DNS_TRACE_QUERY(QUERY_ANSWER, this, ind, count);
+    if (impl_ && ind < maxCount_)
+        impl_->onServerResult(*this, ind, RESULT_CODE::SUCCESS, ttl);
+    if (ind < maxCount_ && claim(ind)) {
+        auto& res = part(ind);
+        res.reset();
+        res.addresses.assign(addresses, addresses + count);
+        if (impl_)
+            impl_->toCache(*this, ind, ttl);
+        if (impl_ && standby_ < waiting_.size())
+            impl_->dropStandby(DataPtr(this), ind);
+        settle(cancellable() ? 1 + cancelRest(ind) : 1);
+    }
+}
+
+void Windscribe::DnsResolver::Data::resetOverflow()
+{
+    if (maxCount_ <= MAX_TRACKED)
+        return;
+    const size_t size = maxCount_ - MAX_TRACKED;
+    if (size > overflowCapacity_) {
+        overflow_.reset(new atomic<uint8_t>[size]);
+        overflowCapacity_ = size;
+    }
+    for (size_t i = 0; i < size; ++i)
+        overflow_[i].store(0, memory_order_relaxed);
+}
+
+bool Windscribe::DnsResolver::Data::isDone(int ind) const
+{
+    if (ind >= MAX_TRACKED)
+        return ind < maxCount_ && (overflow_[ind - MAX_TRACKED].load(memory_order_acquire) & OVERFLOW_DONE) != 0;
+    return (done_.load(memory_order_acquire) & (1ULL << ind)) != 0;
+}
+
+bool Windscribe::DnsResolver::Data::markSent(int ind)
+{
+    if (ind >= MAX_TRACKED) {
+        if (ind < maxCount_ && (overflow_[ind - MAX_TRACKED].fetch_or(OVERFLOW_SENT, memory_order_acq_rel) & OVERFLOW_SENT))
+            return false;
+    }
+    else {
+        const uint64_t bit = 1ULL << ind;
+        if (sent_.fetch_or(bit, memory_order_acq_rel) & bit)
+            return false;
+    }
+    if (static_cast<size_t>(ind) < sentAt_.size())
+        sentAt_[ind] = chrono::steady_clock::now();
+    return true;
+}
+
+bool Windscribe::DnsResolver::Data::isSent(int ind) const
+{
+    if (ind >= MAX_TRACKED)
+        return ind < maxCount_ && (overflow_[ind - MAX_TRACKED].load(memory_order_acquire) & OVERFLOW_SENT) != 0;
+    return (sent_.load(memory_order_acquire) & (1ULL << ind)) != 0;
 }
 
-void Windscribe::DnsResolver::Data::onError(int ind, RESULT_CODE code)
+bool Windscribe::DnsResolver::Data::serverDone(int ind) const
 {
-    DnsResolver::log(__FUNCTION__, to_string(ind) + " " + DnsResolver::toString(code));
-    if (ind < ips_.size() && code != RESULT_CODE::SUCCESS) {
-        ips_[ind] = ResIp(L"", code);
-        processedCount_.fetch_add(1, memory_order_seq_cst);
-        if (processedCount_ == maxCount_)
-            onFinish();
+    const int per = queriesPerServer();
+    const int first = ind / per * per;
+    for (int i = first; i < first + per; ++i) {
+        if (!isDone(i))
+            return false;
     }
+    return true;
 }
 
-void Windscribe::DnsResolver::Data::onIpResolved(int ind, wstring&& ip)
+bool Windscribe::DnsResolver::Data::claim(int ind)
 {
-    DnsResolver::log(__FUNCTION__, to_string(ind) + " " + boost::locale::conv::utf_to_utf<char>(ip));
-    if (ind <= ips_.size()) {
-        ips_[ind] = ResIp(ip); // @todo Provide move-ctor for ResIp.
-        processedCount_.fetch_add(1, memory_order_seq_cst);
-        if (processedCount_ == maxCount_)
-            onFinish();
+    if (ind >= MAX_TRACKED)
+        return (overflow_[ind - MAX_TRACKED].fetch_or(OVERFLOW_DONE, memory_order_acq_rel) & OVERFLOW_DONE) == 0;
+    const uint64_t bit = 1ULL << ind;
+    return (done_.fetch_or(bit, memory_order_acq_rel) & bit) == 0;
+}
+
+int Windscribe::DnsResolver::Data::cancelRest(int ind)
+{
+    // Other queries of the answered server are not cancelled, their addresses are the part of the answer.
+    const int per = queriesPerServer();
+    const int own = ind / per * per;
+    const uint64_t ownBits = own >= MAX_TRACKED ? 0 : ((1ULL << per) - 1) << own;
+    const uint64_t all = (maxCount_ >= MAX_TRACKED ? ~0ULL : (1ULL << maxCount_) - 1) & ~ownBits;
+    const uint64_t cancelled = all & ~done_.fetch_or(all, memory_order_acq_rel);
+
+    // Results of the cancelled queries are written before settle(), so they are visible to the caller.
+    int count{ 0 };
+    for (int ind = 0; ind < maxCount_; ++ind) {
+        const bool claimed = ind < MAX_TRACKED ? (cancelled & (1ULL << ind)) != 0 : ind / per != own / per && claim(ind);
+        if (claimed) {
+            part(ind).reset(RESULT_CODE::CANCELLED);
+            if (impl_) {
+                impl_->onOvertaken(*this, ind);
+                impl_->cancel(DataPtr(this), ind);
+            }
+            count++;
+        }
     }
+    return count;
+}
+
+void Windscribe::DnsResolver::Data::settle(int count)
+{
+    if (processedCount_.fetch_add(count, memory_order_acq_rel) + count == maxCount_)
+        onFinish();
 }
 
 void Windscribe::DnsResolver::Data::onFinish()
 {
-    log(__FUNCTION__);
-    promise_.set_value(shared_from_this());
+    DNS_TRACE_LOOKUP(FINISH, this, maxCount_, 0);
+    if (queriesPerServer() > 1)
+        mergeParts();
+    if (impl_)
+        impl_->onFinish(*this);
+    const DataPtr self(this);
+    auto followers = leader_ ? impl_->detach(*this) : vector<Waiter>();
+    waiter_.complete(self);
+    for (auto& follower : followers)
+        follower.complete(self);
+}
+
+void Windscribe::DnsResolver::Data::setQueryTypes(QUERY_TYPES types)
+{
+    types_ = types;
+    const int per = queriesPerServer();
+    maxCount_ = static_cast<int>(ips_.size()) * per;
+    resetOverflow();
+    sentAt_.assign(maxCount_, chrono::steady_clock::time_point());
+    if (per == 1)
+        return;
+    if (parts_.size() < static_cast<size_t>(maxCount_))
+        parts_.resize(maxCount_);
+    for (int ind = 0; ind < maxCount_; ++ind)
+        parts_[ind].reset();
+}
+
+uint16_t Windscribe::DnsResolver::Data::queryType(int ind) const
+{
+    switch (types_) {
+    case QUERY_TYPES::AAAA:         return DnsMessage::TYPE_AAAA;
+    case QUERY_TYPES::A_AND_AAAA:   return ind % 2 ? DnsMessage::TYPE_AAAA : DnsMessage::TYPE_A;
+    default:                        return DnsMessage::TYPE_A;
+    }
+}
+
+void Windscribe::DnsResolver::Data::mergeParts()
+{
+    const int per = queriesPerServer();
+    for (size_t server = 0; server < ips_.size(); ++server) {
+        auto& res = ips_[server];
+        res.reset(RESULT_CODE::CANCELLED);
+        for (int i = 0; i < per; ++i) {
+            auto& p = parts_[server * per + i];
+            if (p.resCode == RESULT_CODE::SUCCESS) {
+                res.addresses.insert(res.addresses.end(), p.addresses.begin(), p.addresses.end());
+                res.resCode = RESULT_CODE::SUCCESS;
+            }
+            // Without addresses the server reports the error of its first query which was not cancelled.
+            else if (res.resCode == RESULT_CODE::CANCELLED)
+                res.resCode = p.resCode;
+        }
+    }
+}
+
+void Windscribe::DnsResolver::Data::Waiter::complete(const DataPtr& data)
+{
+    if (batch)
+        batch->onResult(index, data);
+    else if (completion)
+        completion->complete(data);
+    else if (callback)
+        callback(data);
+    else
+        res.set_value(data);
+}
+
+namespace Windscribe {
+
+void intrusive_ptr_add_ref(DnsResolver::Data* data)
+{
+    data->refs_.fetch_add(1, memory_order_relaxed);
+}
+
+void intrusive_ptr_release(DnsResolver::Data* data)
+{
+    // Release publishes writes of this owner, acquire makes writes of all owners visible to the recycling thread.
+    if (data->refs_.fetch_sub(1, memory_order_acq_rel) == 1) {
+        data->recycle();
+        dataPool().release(data);
+    }
+}
+
+}
+
+const DataPtr& Windscribe::DnsResolver::Completion::get() const
+{
+    if (!done()) {
+        unique_lock<mutex> lock(mut_);
+        cv_.wait(lock, [this]() { return done(); });
+    }
+    return data_;
+}
+
+bool Windscribe::DnsResolver::Completion::waitFor(chrono::milliseconds timeout) const
+{
+    if (done())
+        return true;
+    unique_lock<mutex> lock(mut_);
+    return cv_.wait_for(lock, timeout, [this]() { return done(); });
+}
+
+Windscribe::DnsResolver::Completion::~Completion()
+{
+    // Waiter which saw done() may delete the completion while complete() still holds the lock, so wait for it.
+    lock_guard<mutex> lock(mut_);
+}
+
+void Windscribe::DnsResolver::Completion::reset()
+{
+    lock_guard<mutex> lock(mut_);
+    data_.reset();
+    done_.store(false, memory_order_relaxed);
+}
+
+void Windscribe::DnsResolver::Completion::complete(const DataPtr& data)
+{
+    // Notified under the lock: the waiter may destroy the completion as soon as it sees it done.
+    lock_guard<mutex> lock(mut_);
+    data_ = data;
+    done_.store(true, memory_order_release);
+    cv_.notify_all();
+}
+
+void Windscribe::DnsResolver::ResIp::reset(RESULT_CODE code)
+{
+    addresses.clear();
+    resCode = code;
+}
+
+wstring Windscribe::DnsResolver::ResIp::toWString() const
+{
+    wstring res;
+    for (const auto& address : addresses) {
+        if (!res.empty())
+            res += L' ';
+        res += address.toWString();
+    }
+    return res;
 }
 
 void Windscribe::DnsResolver::Data::print(int id) const
@@ -379,10 +1131,8 @@ void Windscribe::DnsResolver::Data::print(int id) const
         res = L"\t";
         res += boost::locale::conv::utf_to_utf<wchar_t>(DnsResolver::toString(ip.resCode));
         res += L" ";
-        res += ip.ip;
+        res += ip.toWString();
         BOOST_LOG_TRIVIAL(debug) << res;
     }
 }
 
-atomic_int Windscribe::DnsResolver::Data::createdCount = 0;
-atomic_int Windscribe::DnsResolver::Data::deletedCount = 0;
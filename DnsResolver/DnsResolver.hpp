@@ -1,21 +1,43 @@
 #pragma once
 
+#ifdef _WIN32
 #include <winerror.h>
+#endif
+
+#include "DnsHosts.hpp"
+#include "DnsMetrics.hpp"
+#include "DnsServerStats.hpp"
+#include "IntrusivePtr.hpp"
+#include "IpAddress.hpp"
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
 #include <future>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define DNS_RESOLVER_COROUTINES 1
+#endif
+
 using namespace std;
 
 namespace Windscribe { 
 
+class DnsTransport;
+
 /** Simple async thread-safe DNS resolver. */
 class DnsResolver
 {
+    struct Impl;
+
 public:
 
     /** Result code of the resolution on one DNS server. */
@@ -23,33 +45,178 @@ public:
         SUCCESS,
         EMPTY_HOST,
         NOT_RESOLVED,
-        INTERNAL_ERROR
+        INTERNAL_ERROR,
+        CANCELLED,
+        TIMEOUT
+    };
+
+    /** When the lookup is finished. */
+    enum class MODE {
+        /** After every DNS server answered or failed. */
+        ALL,
+
+        /** After the first successful answer. Queries to the other servers are cancelled. */
+        FIRST_ANSWER,
+
+        /** As FIRST_ANSWER, but query to the next server is sent only if no server answered within Options::staggerDelay.
+        * If the servers queried before failed, the next server is queried right away.
+        */
+        STAGGERED
     };
 
-    /** Resulting ip of the DNS resolution. 
-    * If ip is empty then resCode contains error occured.
+    /** Address records queried on every server. */
+    enum class QUERY_TYPES {
+        A,
+        AAAA,
+
+        /** A and AAAA are queried in parallel and addresses of both are returned in one ResIp. */
+        A_AND_AAAA
+    };
+
+    /** Which DNS servers of the lookup are queried. */
+    enum class SELECTION {
+        /** Every server. */
+        ALL,
+
+        /** Options::selectCount fastest healthy servers and demoted servers due for probing. The rest are standby:
+        * the next one is queried if the selected servers fail or do not answer within Options::failoverDelay.
+        * Standby servers not queried yet are CANCELLED once a server answers.
+        */
+        FASTEST
+    };
+
+    /** Resulting ips of the DNS resolution on one server.
+    * If addresses are empty then resCode contains error occured.
     */
     struct ResIp {
         ResIp() = default;
-        ResIp(const wstring& ip, RESULT_CODE resCode = RESULT_CODE::SUCCESS) : ip(ip), resCode(resCode) {}
-        wstring ip;
+        explicit ResIp(RESULT_CODE resCode) : resCode(resCode) {}
+        explicit ResIp(vector<IpAddress>&& addresses) : addresses(move(addresses)) {}
+
+        /** Addresses in order of the answer. */
+        vector<IpAddress> addresses;
         RESULT_CODE resCode{};
+
+        /** Formats addresses separated by space. */
+        wstring toWString() const;
+
+        /** Sets code and removes addresses keeping their capacity. */
+        void reset(RESULT_CODE code = RESULT_CODE::SUCCESS);
+    };
+
+    struct Data;
+
+    /** Reference to Data. The counter is stored in Data, so references need no separate allocation. */
+    using DataPtr = IntrusivePtr<Data>;
+
+    /** Receiver of the result of the single lookup without shared state.
+    * Owned by the caller, which keeps it alive until the lookup is done. May be reused after reset().
+    */
+    class Completion {
+    public:
+        Completion() = default;
+        ~Completion();
+        Completion(const Completion&) = delete;
+        Completion& operator=(const Completion&) = delete;
+
+        /** Waits until the lookup is done and returns its Data. */
+        const DataPtr& get() const;
+
+        /** Waits until the lookup is done or timeout expires.
+        * @return true if the lookup is done.
+        */
+        bool waitFor(chrono::milliseconds timeout) const;
+
+        bool done() const { return done_.load(memory_order_acquire); }
+
+        /** Prepares completion for the next lookup. Must not be called while the lookup is in flight. */
+        void reset();
+
+    private:
+        friend struct Data;
+
+        void complete(const DataPtr& data);
+
+        DataPtr data_;
+        atomic<bool> done_{ false };
+        mutable mutex mut_;
+        mutable condition_variable cv_;
+    };
+
+    /** Called with Data of the single lookup when it is done.
+    * Called by the thread which finished the lookup: the I/O thread of the transport or the caller if the answer is cached.
+    */
+    using Callback = function<void(const DataPtr& data)>;
+
+    /** Completion of the batch lookup. Collects Data of all hosts of the batch. */
+    class Batch {
+    public:
+        /** Called for every host of the batch when it is resolved.
+        * @param index Index of the host in the batch.
+        */
+        using Callback = function<void(size_t index, const DataPtr& data)>;
+
+        Batch(size_t size, Callback callback);
+
+        /** Waits until all hosts are resolved. */
+        void wait() const;
+
+        /** Waits until all hosts are resolved or timeout expires.
+        * @return true if all hosts are resolved.
+        */
+        bool waitFor(chrono::milliseconds timeout) const;
+
+        /** Returns true if all hosts are resolved. */
+        bool done() const { return remaining_.load(memory_order_acquire) == 0; }
+
+        /** Number of hosts in the batch. */
+        size_t size() const { return results_.size(); }
+
+        /** Data of the hosts in order of the hosts. Data of the host is set when it is resolved. */
+        const vector<DataPtr>& results() const { return results_; }
+
+    private:
+        friend struct Data;
+
+        /** Stores Data of the resolved host and wakes up waiters when the last host is resolved. */
+        void onResult(size_t index, const DataPtr& data);
+
+        vector<DataPtr> results_;
+        Callback callback_;
+        atomic<size_t> remaining_{ 0 };
+        mutable mutex mut_;
+        mutable condition_variable cv_;
     };
 
-    /** Incapsulates data of the DNS resolution. */
-    struct Data : public enable_shared_from_this<Data> {
-        using DataPtr = shared_ptr<DnsResolver::Data>;
+    using BatchPtr = shared_ptr<Batch>;
 
+    /** Incapsulates data of the DNS resolution.
+    * Data is reference counted by DataPtr. When the last reference is dropped, Data returns to the pool of the resolvers.
+    */
+    struct Data {
         Data(const vector<wstring>& dns, const wstring& host, promise<DataPtr> promise);
+
+        /** Creates Data of the host at index of the batch. */
+        Data(const vector<wstring>& dns, const wstring& host, BatchPtr batch, size_t index);
         ~Data();
 
         const vector<ResIp>& ips() const { return ips_; }
 
-        /** Called if error was occured during resolution on some DNS server. */
-        void onError(int ind, RESULT_CODE code);
+        /** Called if error was occured during resolution on some DNS server.
+        * @param ind Index of the query, see queryType().
+        * @param ttl Time in seconds the negative answer may be cached. Zero for errors which are not answers of the server.
+        */
+        void onError(int ind, RESULT_CODE code, uint32_t ttl = 0);
+
+        /** Called if ips were resolved on some DNS server.
+        * @param ind Index of the query, see queryType().
+        * @param addresses All addresses of the answer. Must not be empty.
+        * @param ttl Time to live of the answer in seconds. Zero means the answer is not cached.
+        */
+        void onIpResolved(int ind, vector<IpAddress>&& addresses, uint32_t ttl = 0);
 
-        /** Called if ip was resolved on some DNS server. */
-        void onIpResolved(int ind, wstring&& ip);
+        /** Same as above, addresses are copied, so the transport may reuse its buffer. */
+        void onIpResolved(int ind, const IpAddress* addresses, size_t count, uint32_t ttl = 0);
 
         /** Called if DNS resolution for the given host is done. */
         void onFinish();
@@ -57,61 +224,388 @@ public:
         /** Prints information about Data. */
         void print(int id = -1) const;
 
+        /** Returns true if result of the DNS server at ind is already set or its query is cancelled.
+        * Transports use it to skip queries nobody waits for.
+        */
+        bool isDone(int ind) const;
+
+        /** Marks query at ind as started by the transport now. Returns false if it is started already,
+        * so the delayed query expedited by DnsTransport::Expedite() is not sent twice.
+        * RTT of the server is measured from this time.
+        */
+        bool markSent(int ind);
+
+        /** Returns true if query at ind is started by the transport. */
+        bool isSent(int ind) const;
+
+        /** Returns true if queries of the Data can be cancelled before they are answered. */
+        bool cancellable() const { return mode_ != MODE::ALL; }
+
+        /** Record type of the query at ind. Every server has queriesPerServer() consecutive queries:
+        * A and AAAA if both are queried, so query ind goes to server ind / queriesPerServer().
+        */
+        uint16_t queryType(int ind) const;
+
+        int queriesPerServer() const { return types_ == QUERY_TYPES::A_AND_AAAA ? 2 : 1; }
+
+        /** Time the lookup must be finished by. Servers not answered by then report TIMEOUT. */
+        chrono::steady_clock::time_point deadline() const { return deadline_; }
+
+        const wstring& host() const { return host_; }
+
+        /** Number of the lookup Data is used for. Changes when the pooled Data is reused. */
+        uint32_t lookup() const { return lookup_; }
+
+        /** DNS server the query at ind is sent to. Empty means system configured server. */
+        const wstring& server(int ind) const;
+
     private:
+        friend struct DnsResolver::Impl;
+
+        /** Data of the pooled lookups, reinitialized by init(). */
+        Data();
+
+        /** Prepares Data for the lookup of the host. Buffers of the previous lookup are reused. */
+        void init(shared_ptr<const vector<wstring>> dns, size_t dnsHash, const wstring& host);
+
+        /** Drops references to the receivers and to the servers when Data is returned to the pool. */
+        void recycle();
+
         /** Resolved ips and occured errors. Size of the vector is equal to the count of DNS servers. */
         vector<ResIp> ips_;
 
         /** Host to resolve. */
         wstring host_;
 
-        /** Provided by user DNS servers. */
-        vector<wstring> dns_;
+        /** Provided by user DNS servers. Lookups with the same servers share one list. */
+        shared_ptr<const vector<wstring>> dns_;
+
+        /** Hash of the servers. Used to find identical lookups in flight. */
+        size_t dnsHash_{ 0 };
 
-        /** Technical member equal to the number of DNS servers. 
+        /** Technical member equal to the number of queries: DNS servers times queries per server.
         * Used to control when resolution is finished.
         */
         int maxCount_{ 0 };
 
-        /** Promise used by caller to get the result. */
-        promise<DataPtr> promise_;
+        /** Record types queried. */
+        QUERY_TYPES types_{ QUERY_TYPES::A };
+
+        /** Results of the queries if there are several queries per server. Merged into ips_ when Data is finished.
+        * Kept between lookups of the pooled Data, so it may be larger than maxCount_.
+        */
+        vector<ResIp> parts_;
+
+        /** Sets record types queried. Must be called before any result is set. */
+        void setQueryTypes(QUERY_TYPES types);
+
+        /** Result of the query at ind. */
+        ResIp& part(int ind) { return queriesPerServer() == 1 ? ips_[ind] : parts_[ind]; }
+        const ResIp& part(int ind) const { return queriesPerServer() == 1 ? ips_[ind] : parts_[ind]; }
+
+        /** Merges results of the queries of every server into ips_: addresses of A first, then AAAA. */
+        void mergeParts();
+
+        /** Receiver of the result: promise, completion or callback of the single lookup or host of the batch. */
+        struct Waiter {
+            promise<DataPtr> res;
+            Completion* completion{ nullptr };
+            Callback callback;
+            BatchPtr batch;
+            size_t index{ 0 };
+
+            void complete(const DataPtr& data);
+        };
 
-        /** Tracks count of the already processed DNS servers. */
+        /** Used by caller to get the result. */
+        Waiter waiter_;
+
+        /** Tracks count of the already processed queries. Data is finished by the thread whose settle() reaches maxCount_. */
         atomic_int processedCount_{ 0 };
 
+        /** Number of DataPtr referencing Data. */
+        atomic<uint32_t> refs_{ 0 };
+
+        friend void intrusive_ptr_add_ref(Data* data);
+        friend void intrusive_ptr_release(Data* data);
+
+        /** Mode of the lookup. */
+        MODE mode_{ MODE::ALL };
+
+        chrono::steady_clock::time_point deadline_{ chrono::steady_clock::time_point::max() };
+
+        /** Time queries of the lookup were submitted. Used to measure RTT of the servers. */
+        chrono::steady_clock::time_point start_;
+
+        /** Bit per query whose result is set or cancelled, for the first MAX_TRACKED queries. */
+        atomic<uint64_t> done_{ 0 };
+
+        /** Bit per query started by the transport, for the first MAX_TRACKED queries. */
+        atomic<uint64_t> sent_{ 0 };
+
+        /** DONE and SENT flags of the queries after the first MAX_TRACKED. Kept by the pooled Data for the next lookups. */
+        unique_ptr<atomic<uint8_t>[]> overflow_;
+        size_t overflowCapacity_{ 0 };
+        static const uint8_t OVERFLOW_DONE{ 1 };
+        static const uint8_t OVERFLOW_SENT{ 2 };
+
+        /** Clears flags of the queries after the first MAX_TRACKED, allocates them if there are more queries than before. */
+        void resetOverflow();
+
+        /** Time the queries were started by the transport, see markSent(). Default value if it is not known. */
+        vector<chrono::steady_clock::time_point> sentAt_;
+
+        /** Servers whose queries are delayed in order of their turns and position of the next one to expedite. */
+        vector<int> waiting_;
+        atomic<size_t> nextWaiting_{ 0 };
+
+        /** Position of the first standby server of FASTEST selection in waiting_. */
+        size_t standby_{ 0 };
+
+        /** Returns true if all queries of the server of the query at ind are done. */
+        bool serverDone(int ind) const;
+
+        /** Marks result of the server at ind as set. Returns false if it is already set or cancelled. */
+        bool claim(int ind);
+
+        /** Cancels queries of the servers other than server of the query at ind, whose result is not set yet.
+        * Returns number of cancelled queries.
+        */
+        int cancelRest(int ind);
+
+        /** Adds count processed servers and finishes Data if all servers are processed. */
+        void settle(int count);
+
+        /** Resolver the Data belongs to. Used to cache answers and to complete coalesced lookups. */
+        Impl* impl_{ nullptr };
+
+        /** Incremented by init(), so queries of the previous lookup of the pooled Data are told apart. */
+        uint32_t lookup_{ 0 };
+
+        /** Hash of the host and DNS servers. Identifies Data among lookups in flight. */
+        size_t key_{ 0 };
+
+        /** True if identical lookups may attach to this Data while it is in flight. */
+        bool leader_{ false };
+
+        /** True if Data refreshes the cached answer and nobody waits for it. */
+        bool refresh_{ false };
+
+        /** Next leader in the bucket of the in-flight table, so the table does not allocate. */
+        Data* nextLeader_{ nullptr };
+
+        /** Queries not answered from the cache. Kept to reuse the buffer. */
+        vector<int> missed_;
+
+        /** Receivers of the identical lookups attached to this Data. Guarded by the in-flight table of the resolver. */
+        vector<Waiter> followers_;
+
         /** If there are not user defined dns there is one resolved ip. */
         static const int DEFAULT_DNS_SIZE{ 1 };
 
-        /** @debug To track number of allocated Data objects. */
-        static atomic_int createdCount;
+        /** Number of queries tracked by done_ and sent_. The rest are tracked by overflow_. */
+        static const int MAX_TRACKED{ 64 };
+
+        /** Hashes servers of the lookup. */
+        static size_t hashServers(const vector<wstring>& dns);
+    };
+
+    /** Options of the resolver. */
+    struct Options {
+        /** Maximum number of cached answers. Zero disables the cache. */
+        size_t cacheCapacity{ 65536 };
+
+        /** Upper bound of TTL of the cached positive answers in seconds. */
+        uint32_t maxCacheTtl{ 86400 };
+
+        /** Upper bound of TTL of the cached negative answers (NOT_RESOLVED) in seconds. */
+        uint32_t maxNegativeCacheTtl{ 30 };
+
+        /** Percent of TTL left when the cached answer of the hot name is refreshed in background. Zero disables prefetch. */
+        uint32_t prefetchPercent{ 10 };
+
+        /** Number of cache hits since the answer was stored which make its name hot. */
+        uint32_t prefetchHits{ 3 };
+
+        /** Seconds the expired answer is still answered from the cache while it is refreshed in background,
+        * so lookups do not wait for the slow or failed servers. Zero disables serve-stale.
+        */
+        uint32_t staleCacheTtl{ 0 };
+
+        /** Cache snapshot loaded at start and written when the resolver is destroyed, see loadCache(). Empty means none. */
+        string cacheFile;
+
+        /** If true, identical lookups made while one is in flight wait for its result instead of querying servers again. */
+        bool coalesceLookups{ true };
+
+        /** When lookups are finished. */
+        MODE mode{ MODE::ALL };
+
+        /** Delay between queries to the consecutive servers in STAGGERED mode. */
+        chrono::milliseconds staggerDelay{ 100 };
+
+        /** Maximum duration of the lookup. Servers not answered in time report TIMEOUT. Zero means no deadline. */
+        chrono::milliseconds timeout{ 5000 };
 
-        /** @debug To track number of deleted Data objects. */
-        static atomic_int deletedCount;
+        /** Address records queried on every server. */
+        QUERY_TYPES queryTypes{ QUERY_TYPES::A_AND_AAAA };
+
+        /** Which servers are queried. */
+        SELECTION selection{ SELECTION::ALL };
+
+        /** Number of servers queried in FASTEST selection. */
+        size_t selectCount{ 1 };
+
+        /** Delay between queries to the consecutive standby servers in FASTEST selection. */
+        chrono::milliseconds failoverDelay{ 500 };
+
+        /** Number of consecutive failures after which the server is demoted and only probed. */
+        int failuresToDemote{ 3 };
+
+        /** Interval between probe queries to the demoted server. */
+        chrono::milliseconds probeInterval{ 5000 };
+
+        /** If false, latencies and results are not recorded and metrics() has only counters of the cache and the transport. */
+        bool collectMetrics{ true };
+
+        /** Hosts file loaded at start, see loadHosts(). Empty means no static hosts. */
+        string hostsFile;
+
+        /** Interval between checks of the hosts file for changes. Zero disables reloading. */
+        chrono::milliseconds hostsReloadInterval{ 1000 };
     };
 
     /** Lookups DNS serveres to resolve host. 
+    * Answers are taken from the cache if possible, in this case res is fulfilled synchronously.
+    * Cached answers of the hot names close to expiry and the stale answers are refreshed by the queries sent along.
+    * Lookup of the same host on the same servers as the lookup in flight is attached to it and gets the same Data.
+    * In FIRST_ANSWER and STAGGERED modes res is fulfilled by the first successful answer and the rest of servers are CANCELLED.
     * @param host Host to resolve.
     * @param dns Dns servers.
     * @param res Promise to return the result to the caller.
     */
-    void Lookup(const wstring& host, const vector<wstring>& dns, promise<shared_ptr<DnsResolver::Data>> res);
+    void Lookup(const wstring& host, const vector<wstring>& dns, promise<DataPtr> res);
+
+    /** Same as above, the result is returned to completion, which does not allocate shared state like promise. */
+    void Lookup(const wstring& host, const vector<wstring>& dns, Completion& completion);
+
+    /** Same as above, callback is called with the result. No thread waits for the lookup. */
+    void Lookup(const wstring& host, const vector<wstring>& dns, Callback callback);
+
+#ifdef DNS_RESOLVER_COROUTINES
+    /** Lookup awaited by the coroutine: DataPtr data = co_await resolver.resolve(host, dns).
+    * The coroutine is resumed by the thread which finished the lookup, or is not suspended if the answer is cached.
+    */
+    class Awaitable {
+    public:
+        Awaitable(DnsResolver& resolver, const wstring& host, const vector<wstring>& dns)
+            : resolver_(resolver), host_(host), dns_(dns) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(coroutine_handle<> handle) {
+            handle_ = handle;
+            resolver_.Lookup(host_, dns_, [this](const DataPtr& data) {
+                data_ = data;
+                // The second of the callback and await_suspend() continues the coroutine.
+                if (arrived_.exchange(true, memory_order_acq_rel))
+                    handle_.resume();
+            });
+            return !arrived_.exchange(true, memory_order_acq_rel);
+        }
+
+        DataPtr await_resume() { return move(data_); }
+
+    private:
+        DnsResolver& resolver_;
+        const wstring& host_;
+        const vector<wstring>& dns_;
+        coroutine_handle<> handle_;
+        DataPtr data_;
+        atomic<bool> arrived_{ false };
+    };
+
+    /** Returns lookup for co_await. Host and dns must outlive the co_await expression. */
+    Awaitable resolve(const wstring& host, const vector<wstring>& dns = {}) { return Awaitable(*this, host, dns); }
+#endif
+
+    /** Lookups DNS servers to resolve all hosts at once.
+    * Queries of all hosts are submitted to the transport together, so they are sent without waiting for each other.
+    * @param hosts Hosts to resolve.
+    * @param count Number of hosts.
+    * @param dns Dns servers used for every host.
+    * @param callback Optional callback called for every host when it is resolved. Called by the thread resolved the host.
+    * @return Completion of the batch with Data of every host.
+    */
+    BatchPtr LookupBatch(const wstring* hosts, size_t count, const vector<wstring>& dns, Batch::Callback callback = nullptr);
+    BatchPtr LookupBatch(const vector<wstring>& hosts, const vector<wstring>& dns, Batch::Callback callback = nullptr);
+
+    /** Creates resolver with the native transport of the current platform. */
+    DnsResolver();
+
+    /** Creates resolver with the native transport of the current platform. */
+    explicit DnsResolver(const Options& options);
+
+    /** Creates resolver with the given transport. */
+    explicit DnsResolver(unique_ptr<DnsTransport> transport);
+    DnsResolver(unique_ptr<DnsTransport> transport, const Options& options);
 
-    DnsResolver() = default;
     DnsResolver(DnsResolver&&) = default;            
     DnsResolver& operator=(DnsResolver&&) = default;
     ~DnsResolver();
 
+    /** Loads the hosts file. Its names are answered from memory, before the cache and without queries to any server:
+    * A and AAAA queries get addresses of their family or NOT_RESOLVED. The file is reloaded when it changes.
+    * @return false if the file can't be read, hosts loaded before are kept then.
+    */
+    bool loadHosts(const string& path);
+
+    /** Replaces the static hosts, e.g. by the zone built with DnsHosts::Builder. Null removes them. */
+    void setHosts(unique_ptr<const DnsHosts> hosts);
+
+    /** Removes all cached answers. */
+    void clearCache();
+
+    /** Writes the cached answers to the snapshot file, so the next process can start with them.
+    * @return false if the cache is disabled or the file can't be written.
+    */
+    bool saveCache(const string& path) const;
+
+    /** Adds the cached answers of the snapshot file written by saveCache(). The file is mapped into memory, not parsed,
+    * and TTLs are reduced by the time passed since it was written.
+    * @return Number of answers added.
+    */
+    size_t loadCache(const string& path);
+
+    /** Returns health statistics of the DNS servers used so far. */
+    vector<DnsServerStats::Snapshot> serverStats() const;
+
+    /** Returns latencies, result counters, cache hits and queries in flight. Use DnsMetrics::Snapshot::write() to export them. */
+    DnsMetrics::Snapshot metrics() const;
+
+    /** Counters of the pooled allocations. Hits are objects reused, misses are objects allocated on the heap. */
+    struct PoolStats {
+        /** Data objects. */
+        uint64_t dataHits{ 0 };
+        uint64_t dataMisses{ 0 };
+        size_t dataIdle{ 0 };
+
+        /** Server lists: hits are lookups sharing the interned list, misses are lists copied. */
+        uint64_t serverListHits{ 0 };
+        uint64_t serverListMisses{ 0 };
+        size_t serverLists{ 0 };
+    };
+
+    PoolStats poolStats() const;
+
     /** Converts RESULT_CODE to string. */
     static string toString(RESULT_CODE code);
 
-    /** @debug Logs useful information. */
-    static void log(const string& func, const string& msg = "");
-
 private:
-    struct Impl;
     struct ImplDeleter { void operator()(Impl*) const; };
     std::unique_ptr<Impl, ImplDeleter> pImpl_{ nullptr };
 };
 
-using DataPtr = shared_ptr<DnsResolver::Data>;
+using DataPtr = DnsResolver::DataPtr;
 
 }
\ No newline at end of file
@@ -0,0 +1,141 @@
+#include "DnsServerStats.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <mutex>
+
+using namespace Windscribe;
+
+namespace {
+
+/** Loss rate of 100% in millionths. */
+const uint32_t FULL_LOSS{ 1000000 };
+
+/** Weight of the loss rate in the score: server losing every query looks 5 times slower. */
+const int64_t LOSS_PENALTY{ 4 };
+
+}
+
+DnsServerStats::DnsServerStats() : DnsServerStats(Options()) {}
+
+DnsServerStats::DnsServerStats(const Options& options)
+    : options_(options)
+{
+}
+
+DnsServerStats::Entry& DnsServerStats::entry(const wstring& server)
+{
+    {
+        shared_lock<shared_timed_mutex> lock(mut_);
+        const auto it = entries_.find(server);
+        if (it != entries_.cend())
+            return *it->second;
+    }
+    unique_lock<shared_timed_mutex> lock(mut_);
+    auto& res = entries_[server];
+    if (!res)
+        res = make_unique<Entry>();
+    return *res;
+}
+
+void DnsServerStats::onAnswer(const wstring& server, chrono::microseconds rtt)
+{
+    auto& e = entry(server);
+    const int64_t sample = max<int64_t>(1, rtt.count());
+    const auto srtt = e.srtt.load(memory_order_relaxed);
+    if (!srtt) {
+        e.srtt.store(sample, memory_order_relaxed);
+        e.rttvar.store(sample / 2, memory_order_relaxed);
+    }
+    else {
+        const auto rttvar = e.rttvar.load(memory_order_relaxed);
+        e.rttvar.store(rttvar - rttvar / 4 + llabs(srtt - sample) / 4, memory_order_relaxed);
+        e.srtt.store(max<int64_t>(1, srtt - srtt / 8 + sample / 8), memory_order_relaxed);
+    }
+    onAnswer(server);
+}
+
+void DnsServerStats::onAnswer(const wstring& server)
+{
+    auto& e = entry(server);
+    e.answers.fetch_add(1, memory_order_relaxed);
+    e.failures.store(0, memory_order_relaxed);
+    const auto loss = e.loss.load(memory_order_relaxed);
+    e.loss.store(loss - loss / 8, memory_order_relaxed);
+}
+
+void DnsServerStats::onFailure(const wstring& server)
+{
+    auto& e = entry(server);
+    e.errors.fetch_add(1, memory_order_relaxed);
+    e.failures.fetch_add(1, memory_order_relaxed);
+    const auto loss = e.loss.load(memory_order_relaxed);
+    e.loss.store(loss + (FULL_LOSS - loss) / 8, memory_order_relaxed);
+}
+
+int64_t DnsServerStats::score(const Entry& entry)
+{
+    const auto srtt = entry.srtt.load(memory_order_relaxed);
+    const auto loss = static_cast<int64_t>(entry.loss.load(memory_order_relaxed));
+    return srtt + srtt * loss * LOSS_PENALTY / FULL_LOSS;
+}
+
+size_t DnsServerStats::select(const vector<wstring>& servers, vector<int>& candidates, size_t count)
+{
+    if (candidates.size() <= count)
+        return candidates.size();
+
+    const auto now = Clock::now().time_since_epoch().count();
+    const auto interval = chrono::duration_cast<Clock::duration>(options_.probeInterval).count();
+    vector<pair<int64_t, int>> healthyServers;
+    vector<int> probes, demoted;
+    healthyServers.reserve(candidates.size());
+    for (const auto ind : candidates) {
+        auto& e = entry(servers[ind]);
+        if (healthy(e)) {
+            healthyServers.emplace_back(score(e), ind);
+            continue;
+        }
+        // Only one lookup probes the demoted server per interval.
+        auto last = e.lastProbe.load(memory_order_relaxed);
+        if (now - last >= interval && e.lastProbe.compare_exchange_strong(last, now, memory_order_relaxed))
+            probes.push_back(ind);
+        else
+            demoted.push_back(ind);
+    }
+    if (healthyServers.empty())
+        return candidates.size();
+
+    // Not measured servers have zero score, so they are tried first. Equal scores keep the order of the servers.
+    count = min(count, healthyServers.size());
+    sort(healthyServers.begin(), healthyServers.end());
+    candidates.clear();
+    for (size_t i = 0; i < count; ++i)
+        candidates.push_back(healthyServers[i].second);
+    candidates.insert(candidates.end(), probes.begin(), probes.end());
+    for (size_t i = count; i < healthyServers.size(); ++i)
+        candidates.push_back(healthyServers[i].second);
+    candidates.insert(candidates.end(), demoted.begin(), demoted.end());
+    return count + probes.size();
+}
+
+vector<DnsServerStats::Snapshot> DnsServerStats::snapshot() const
+{
+    shared_lock<shared_timed_mutex> lock(mut_);
+    vector<Snapshot> res;
+    res.reserve(entries_.size());
+    for (const auto& p : entries_) {
+        const auto& e = *p.second;
+        Snapshot s;
+        s.server = p.first;
+        s.srtt = chrono::microseconds(e.srtt.load(memory_order_relaxed));
+        s.rttvar = chrono::microseconds(e.rttvar.load(memory_order_relaxed));
+        s.loss = static_cast<double>(e.loss.load(memory_order_relaxed)) / FULL_LOSS;
+        s.failures = e.failures.load(memory_order_relaxed);
+        s.healthy = healthy(e);
+        s.answers = e.answers.load(memory_order_relaxed);
+        s.errors = e.errors.load(memory_order_relaxed);
+        res.push_back(s);
+    }
+    return res;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace Windscribe {
+
+/**
+* Health of the upstream DNS servers: smoothed RTT, loss rate and consecutive failures.
+* Servers failed several times in a row are demoted and only probed from time to time until they answer again.
+* Statistics are updated without locks, concurrent updates of the same server may lose samples.
+*/
+class DnsServerStats
+{
+public:
+
+    struct Options {
+        /** Number of consecutive failures after which the server is demoted. */
+        int failuresToDemote{ 3 };
+
+        /** Interval between probe queries to the demoted server. */
+        chrono::milliseconds probeInterval{ 5000 };
+    };
+
+    /** Statistics of one server. */
+    struct Snapshot {
+        wstring server;
+        chrono::microseconds srtt{ 0 };
+        chrono::microseconds rttvar{ 0 };
+
+        /** Smoothed share of the queries without answer, from 0 to 1. */
+        double loss{ 0 };
+        int failures{ 0 };
+        bool healthy{ true };
+        uint64_t answers{ 0 };
+        uint64_t errors{ 0 };
+    };
+
+    using Clock = chrono::steady_clock;
+
+    DnsServerStats();
+    explicit DnsServerStats(const Options& options);
+
+    /** Records answer of the server received rtt after the query was sent. */
+    void onAnswer(const wstring& server, chrono::microseconds rtt);
+
+    /** Records answer of the server whose RTT is not known. */
+    void onAnswer(const wstring& server);
+
+    /** Records query which got no usable answer: timeout, server failure or network error. */
+    void onFailure(const wstring& server);
+
+    /** Orders candidates by the health of their servers: count fastest healthy servers and demoted servers due for probing
+    * first, then the rest of healthy servers from the fastest, then the rest of demoted servers.
+    * If there is no healthy server among candidates, their order is kept.
+    * @param servers Servers of the lookup.
+    * @param candidates Indices of the servers to select from.
+    * @return Number of the first candidates to query right away, the rest are standby.
+    */
+    size_t select(const vector<wstring>& servers, vector<int>& candidates, size_t count);
+
+    /** Statistics of all servers seen. */
+    vector<Snapshot> snapshot() const;
+
+private:
+    struct Entry {
+        /** Smoothed RTT and its variance in microseconds (RFC 6298). Zero SRTT means server was not measured yet. */
+        atomic<int64_t> srtt{ 0 };
+        atomic<int64_t> rttvar{ 0 };
+
+        /** Smoothed loss rate in millionths. */
+        atomic<uint32_t> loss{ 0 };
+        atomic<int> failures{ 0 };
+        atomic<Clock::rep> lastProbe{ 0 };
+        atomic<uint64_t> answers{ 0 };
+        atomic<uint64_t> errors{ 0 };
+    };
+
+    /** Returns entry of the server, creating it if necessary. Entries are never removed. */
+    Entry& entry(const wstring& server);
+
+    /** Scaled RTT used to order servers: lossy servers look slower. */
+    static int64_t score(const Entry& entry);
+
+    bool healthy(const Entry& entry) const { return entry.failures.load(memory_order_relaxed) < options_.failuresToDemote; }
+
+    Options options_;
+    mutable shared_timed_mutex mut_;
+    unordered_map<wstring, unique_ptr<Entry>> entries_;
+};
+
+}
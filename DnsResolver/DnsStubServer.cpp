@@ -0,0 +1,282 @@
+#ifndef _WIN32
+
+#include "DnsStubServer.hpp"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <queue>
+#include <random>
+#include <system_error>
+
+using namespace Windscribe;
+
+namespace {
+
+/** Maximum length of CNAME chain followed inside the zone. */
+const int MAX_CNAME_CHAIN{ 8 };
+
+/** Receive buffer of the UDP socket, so bursts of queries are not dropped. */
+const int UDP_BUFFER_SIZE{ 4 * 1024 * 1024 };
+
+/** Number of attempts to find port free for both UDP and TCP. */
+const int BIND_ATTEMPTS{ 16 };
+
+/** Loss rate of 100% in millionths. */
+const uint32_t FULL_LOSS{ 1000000 };
+
+int bindSocket(int type, uint16_t port)
+{
+    const int fd = socket(AF_INET, type | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    const int on{ 1 };
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+uint16_t boundPort(int fd)
+{
+    sockaddr_in addr{};
+    socklen_t len = sizeof(addr);
+    getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len);
+    return ntohs(addr.sin_port);
+}
+
+}
+
+bool DnsStubServer::Zone::add(const string& name, uint16_t type, const string& value, uint32_t ttl)
+{
+    DnsMessage::Record rec;
+    rec.name = DnsMessage::normalize(name);
+    rec.type = type;
+    rec.ttl = ttl;
+    switch (type) {
+    case DnsMessage::TYPE_A:
+        rec.address.resize(4);
+        if (inet_pton(AF_INET, value.c_str(), rec.address.data()) != 1)
+            return false;
+        break;
+    case DnsMessage::TYPE_AAAA:
+        rec.address.resize(16);
+        if (inet_pton(AF_INET6, value.c_str(), rec.address.data()) != 1)
+            return false;
+        break;
+    case DnsMessage::TYPE_CNAME:
+        rec.target = DnsMessage::normalize(value);
+        break;
+    default:
+        return false;
+    }
+    records[rec.name].emplace_back(move(rec));
+    return true;
+}
+
+DnsStubServer::DnsStubServer(Zone zone, uint16_t port)
+    : zone_(move(zone))
+{
+    for (int i = 0; i < BIND_ATTEMPTS && tcpFd_ < 0; ++i) {
+        udpFd_ = bindSocket(SOCK_DGRAM, port);
+        if (udpFd_ < 0)
+            break;
+        setsockopt(udpFd_, SOL_SOCKET, SO_RCVBUF, &UDP_BUFFER_SIZE, sizeof(UDP_BUFFER_SIZE));
+        tcpFd_ = bindSocket(SOCK_STREAM, boundPort(udpFd_));
+        if (tcpFd_ < 0) {
+            close(udpFd_);
+            udpFd_ = -1;
+            if (port)
+                break;
+        }
+    }
+    if (udpFd_ < 0 || tcpFd_ < 0 || listen(tcpFd_, SOMAXCONN) < 0 || pipe(wakeFds_) < 0)
+        throw system_error(errno, generic_category(), "DnsStubServer");
+
+    port_ = boundPort(udpFd_);
+    thread_ = thread(&DnsStubServer::run, this);
+}
+
+DnsStubServer::~DnsStubServer()
+{
+    const char stop{ 0 };
+    (void)write(wakeFds_[1], &stop, sizeof(stop));
+    thread_.join();
+    close(wakeFds_[0]);
+    close(wakeFds_[1]);
+    close(tcpFd_);
+    close(udpFd_);
+}
+
+void DnsStubServer::setDelay(chrono::microseconds base, chrono::microseconds tail)
+{
+    baseDelay_ = max<int64_t>(0, base.count());
+    tailDelay_ = max<int64_t>(0, tail.count());
+}
+
+void DnsStubServer::setLossRate(double rate)
+{
+    loss_ = static_cast<uint32_t>(min(max(rate, 0.0), 1.0) * FULL_LOSS);
+}
+
+wstring DnsStubServer::address() const
+{
+    const auto str = "127.0.0.1:" + to_string(port_);
+    return wstring(str.begin(), str.end());
+}
+
+bool DnsStubServer::answer(const uint8_t* buf, size_t size, size_t maxSize, vector<uint8_t>& out)
+{
+    DnsMessage::Message msg;
+    if (!DnsMessage::parse(buf, size, msg) || msg.response)
+        return false;
+
+    msg.response = true;
+    msg.answers.clear();
+    auto name = DnsMessage::normalize(msg.qname);
+    for (int depth = 0; depth < MAX_CNAME_CHAIN; ++depth) {
+        const auto it = zone_.records.find(name);
+        if (it == zone_.records.cend()) {
+            if (depth == 0)
+                msg.rcode = DnsMessage::RCODE_NXDOMAIN;
+            break;
+        }
+        string next;
+        for (const auto& rec : it->second) {
+            if (rec.type == msg.qtype || rec.type == DnsMessage::TYPE_CNAME)
+                msg.answers.push_back(rec);
+            if (rec.type == DnsMessage::TYPE_CNAME)
+                next = rec.target;
+        }
+        if (next.empty() || msg.qtype == DnsMessage::TYPE_CNAME || !followCnames_)
+            break;
+        name = next;
+    }
+
+    queriesCount_.fetch_add(1, memory_order_relaxed);
+    return DnsMessage::build(msg, out, maxSize);
+}
+
+void DnsStubServer::run()
+{
+    vector<uint8_t> buffer(65536);
+    vector<uint8_t> out;
+
+    /** Accepted TCP connections and their not yet processed input. */
+    unordered_map<int, vector<uint8_t>> clients;
+    vector<pollfd> fds;
+
+    /** Delayed answers, the earliest on top. */
+    auto later = [](const Delayed& a, const Delayed& b) { return a.due > b.due; };
+    priority_queue<Delayed, vector<Delayed>, decltype(later)> delayed(later);
+    uint32_t seed = seed_;
+    mt19937 random(seed);
+    uniform_int_distribution<uint32_t> lossDistribution(0, FULL_LOSS - 1);
+
+    while (true) {
+        fds.clear();
+        fds.push_back({ wakeFds_[0], POLLIN, 0 });
+        fds.push_back({ udpFd_, POLLIN, 0 });
+        fds.push_back({ tcpFd_, POLLIN, 0 });
+        for (const auto& client : clients)
+            fds.push_back({ client.first, POLLIN, 0 });
+
+        // Waits until the next delayed answer is due.
+        timespec timeout{};
+        if (!delayed.empty()) {
+            const auto left = max(chrono::nanoseconds(0), delayed.top().due - chrono::steady_clock::now());
+            timeout.tv_sec = static_cast<time_t>(left.count() / 1000000000);
+            timeout.tv_nsec = static_cast<long>(left.count() % 1000000000);
+        }
+        if (ppoll(fds.data(), fds.size(), delayed.empty() ? nullptr : &timeout, nullptr) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[0].revents)
+            break;
+
+        if (seed != seed_) {
+            seed = seed_;
+            random.seed(seed);
+        }
+
+        // All queries received are answered at once, so bursts of queries do not wait for the next poll.
+        while (fds[1].revents & POLLIN) {
+            sockaddr_storage from{};
+            socklen_t fromLen = sizeof(from);
+            const auto n = recvfrom(udpFd_, buffer.data(), buffer.size(), MSG_DONTWAIT, reinterpret_cast<sockaddr*>(&from), &fromLen);
+            if (n < 0)
+                break;
+            const auto maxSize = truncateUdp_ ? DnsMessage::HEADER_SIZE : DnsMessage::MAX_UDP_SIZE;
+            if (loss_ && lossDistribution(random) < loss_)
+                continue;
+            if (n == 0 || !answer(buffer.data(), n, maxSize, out))
+                continue;
+
+            const auto tail = tailDelay_.load();
+            const auto delay = baseDelay_ + (tail ? static_cast<int64_t>(exponential_distribution<double>(1.0 / tail)(random)) : 0);
+            if (!delay) {
+                sendto(udpFd_, out.data(), out.size(), 0, reinterpret_cast<const sockaddr*>(&from), fromLen);
+                continue;
+            }
+            delayed.push({ chrono::steady_clock::now() + chrono::microseconds(delay), from, fromLen, out });
+        }
+
+        const auto now = chrono::steady_clock::now();
+        while (!delayed.empty() && delayed.top().due <= now) {
+            const auto& next = delayed.top();
+            sendto(udpFd_, next.message.data(), next.message.size(), 0, reinterpret_cast<const sockaddr*>(&next.to), next.toLen);
+            delayed.pop();
+        }
+
+        if (fds[2].revents & POLLIN) {
+            const int fd = accept(tcpFd_, nullptr, nullptr);
+            if (fd >= 0)
+                clients[fd];
+        }
+
+        for (size_t i = 3; i < fds.size(); ++i) {
+            if (!fds[i].revents)
+                continue;
+            const int fd = fds[i].fd;
+            auto& input = clients[fd];
+            const auto n = recv(fd, buffer.data(), buffer.size(), 0);
+            if (n <= 0) {
+                close(fd);
+                clients.erase(fd);
+                continue;
+            }
+            input.insert(input.end(), buffer.data(), buffer.data() + n);
+            while (input.size() >= 2) {
+                const size_t size = (input[0] << 8) | input[1];
+                if (input.size() < size + 2)
+                    break;
+                if (answer(input.data() + 2, size, SIZE_MAX, out)) {
+                    const uint8_t len[2]{ static_cast<uint8_t>(out.size() >> 8), static_cast<uint8_t>(out.size() & 0xFF) };
+                    send(fd, len, sizeof(len), MSG_NOSIGNAL);
+                    send(fd, out.data(), out.size(), MSG_NOSIGNAL);
+                }
+                input.erase(input.begin(), input.begin() + size + 2);
+            }
+        }
+    }
+
+    for (const auto& client : clients)
+        close(client.first);
+}
+
+#endif
@@ -0,0 +1,109 @@
+#pragma once
+
+#ifndef _WIN32
+
+#include "DnsMessage.hpp"
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace Windscribe {
+
+/**
+* In-process loopback DNS server answering A, AAAA and CNAME queries from the zone table.
+* Serves UDP and TCP on the same port, so the resolver can be run and measured on a machine with no network.
+*/
+class DnsStubServer
+{
+public:
+
+    /** Zone table. Names are stored normalized (see DnsMessage::normalize()). */
+    struct Zone {
+        /** Adds record. Value is textual IPv4/IPv6 address or CNAME target.
+        * @return false if value is not valid for the type.
+        */
+        bool add(const string& name, uint16_t type, const string& value, uint32_t ttl = 300);
+
+        unordered_map<string, vector<DnsMessage::Record>> records;
+    };
+
+    /** Starts server on 127.0.0.1.
+    * @param zone Zone table to answer from.
+    * @param port Port to listen on. 0 means any free port.
+    */
+    explicit DnsStubServer(Zone zone, uint16_t port = 0);
+    ~DnsStubServer();
+
+    DnsStubServer(const DnsStubServer&) = delete;
+    DnsStubServer& operator=(const DnsStubServer&) = delete;
+
+    /** Address of the server in the form accepted by DnsResolver::Lookup(). */
+    wstring address() const;
+
+    uint16_t port() const { return port_; }
+
+    /** Forces truncated answers over UDP, so clients have to repeat queries over TCP. */
+    void setTruncateUdp(bool truncate) { truncateUdp_ = truncate; }
+
+    /** If false, only the first CNAME of the chain is answered, so clients have to query its target. */
+    void setFollowCnames(bool follow) { followCnames_ = follow; }
+
+    /** Delays UDP answers by base plus exponentially distributed time with mean tail, so answers have the long tail of real servers. */
+    void setDelay(chrono::microseconds base, chrono::microseconds tail = chrono::microseconds(0));
+
+    /** Drops share of UDP queries without answer, from 0 to 1. */
+    void setLossRate(double rate);
+
+    /** Seeds the random delays and losses, so runs can be repeated. */
+    void setSeed(uint32_t seed) { seed_ = seed; }
+
+    /** Number of answered queries. */
+    uint64_t queriesCount() const { return queriesCount_.load(memory_order_relaxed); }
+
+private:
+    /** Builds answer to the query. */
+    bool answer(const uint8_t* buf, size_t size, size_t maxSize, vector<uint8_t>& out);
+
+    /** Answer of UDP query to be sent later. */
+    struct Delayed {
+        chrono::steady_clock::time_point due;
+        sockaddr_storage to;
+        socklen_t toLen;
+        vector<uint8_t> message;
+    };
+
+    /** Server thread loop. */
+    void run();
+
+    Zone zone_;
+    uint16_t port_{ 0 };
+    int udpFd_{ -1 };
+    int tcpFd_{ -1 };
+
+    /** Pipe used to wake up server thread on stop. */
+    int wakeFds_[2]{ -1, -1 };
+
+    atomic_bool truncateUdp_{ false };
+    atomic_bool followCnames_{ true };
+    atomic<uint64_t> queriesCount_{ 0 };
+    atomic<int64_t> baseDelay_{ 0 };
+    atomic<int64_t> tailDelay_{ 0 };
+
+    /** Loss rate in millionths. */
+    atomic<uint32_t> loss_{ 0 };
+    atomic<uint32_t> seed_{ 5489 };
+    thread thread_;
+};
+
+}
+
+#endif
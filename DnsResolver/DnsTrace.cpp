@@ -0,0 +1,214 @@
+#include "DnsTrace.hpp"
+
+#include <boost/log/trivial.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+
+using namespace Windscribe;
+
+namespace {
+
+/** Name of the event and names of its numbers. Empty name means the number is not printed. */
+struct EventInfo {
+    const char* name;
+    const char* a;
+    const char* b;
+    const char* c;
+};
+
+const EventInfo EVENTS[] = {
+    { "INVALID_SERVER", "data", "ind", "" },
+    { "INVALID_HOST", "data", "ind", "" },
+    { "UDP_SEND_FAILED", "upstream", "errno", "" },
+    { "UDP_RECV_FAILED", "upstream", "errno", "" },
+    { "TCP_CONNECT_FAILED", "slot", "errno", "" },
+    { "TCP_FAILED", "slot", "", "" },
+    { "CONTEXT_ALLOCATION_FAILED", "data", "ind", "error" },
+    { "SERVER_LIST_FAILED", "data", "ind", "error" },
+    { "HOSTS_FAILED", "errno", "", "" },
+    { "CACHE_SAVE_FAILED", "errno", "", "" },
+    { "UPSTREAM_BUSY", "upstream", "pending", "" },
+    { "LOOKUP", "data", "servers", "" },
+    { "EMPTY_HOST", "data", "", "" },
+    { "BATCH", "hosts", "servers", "" },
+    { "FINISH", "data", "queries", "" },
+    { "DATA_CREATED", "data", "", "" },
+    { "DATA_DELETED", "data", "", "" },
+    { "HOSTS_LOADED", "names", "", "" },
+    { "REFRESH", "data", "type", "" },
+    { "CACHE_LOADED", "answers", "", "" },
+    { "QUERY_ERROR", "data", "ind", "code" },
+    { "QUERY_ANSWER", "data", "ind", "addresses" },
+    { "QUERY_SENT", "data", "ind", "" },
+    { "QUERY_STATUS", "data", "ind", "status" },
+    { "CONTEXT_ALLOCATED", "context", "data", "ind" },
+    { "CONTEXT_DELETED", "context", "", "" },
+};
+
+static_assert(sizeof(EVENTS) / sizeof(EVENTS[0]) == static_cast<size_t>(DnsTrace::EVENT::COUNT), "Every event needs its info");
+
+/** Events of one thread. Written only by its owner, so no locks are needed. */
+struct Ring {
+    DnsTrace::Event events[DnsTrace::RING_SIZE];
+
+    /** Number of events written so far. */
+    atomic<uint64_t> head{ 0 };
+
+    /** False when the thread exited, then the ring is given to the next new thread with its events. */
+    atomic<bool> owned{ true };
+
+    uint16_t thread{ 0 };
+};
+
+/** Rings of all threads. Never freed, so events of the exited threads can be dumped and late threads can trace at exit. */
+struct Rings {
+    mutex mut;
+    vector<Ring*> rings;
+    uint16_t threadsCount{ 0 };
+};
+
+Rings& allRings()
+{
+    static auto rings = new Rings();
+    return *rings;
+}
+
+Ring* acquireRing()
+{
+    auto& all = allRings();
+    lock_guard<mutex> lock(all.mut);
+    Ring* ring{ nullptr };
+    for (auto candidate : all.rings) {
+        if (!candidate->owned.load(memory_order_acquire)) {
+            ring = candidate;
+            break;
+        }
+    }
+    if (!ring) {
+        ring = new Ring();
+        all.rings.push_back(ring);
+    }
+    ring->owned.store(true, memory_order_relaxed);
+    ring->thread = ++all.threadsCount;
+    return ring;
+}
+
+/** Releases the ring of the thread when it exits. */
+struct RingHolder {
+    Ring* ring{ nullptr };
+
+    ~RingHolder()
+    {
+        if (ring)
+            ring->owned.store(false, memory_order_release);
+    }
+};
+
+thread_local RingHolder ringHolder;
+thread_local uint16_t logThread{ 0 };
+atomic<uint16_t> logThreadsCount{ 0 };
+
+uint64_t now()
+{
+    return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+}
+
+atomic<DnsTrace::MODE> DnsTrace::mode_{ DnsTrace::MODE::OFF };
+
+void DnsTrace::setMode(MODE mode)
+{
+    mode_.store(mode, memory_order_relaxed);
+}
+
+void DnsTrace::record(EVENT event, uint64_t a, uint64_t b, uint32_t c)
+{
+    const auto mode = mode_.load(memory_order_relaxed);
+    if (mode == MODE::LOG) {
+        Event ev;
+        ev.time = now();
+        ev.event = event;
+        ev.a = a;
+        ev.b = b;
+        ev.c = c;
+        if (!logThread)
+            logThread = ++logThreadsCount;
+        ev.thread = logThread;
+        ostringstream out;
+        format(out, ev);
+        BOOST_LOG_TRIVIAL(debug) << out.str();
+        return;
+    }
+    if (mode != MODE::RING)
+        return;
+
+    auto& ring = ringHolder.ring;
+    if (!ring)
+        ring = acquireRing();
+    const auto pos = ring->head.load(memory_order_relaxed);
+    auto& ev = ring->events[pos & (RING_SIZE - 1)];
+    ev.time = now();
+    ev.event = event;
+    ev.a = a;
+    ev.b = b;
+    ev.c = c;
+    ev.thread = ring->thread;
+    ring->head.store(pos + 1, memory_order_release);
+}
+
+vector<DnsTrace::Event> DnsTrace::collect()
+{
+    vector<Event> res;
+    auto& all = allRings();
+    lock_guard<mutex> lock(all.mut);
+    for (auto ring : all.rings) {
+        const auto head = ring->head.load(memory_order_acquire);
+        const auto first = head > RING_SIZE ? head - RING_SIZE : 0;
+        const auto start = res.size();
+        for (auto pos = first; pos < head; ++pos)
+            res.push_back(ring->events[pos & (RING_SIZE - 1)]);
+
+        // Events written by the owner during the copy overwrote the oldest copied ones.
+        const auto after = ring->head.load(memory_order_acquire);
+        const auto lost = after > head ? min<uint64_t>(after - head, head - first) : 0;
+        res.erase(res.begin() + start, res.begin() + start + lost);
+    }
+    stable_sort(res.begin(), res.end(), [](const Event& x, const Event& y) { return x.time < y.time; });
+    return res;
+}
+
+void DnsTrace::dump(ostream& out)
+{
+    for (const auto& event : collect()) {
+        format(out, event);
+        out << '\n';
+    }
+}
+
+void DnsTrace::format(ostream& out, const Event& event)
+{
+    const auto index = static_cast<size_t>(event.event);
+    if (index >= static_cast<size_t>(EVENT::COUNT)) {
+        out << event.time / 1000 << " #" << event.thread << " UNKNOWN";
+        return;
+    }
+    const auto& info = EVENTS[index];
+    out << event.time / 1000 << " #" << event.thread << ' ' << info.name;
+    auto print = [&out](const char* name, uint64_t value) {
+        if (!*name)
+            return;
+        out << ' ' << name << '=';
+        if (strcmp(name, "data") == 0 || strcmp(name, "context") == 0)
+            out << "0x" << hex << value << dec;
+        else
+            out << value;
+    };
+    print(info.a, event.a);
+    print(info.b, event.b);
+    print(info.c, event.c);
+}
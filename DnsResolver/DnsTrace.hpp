@@ -0,0 +1,145 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <type_traits>
+#include <vector>
+
+using namespace std;
+
+/** Levels of the trace events. Events of the levels above DNS_TRACE_LEVEL are compiled out. */
+#define DNS_TRACE_LEVEL_NONE 0
+#define DNS_TRACE_LEVEL_ERROR 1
+#define DNS_TRACE_LEVEL_LOOKUP 2
+#define DNS_TRACE_LEVEL_QUERY 3
+
+#ifndef DNS_TRACE_LEVEL
+#define DNS_TRACE_LEVEL DNS_TRACE_LEVEL_QUERY
+#endif
+
+namespace Windscribe {
+
+/**
+* Structured tracing of the resolver.
+* Events are fixed-size records of the event kind and up to three numbers, so tracing builds no strings.
+* In RING mode events are written to the ring buffer of the thread without locks and formatted later by dump().
+* In LOG mode events are formatted right away to the debug log. In OFF mode the traced code only loads one atomic.
+*/
+class DnsTrace
+{
+public:
+    enum class EVENT : uint16_t {
+        // Errors: a - Data or upstream, b - index of the query or errno.
+        INVALID_SERVER,
+        INVALID_HOST,
+        UDP_SEND_FAILED,
+        UDP_RECV_FAILED,
+        TCP_CONNECT_FAILED,
+        TCP_FAILED,
+        CONTEXT_ALLOCATION_FAILED,
+        SERVER_LIST_FAILED,
+        HOSTS_FAILED,
+        CACHE_SAVE_FAILED,
+        UPSTREAM_BUSY,
+
+        // Lookups.
+        LOOKUP,
+        EMPTY_HOST,
+        BATCH,
+        FINISH,
+        DATA_CREATED,
+        DATA_DELETED,
+        HOSTS_LOADED,
+        REFRESH,
+        CACHE_LOADED,
+
+        // Queries.
+        QUERY_ERROR,
+        QUERY_ANSWER,
+        QUERY_SENT,
+        QUERY_STATUS,
+        CONTEXT_ALLOCATED,
+        CONTEXT_DELETED,
+
+        COUNT
+    };
+
+    enum class MODE {
+        OFF,
+        LOG,
+        RING
+    };
+
+    /** Recorded event. */
+    struct Event {
+        /** Steady clock time in nanoseconds. */
+        uint64_t time{ 0 };
+        uint64_t a{ 0 };
+        uint64_t b{ 0 };
+        uint32_t c{ 0 };
+        EVENT event{ EVENT::COUNT };
+
+        /** Number of the thread in order of its first event. */
+        uint16_t thread{ 0 };
+    };
+
+    /** Number of events kept per thread. Power of 2. */
+    static const size_t RING_SIZE{ 4096 };
+
+    static void setMode(MODE mode);
+
+    static bool enabled() { return mode_.load(memory_order_relaxed) != MODE::OFF; }
+
+    /** Records the event in the current mode. Use DNS_TRACE_* macros, so events above DNS_TRACE_LEVEL are compiled out. */
+    static void record(EVENT event, uint64_t a, uint64_t b, uint32_t c);
+
+    /** Returns events kept in the rings of all threads ordered by time.
+    * Events overwritten while they are copied are skipped.
+    */
+    static vector<Event> collect();
+
+    /** Formats events kept in the rings, one per line. */
+    static void dump(ostream& out);
+
+    /** Formats single event. */
+    static void format(ostream& out, const Event& event);
+
+    /** Converts number, enum or pointer argument of the event. */
+    template<typename T>
+    static typename enable_if<!is_pointer<T>::value, uint64_t>::type value(T v) { return static_cast<uint64_t>(v); }
+    static uint64_t value(const void* v) { return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(v)); }
+
+private:
+    static atomic<MODE> mode_;
+};
+
+}
+
+#define DNS_TRACE_EVENT(event, a, b, c) \
+    do { \
+        if (::Windscribe::DnsTrace::enabled()) \
+            ::Windscribe::DnsTrace::record(::Windscribe::DnsTrace::EVENT::event, \
+                ::Windscribe::DnsTrace::value(a), ::Windscribe::DnsTrace::value(b), \
+                static_cast<uint32_t>(::Windscribe::DnsTrace::value(c))); \
+    } while (0)
+
+#define DNS_TRACE_NOTHING() do {} while (0)
+
+#if DNS_TRACE_LEVEL >= DNS_TRACE_LEVEL_ERROR
+#define DNS_TRACE_ERROR(event, a, b, c) DNS_TRACE_EVENT(event, a, b, c)
+#else
+#define DNS_TRACE_ERROR(event, a, b, c) DNS_TRACE_NOTHING()
+#endif
+
+#if DNS_TRACE_LEVEL >= DNS_TRACE_LEVEL_LOOKUP
+#define DNS_TRACE_LOOKUP(event, a, b, c) DNS_TRACE_EVENT(event, a, b, c)
+#else
+#define DNS_TRACE_LOOKUP(event, a, b, c) DNS_TRACE_NOTHING()
+#endif
+
+#if DNS_TRACE_LEVEL >= DNS_TRACE_LEVEL_QUERY
+#define DNS_TRACE_QUERY(event, a, b, c) DNS_TRACE_EVENT(event, a, b, c)
+#else
+#define DNS_TRACE_QUERY(event, a, b, c) DNS_TRACE_NOTHING()
+#endif
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "DnsResolver.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace Windscribe {
+
+/** Transport used by DnsResolver to query a single DNS server.
+* Implementations report the result asynchronously through Data::onIpResolved() or Data::onError() with the given index.
+*/
+class DnsTransport
+{
+public:
+    virtual ~DnsTransport() = default;
+
+    /** Time in seconds negative answers are cached if the server did not provide SOA record. */
+    static const uint32_t DEFAULT_NEGATIVE_TTL{ 60 };
+
+    /** Starts resolution of the host on the DNS server.
+    * @param host Host to resolve.
+    * @param dns Address of the DNS server ("ip" or "ip:port", "[ipv6]:port"). Empty means system configured server.
+    * @param data Data to report the result to.
+    * @param ind Index of the DNS server in data.
+    * Host and server are always data->host() and data->server(ind), so transports may read them from data instead.
+    */
+    virtual void Query(const wstring& host, const wstring& dns, DataPtr data, int ind) = 0;
+
+    /** Query of the batch. Host and server must be valid until Query() returns. */
+    struct Request {
+        const wstring* host{ nullptr };
+        const wstring* dns{ nullptr };
+        DataPtr data;
+        int ind{ 0 };
+
+        /** Query is sent after delay unless data->isDone(ind) by then. */
+        chrono::milliseconds delay{ 0 };
+    };
+
+    /** Starts resolution of many queries at once. Requests are moved from.
+    * Default implementation starts them one by one and ignores delays.
+    */
+    virtual void Query(vector<Request>& requests)
+    {
+        for (auto& req : requests)
+            Query(*req.host, *req.dns, move(req.data), req.ind);
+    }
+
+    /** Cancels query of the server at ind of data, whose result is not needed anymore.
+    * Result of the cancelled query may still be reported, Data ignores it. Default implementation does nothing.
+    */
+    virtual void Cancel(const DataPtr&, int) {}
+
+    /** Starts the delayed query at ind of data right away, e.g. because the server queried before it failed.
+    * The query is sent once: the delayed request is skipped when it is due, see Data::markSent().
+    * Default implementation does nothing, it does not delay queries.
+    */
+    virtual void Expedite(const DataPtr&, int) {}
+
+    /** Number of queries sent and waiting for the answer. Reported in the metrics of the resolver. */
+    virtual size_t inFlight() const { return 0; }
+
+    /** Identifies query by Data, its lookup and index of the server.
+    * Data are pooled, so the key of the query of the previous lookup does not match the query of the next one.
+    */
+    struct QueryKey {
+        QueryKey() = default;
+        QueryKey(const DnsResolver::Data* data, int ind) : data(data), ind(ind), lookup(data->lookup()) {}
+
+        const DnsResolver::Data* data{ nullptr };
+        int ind{ 0 };
+        uint32_t lookup{ 0 };
+
+        bool operator==(const QueryKey& other) const { return data == other.data && ind == other.ind && lookup == other.lookup; }
+    };
+
+    struct QueryKeyHash {
+        size_t operator()(const QueryKey& key) const
+        {
+            return hash<const void*>()(key.data) ^ static_cast<size_t>(key.ind) ^ (static_cast<size_t>(key.lookup) << 8);
+        }
+    };
+
+    /** Creates native transport of the current platform. */
+    static unique_ptr<DnsTransport> createDefault();
+};
+
+}
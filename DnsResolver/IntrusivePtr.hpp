@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+
+using namespace std;
+
+namespace Windscribe {
+
+/**
+* Smart pointer to the object which counts references itself.
+* Calls intrusive_ptr_add_ref(T*) and intrusive_ptr_release(T*) found by ADL, so no control block is allocated.
+*/
+template<typename T>
+class IntrusivePtr
+{
+public:
+    IntrusivePtr() = default;
+    IntrusivePtr(nullptr_t) {}
+
+    /** Takes new reference to ptr. */
+    explicit IntrusivePtr(T* ptr) : ptr_(ptr)
+    {
+        if (ptr_)
+            intrusive_ptr_add_ref(ptr_);
+    }
+
+    IntrusivePtr(const IntrusivePtr& other) : IntrusivePtr(other.ptr_) {}
+    IntrusivePtr(IntrusivePtr&& other) noexcept : ptr_(other.ptr_) { other.ptr_ = nullptr; }
+
+    ~IntrusivePtr()
+    {
+        if (ptr_)
+            intrusive_ptr_release(ptr_);
+    }
+
+    IntrusivePtr& operator=(const IntrusivePtr& other)
+    {
+        IntrusivePtr(other).swap(*this);
+        return *this;
+    }
+
+    IntrusivePtr& operator=(IntrusivePtr&& other) noexcept
+    {
+        IntrusivePtr(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    IntrusivePtr& operator=(nullptr_t)
+    {
+        reset();
+        return *this;
+    }
+
+    void reset() { IntrusivePtr().swap(*this); }
+
+    void swap(IntrusivePtr& other) noexcept { std::swap(ptr_, other.ptr_); }
+
+    T* get() const { return ptr_; }
+    T& operator*() const { return *ptr_; }
+    T* operator->() const { return ptr_; }
+    explicit operator bool() const { return ptr_ != nullptr; }
+
+    bool operator==(const IntrusivePtr& other) const { return ptr_ == other.ptr_; }
+    bool operator!=(const IntrusivePtr& other) const { return ptr_ != other.ptr_; }
+    bool operator==(nullptr_t) const { return ptr_ == nullptr; }
+    bool operator!=(nullptr_t) const { return ptr_ != nullptr; }
+
+private:
+    T* ptr_{ nullptr };
+};
+
+}
@@ -0,0 +1,198 @@
+#include "IpAddress.hpp"
+
+#include <cstring>
+
+using namespace Windscribe;
+
+namespace {
+
+/** Parses dotted quad from begin to end into 4 bytes of out. */
+bool parseV4(const char* begin, const char* end, uint8_t* out)
+{
+    const char* s = begin;
+    for (size_t i = 0; i < IpAddress::V4_SIZE; ++i) {
+        if (i) {
+            if (s == end || *s != '.')
+                return false;
+            ++s;
+        }
+        const char* first = s;
+        unsigned value{ 0 };
+        while (s != end && *s >= '0' && *s <= '9') {
+            value = value * 10 + (*s - '0');
+            if (++s - first > 3 || value > 255)
+                return false;
+        }
+        // Leading zeros are not accepted: some parsers read such octets as octal.
+        if (s == first || (s - first > 1 && *first == '0'))
+            return false;
+        out[i] = static_cast<uint8_t>(value);
+    }
+    return s == end;
+}
+
+int hexDigit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/** Parses IPv6 text from begin to end into 16 bytes of out. */
+bool parseV6(const char* begin, const char* end, uint8_t* out)
+{
+    uint8_t bytes[IpAddress::V6_SIZE]{};
+    size_t count{ 0 };
+
+    // Number of bytes before "::", or -1 if there is no "::".
+    int gap{ -1 };
+    const char* s = begin;
+    if (s != end && *s == ':') {
+        if (end - s < 2 || s[1] != ':')
+            return false;
+        s += 2;
+        gap = 0;
+    }
+    while (s != end) {
+        if (count == IpAddress::V6_SIZE)
+            return false;
+        const char* first = s;
+        unsigned value{ 0 };
+        while (s != end && hexDigit(*s) >= 0) {
+            value = (value << 4) | static_cast<unsigned>(hexDigit(*s));
+            if (++s - first > 4)
+                break;
+        }
+        if (s != end && *s == '.') {
+            // Embedded IPv4 address ends the text.
+            if (count > IpAddress::V6_SIZE - IpAddress::V4_SIZE || !parseV4(first, end, bytes + count))
+                return false;
+            count += IpAddress::V4_SIZE;
+            break;
+        }
+        if (s == first || s - first > 4)
+            return false;
+        bytes[count++] = static_cast<uint8_t>(value >> 8);
+        bytes[count++] = static_cast<uint8_t>(value & 0xFF);
+        if (s == end)
+            break;
+        if (*s != ':' || ++s == end)
+            return false;
+        if (*s == ':') {
+            if (gap >= 0)
+                return false;
+            gap = static_cast<int>(count);
+            ++s;
+        }
+    }
+
+    // "::" stands for at least one zero group.
+    if (gap < 0 ? count != IpAddress::V6_SIZE : count == IpAddress::V6_SIZE)
+        return false;
+    memset(out, 0, IpAddress::V6_SIZE);
+    if (gap < 0) {
+        memcpy(out, bytes, count);
+        return true;
+    }
+    memcpy(out, bytes, gap);
+    memcpy(out + IpAddress::V6_SIZE - (count - gap), bytes + gap, count - gap);
+    return true;
+}
+
+}
+
+IpAddress::IpAddress(const uint8_t* bytes, size_t size)
+{
+    if (size == V4_SIZE)
+        family_ = FAMILY::V4;
+    else if (size == V6_SIZE)
+        family_ = FAMILY::V6;
+    else
+        return;
+    memcpy(bytes_.data(), bytes, size);
+}
+
+bool IpAddress::parse(const string& text, IpAddress& out)
+{
+    uint8_t bytes[V6_SIZE];
+    const char* begin = text.data();
+    const char* end = begin + text.size();
+    if (text.find(':') == string::npos) {
+        if (!parseV4(begin, end, bytes))
+            return false;
+        out = IpAddress(bytes, V4_SIZE);
+        return true;
+    }
+    if (!parseV6(begin, end, bytes))
+        return false;
+    out = IpAddress(bytes, V6_SIZE);
+    return true;
+}
+
+string IpAddress::toString() const
+{
+    static const char HEX[] = "0123456789abcdef";
+    string res;
+    if (family_ == FAMILY::V4) {
+        res.reserve(15);
+        for (size_t i = 0; i < V4_SIZE; ++i) {
+            if (i)
+                res += '.';
+            res += to_string(bytes_[i]);
+        }
+        return res;
+    }
+    if (family_ != FAMILY::V6)
+        return res;
+
+    uint16_t groups[8];
+    for (int i = 0; i < 8; ++i)
+        groups[i] = static_cast<uint16_t>((bytes_[2 * i] << 8) | bytes_[2 * i + 1]);
+
+    // The longest run of at least two zero groups is replaced by "::", the first one if there are several.
+    int bestStart{ -1 }, bestLen{ 1 };
+    for (int i = 0; i < 8;) {
+        if (groups[i]) {
+            ++i;
+            continue;
+        }
+        int j = i;
+        while (j < 8 && !groups[j])
+            ++j;
+        if (j - i > bestLen) {
+            bestStart = i;
+            bestLen = j - i;
+        }
+        i = j;
+    }
+
+    res.reserve(39);
+    for (int i = 0; i < 8; ++i) {
+        if (i == bestStart) {
+            res += "::";
+            i += bestLen - 1;
+            continue;
+        }
+        if (i && i != bestStart + bestLen)
+            res += ':';
+        bool leading{ true };
+        for (int shift = 12; shift >= 0; shift -= 4) {
+            const auto digit = (groups[i] >> shift) & 0xF;
+            if (leading && digit == 0 && shift)
+                continue;
+            leading = false;
+            res += HEX[digit];
+        }
+    }
+    return res;
+}
+
+wstring IpAddress::toWString() const
+{
+    const auto str = toString();
+    return wstring(str.begin(), str.end());
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+namespace Windscribe {
+
+/** IPv4 or IPv6 address in network byte order. Fits in 17 bytes and is never allocated on the heap. */
+struct IpAddress
+{
+    enum class FAMILY : uint8_t {
+        NONE,
+        V4,
+        V6
+    };
+
+    static const size_t V4_SIZE{ 4 };
+    static const size_t V6_SIZE{ 16 };
+
+    IpAddress() = default;
+
+    /** Creates address from 4 (IPv4) or 16 (IPv6) bytes. Other sizes give address of NONE family. */
+    IpAddress(const uint8_t* bytes, size_t size);
+
+    /** Parses dotted quad IPv4 or RFC 4291 text IPv6 address. IPv6 zones and IPv4 octets with leading zeros are not accepted.
+    * @return false if text is not an address, out is not changed then.
+    */
+    static bool parse(const string& text, IpAddress& out);
+
+    FAMILY family() const { return family_; }
+
+    /** Address bytes, size() of them. */
+    const uint8_t* data() const { return bytes_.data(); }
+    size_t size() const { return family_ == FAMILY::V4 ? V4_SIZE : family_ == FAMILY::V6 ? V6_SIZE : 0; }
+
+    /** Formats address as dotted quad for IPv4 and as RFC 5952 text for IPv6. */
+    string toString() const;
+    wstring toWString() const;
+
+    bool operator==(const IpAddress& other) const { return family_ == other.family_ && bytes_ == other.bytes_; }
+    bool operator!=(const IpAddress& other) const { return !(*this == other); }
+
+private:
+    array<uint8_t, V6_SIZE> bytes_{};
+    FAMILY family_{ FAMILY::NONE };
+};
+
+}
@@ -0,0 +1,127 @@
+#include "LatencyHistogram.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace Windscribe;
+
+namespace {
+
+atomic<size_t> threadsCount{ 0 };
+
+/** Shard of the thread. Threads take shards in turn, so few threads never share one. */
+size_t shardOfThread()
+{
+    static thread_local const size_t shard = threadsCount.fetch_add(1, memory_order_relaxed);
+    return shard;
+}
+
+/** Number of the highest bit set. Value must not be zero. */
+int highestBit(uint64_t value)
+{
+    int res{ 0 };
+    while (value >>= 1)
+        res++;
+    return res;
+}
+
+}
+
+size_t LatencyHistogram::bucket(uint64_t value)
+{
+    // Values below 2 * SUB_BUCKETS have own buckets, above them bucket covers 2^shift values.
+    if (value < 2 * SUB_BUCKETS)
+        return static_cast<size_t>(value);
+    const int top = highestBit(value);
+    if (top >= MAX_BITS)
+        return BUCKETS - 1;
+    const int shift = top - SUB_BITS;
+    return static_cast<size_t>(shift * SUB_BUCKETS + (value >> shift));
+}
+
+uint64_t LatencyHistogram::upperBound(size_t bucket)
+{
+    if (bucket < 2 * SUB_BUCKETS)
+        return bucket;
+    const auto shift = bucket / SUB_BUCKETS - 1;
+    const auto sub = bucket % SUB_BUCKETS + SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t value)
+{
+    auto& shard = shards_[shardOfThread() & (SHARDS - 1)];
+    shard.counts[bucket(value)].fetch_add(1, memory_order_relaxed);
+    shard.sum.fetch_add(value, memory_order_relaxed);
+
+    // Shard is rarely shared, so the loops almost never repeat.
+    auto min = shard.min.load(memory_order_relaxed);
+    while (value < min && !shard.min.compare_exchange_weak(min, value, memory_order_relaxed)) {}
+    auto max = shard.max.load(memory_order_relaxed);
+    while (value > max && !shard.max.compare_exchange_weak(max, value, memory_order_relaxed)) {}
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const
+{
+    Snapshot res;
+    uint64_t min{ UINT64_MAX };
+    for (const auto& shard : shards_) {
+        uint64_t count{ 0 };
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            const auto n = shard.counts[i].load(memory_order_relaxed);
+            if (!n)
+                continue;
+            if (res.counts.empty())
+                res.counts.resize(BUCKETS);
+            res.counts[i] += n;
+            count += n;
+        }
+        if (!count)
+            continue;
+        res.count += count;
+        res.sum += shard.sum.load(memory_order_relaxed);
+        min = std::min(min, shard.min.load(memory_order_relaxed));
+        res.max = std::max(res.max, shard.max.load(memory_order_relaxed));
+    }
+    res.min = res.count ? min : 0;
+    return res;
+}
+
+void LatencyHistogram::reset()
+{
+    for (auto& shard : shards_) {
+        for (auto& count : shard.counts)
+            count.store(0, memory_order_relaxed);
+        shard.sum.store(0, memory_order_relaxed);
+        shard.min.store(UINT64_MAX, memory_order_relaxed);
+        shard.max.store(0, memory_order_relaxed);
+    }
+}
+
+uint64_t LatencyHistogram::Snapshot::percentile(double q) const
+{
+    if (!count)
+        return 0;
+    const auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(ceil(std::min(std::max(q, 0.0), 1.0) * count)));
+    uint64_t seen{ 0 };
+    for (size_t i = 0; i < counts.size(); ++i) {
+        seen += counts[i];
+        if (seen >= rank)
+            return std::min(std::max(upperBound(i), this->min), this->max);
+    }
+    return this->max;
+}
+
+void LatencyHistogram::Snapshot::merge(const Snapshot& other)
+{
+    if (!other.count)
+        return;
+    if (counts.empty())
+        counts.resize(BUCKETS);
+    for (size_t i = 0; i < other.counts.size(); ++i)
+        counts[i] += other.counts[i];
+    min = count ? std::min(min, other.min) : other.min;
+    max = std::max(max, other.max);
+    count += other.count;
+    sum += other.sum;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+namespace Windscribe {
+
+/**
+* Histogram of latencies in microseconds with buckets of HDR histograms: every power of 2 is split into SUB_BUCKETS
+* linear buckets, so percentiles are within 1 / SUB_BUCKETS of the recorded values.
+* Recording takes no locks: every thread adds to the counters of its own shard, shards are merged by snapshot().
+*/
+class LatencyHistogram
+{
+public:
+    static const int SUB_BITS{ 4 };
+    static const uint64_t SUB_BUCKETS{ 1 << SUB_BITS };
+
+    /** Values from 2^MAX_BITS microseconds (about 71 minutes) are counted in the last bucket. */
+    static const int MAX_BITS{ 32 };
+
+    static const size_t BUCKETS{ (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS };
+
+    /** Merged counters of all shards. */
+    struct Snapshot {
+        /** Number of values per bucket. Empty if nothing was recorded. */
+        vector<uint64_t> counts;
+        uint64_t count{ 0 };
+        uint64_t sum{ 0 };
+        uint64_t min{ 0 };
+        uint64_t max{ 0 };
+
+        /** Returns value q (from 0 to 1) of the recorded values are less than or equal to, at most max. */
+        uint64_t percentile(double q) const;
+
+        double mean() const { return count ? static_cast<double>(sum) / count : 0; }
+
+        /** Adds values of other. */
+        void merge(const Snapshot& other);
+    };
+
+    LatencyHistogram() = default;
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    void record(chrono::microseconds value) { record(static_cast<uint64_t>(value.count() > 0 ? value.count() : 0)); }
+    void record(uint64_t value);
+
+    Snapshot snapshot() const;
+
+    /** Removes all recorded values. Values recorded concurrently may be partly kept. */
+    void reset();
+
+    /** Index of the bucket of value. */
+    static size_t bucket(uint64_t value);
+
+    /** The largest value counted in the bucket. */
+    static uint64_t upperBound(size_t bucket);
+
+private:
+    /** Number of shards. Power of 2. */
+    static const size_t SHARDS{ 8 };
+
+    struct alignas(64) Shard {
+        atomic<uint64_t> counts[BUCKETS]{};
+        atomic<uint64_t> sum{ 0 };
+        atomic<uint64_t> min{ UINT64_MAX };
+        atomic<uint64_t> max{ 0 };
+    };
+
+    Shard shards_[SHARDS];
+};
+
+}
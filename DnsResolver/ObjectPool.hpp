@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace Windscribe {
+
+/**
+* Thread-safe pool of objects kept for reuse instead of being deleted.
+* Released objects are not destroyed, so their strings and vectors keep the capacity. Callers reinitialize them after acquire().
+* Idle objects are spread over shards picked by the thread, so threads rarely contend on one mutex.
+*/
+template<typename T>
+class ObjectPool
+{
+public:
+    /** Counters of the pool. Hits are acquisitions served by the idle object, misses are the ones left to the caller. */
+    struct Stats {
+        uint64_t hits{ 0 };
+        uint64_t misses{ 0 };
+        size_t idle{ 0 };
+    };
+
+    /** @param maxIdle Maximum number of idle objects kept. Objects released to the full pool are deleted. */
+    explicit ObjectPool(size_t maxIdle = 4096)
+        : shardCapacity_(maxIdle / SHARDS + 1)
+    {
+        for (auto& shard : shards_)
+            shard.idle.reserve(shardCapacity_);
+    }
+
+    ~ObjectPool()
+    {
+        for (auto& shard : shards_) {
+            for (auto obj : shard.idle)
+                delete obj;
+        }
+    }
+
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    /** Returns idle object or nullptr if there is none, the caller creates new object then.
+    * Shard of the thread is tried first, then the rest of shards.
+    */
+    T* acquire()
+    {
+        const auto first = shardIndex();
+        for (size_t i = 0; i < SHARDS; ++i) {
+            auto& shard = shards_[(first + i) & (SHARDS - 1)];
+            unique_lock<mutex> lock(shard.mut, defer_lock);
+            if (i == 0)
+                lock.lock();
+            else if (!lock.try_lock())
+                continue;
+            if (!shard.idle.empty()) {
+                auto obj = shard.idle.back();
+                shard.idle.pop_back();
+                hits_.fetch_add(1, memory_order_relaxed);
+                return obj;
+            }
+        }
+        misses_.fetch_add(1, memory_order_relaxed);
+        return nullptr;
+    }
+
+    /** Keeps the object for reuse or deletes it if the shard of the thread is full. */
+    void release(T* obj)
+    {
+        auto& shard = shards_[shardIndex()];
+        {
+            lock_guard<mutex> lock(shard.mut);
+            if (shard.idle.size() < shardCapacity_) {
+                shard.idle.push_back(obj);
+                return;
+            }
+        }
+        delete obj;
+    }
+
+    Stats stats() const
+    {
+        Stats res;
+        res.hits = hits_.load(memory_order_relaxed);
+        res.misses = misses_.load(memory_order_relaxed);
+        for (auto& shard : shards_) {
+            lock_guard<mutex> lock(shard.mut);
+            res.idle += shard.idle.size();
+        }
+        return res;
+    }
+
+private:
+    /** Number of shards. Power of 2. */
+    static const size_t SHARDS{ 8 };
+
+    struct Shard {
+        mutable mutex mut;
+        vector<T*> idle;
+    };
+
+    static size_t shardIndex() { return hash<thread::id>()(this_thread::get_id()) & (SHARDS - 1); }
+
+    size_t shardCapacity_;
+    Shard shards_[SHARDS];
+    atomic<uint64_t> hits_{ 0 };
+    atomic<uint64_t> misses_{ 0 };
+};
+
+}
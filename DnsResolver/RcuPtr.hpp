@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+namespace Windscribe {
+
+/**
+* Pointer to the immutable object which is read without locks and replaced as a whole (read-copy-update).
+* Readers mark themselves in the counter of the current epoch, sharded by thread. Writer publishes the new object,
+* switches the epoch and deletes the old object once the readers of the previous epoch are gone.
+*/
+template<typename T>
+class RcuPtr
+{
+    /** Number of counter shards per epoch. Power of 2. */
+    static const size_t SHARDS{ 16 };
+
+    /** Counter padded to the cache line, so shards do not share lines. Not alignas: owners would need aligned new. */
+    struct Counter {
+        atomic<uint64_t> readers{ 0 };
+        char padding[64 - sizeof(atomic<uint64_t>)];
+    };
+
+public:
+    /** Keeps the object read alive until the reader is destroyed. Must not outlive the RcuPtr. */
+    class Reader
+    {
+    public:
+        Reader(Reader&& other) noexcept : counter_(other.counter_), ptr_(other.ptr_) { other.counter_ = nullptr; }
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        ~Reader()
+        {
+            if (counter_)
+                counter_->readers.fetch_sub(1, memory_order_release);
+        }
+
+        const T* get() const { return ptr_; }
+        const T* operator->() const { return ptr_; }
+        explicit operator bool() const { return ptr_ != nullptr; }
+
+    private:
+        friend class RcuPtr;
+
+        Reader(Counter* counter, const T* ptr) : counter_(counter), ptr_(ptr) {}
+
+        Counter* counter_;
+        const T* ptr_;
+    };
+
+    RcuPtr() = default;
+    RcuPtr(const RcuPtr&) = delete;
+    RcuPtr& operator=(const RcuPtr&) = delete;
+
+    ~RcuPtr() { delete ptr_.load(memory_order_relaxed); }
+
+    Reader read() const
+    {
+        // Sequentially consistent, so writer either sees the reader in the counter or the reader sees the new object.
+        // Epoch could be switched between its load and the increment, then writer may be waiting for the other epoch
+        // already, so the reader leaves the counter and retries in the current epoch.
+        const auto shard = shardOfThread();
+        for (;;) {
+            const auto epoch = epoch_.load();
+            auto& counter = counters_[epoch][shard];
+            counter.readers.fetch_add(1);
+            if (epoch_.load() == epoch)
+                return Reader(&counter, ptr_.load());
+            counter.readers.fetch_sub(1);
+        }
+    }
+
+    /** Publishes obj. Returns when the previous object is deleted. */
+    void reset(unique_ptr<const T> obj)
+    {
+        lock_guard<mutex> lock(writerMutex_);
+        const T* old = ptr_.exchange(obj.release());
+        const auto epoch = epoch_.load();
+        epoch_.store(epoch ^ 1);
+        for (auto& counter : counters_[epoch]) {
+            while (counter.readers.load())
+                this_thread::yield();
+        }
+        delete old;
+    }
+
+private:
+    static size_t shardOfThread()
+    {
+        static atomic<size_t> threadsCount{ 0 };
+        static thread_local const size_t shard = threadsCount.fetch_add(1, memory_order_relaxed) & (SHARDS - 1);
+        return shard;
+    }
+
+    atomic<const T*> ptr_{ nullptr };
+    atomic<size_t> epoch_{ 0 };
+    mutable Counter counters_[2][SHARDS];
+    mutex writerMutex_;
+};
+
+}
@@ -0,0 +1,413 @@
+#ifdef _WIN32
+
+#include "DnsTrace.hpp"
+#include "DnsTransport.hpp"
+#include "ObjectPool.hpp"
+
+#include <Ws2tcpip.h>
+#include <Mstcpip.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <windns.h>
+
+#include <mutex>
+#include <new>
+#include <unordered_map>
+
+using namespace Windscribe;
+
+namespace {
+
+/**
+* Transport based on the asynchronous DnsQueryEx() of the Windows DNS client.
+* Code for DNS query is from https://github.com/microsoft/Windows-classic-samples/blob/master/Samples/DNSAsyncQuery/cpp/DnsQueryEx.cpp.
+*/
+class WinDnsTransport : public DnsTransport
+{
+public:
+
+    /** Winsock is initialized once for the lifetime of the transport instead of once per query. */
+    WinDnsTransport()
+    {
+        WSADATA wsaData;
+        wsaStarted_ = WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+    }
+
+    ~WinDnsTransport() override
+    {
+        if (wsaStarted_)
+            WSACleanup();
+    }
+
+    /** Contexts of the queries in flight. Contexts outlive transports, so they are counted for all of them. */
+    static atomic<size_t> contextsInUse_;
+
+    size_t inFlight() const override { return contextsInUse_.load(memory_order_relaxed); }
+
+    /** Context for the DnsQueries. */
+    typedef struct _QueryContextStruct
+    {
+        ULONG               RefCount{ 0 };
+        WCHAR               QueryName[DNS_MAX_NAME_BUFFER_LENGTH];
+        WORD                QueryType;
+        ULONG               QueryOptions;
+        DNS_QUERY_RESULT    QueryResults;
+        DNS_QUERY_CANCEL    QueryCancelContext;
+
+        /** Member with Data.
+        * @note Do not forget make it nullptr before deleting parent structure.
+        */
+        DataPtr             Data;
+
+        /** Using this index context knows what Data::ips_ member it currently resolves.
+        * This parameter allows to change Data by different threads without blocking.
+        */
+        INT                 Ind{ 0 };
+
+        /** Transport which started the query. Set only for cancellable queries. */
+        WinDnsTransport*    Transport{ nullptr };
+    }QUERY_CONTEXT, * PQUERY_CONTEXT;
+
+    /** Extracts all IPs of the queried type from the DNS resolution result and sets them to data at the ind.
+    * DnsQueryEx() follows CNAME chain itself, CNAME records of the chain only limit TTL.
+    */
+    static void ExtractIp( PDNS_RECORD DnsRecord, DataPtr data, INT ind )
+    {
+        const WORD Type = data->queryType(ind);
+        // Callbacks run on the threads of the DNS client, the buffer of the thread is reused by the next answers.
+        static thread_local vector<IpAddress> Addresses;
+        Addresses.clear();
+        DWORD Ttl{ MAXDWORD };
+        for (PDNS_RECORD Record = DnsRecord; Record; Record = Record->pNext)
+        {
+            Ttl = min(Ttl, Record->dwTtl);
+            if (Record->wType != Type)
+                continue;
+            // Addresses are already in network byte order.
+            if (Type == DNS_TYPE_A)
+                Addresses.emplace_back(reinterpret_cast<const uint8_t*>(&Record->Data.A.IpAddress), IpAddress::V4_SIZE);
+            else if (Type == DNS_TYPE_AAAA)
+                Addresses.emplace_back(reinterpret_cast<const uint8_t*>(&Record->Data.AAAA.Ip6Address), IpAddress::V6_SIZE);
+        }
+
+        if (!Addresses.empty()) {
+            data->onIpResolved(ind, Addresses.data(), Addresses.size(), Ttl);
+        }
+        else {
+            data->onError(ind, DnsResolver::RESULT_CODE::NOT_RESOLVED);
+        }
+    }
+
+    /**
+    *  Wrapper function that creates DNS_ADDR_ARRAY from IP address string.
+    */
+    DWORD CreateDnsServerList(_In_ PWSTR ServerIp, _Out_ PDNS_ADDR_ARRAY DnsServerList)
+    {
+        DWORD  Error = ERROR_SUCCESS;
+        SOCKADDR_STORAGE SockAddr;
+        INT AddressLength;
+
+        ZeroMemory(DnsServerList, sizeof(*DnsServerList));
+
+        AddressLength = sizeof(SockAddr);
+        Error = WSAStringToAddressW(ServerIp,
+            AF_INET,
+            NULL,
+            (LPSOCKADDR)&SockAddr,
+            &AddressLength);
+        if (Error != ERROR_SUCCESS)
+        {
+            AddressLength = sizeof(SockAddr);
+            Error = WSAStringToAddressW(ServerIp,
+                AF_INET6,
+                NULL,
+                (LPSOCKADDR)&SockAddr,
+                &AddressLength);
+        }
+
+        if (Error != ERROR_SUCCESS)
+        {
+            return Error;
+        }
+
+        DnsServerList->MaxCount = 1;
+        DnsServerList->AddrCount = 1;
+        CopyMemory(DnsServerList->AddrArray[0].MaxSa, &SockAddr, DNS_ADDR_MAX_SOCKADDR_LENGTH);
+
+        return Error;
+    }
+
+    /** Returns DNS_ADDR_ARRAY of the server. Arrays are created once per server and then reused by all queries. */
+    DWORD GetDnsServerList(_In_ const wstring& ServerIp, _Out_ PDNS_ADDR_ARRAY DnsServerList)
+    {
+        lock_guard<mutex> lock(serversMutex_);
+        auto it = servers_.find(ServerIp);
+        if (it == servers_.end())
+        {
+            DNS_ADDR_ARRAY List;
+            const DWORD Error = CreateDnsServerList(const_cast<wchar_t*>(ServerIp.c_str()), &List);
+            if (Error != ERROR_SUCCESS)
+            {
+                return Error;
+            }
+            it = servers_.emplace(ServerIp, List).first;
+        }
+        CopyMemory(DnsServerList, &it->second, sizeof(*DnsServerList));
+        return ERROR_SUCCESS;
+    }
+
+    /** Increments ref counter of the Context.
+    * @todo Possibly not necessary in the given implementation as we have one Context per DNS.
+    */
+    VOID AddReferenceQueryContext(_Inout_ PQUERY_CONTEXT QueryContext)
+    {
+        InterlockedIncrement(&QueryContext->RefCount);
+    }
+
+    /** Cleans up Context after DNS resolution. */
+    static VOID DeReferenceQueryContext(_Inout_ PQUERY_CONTEXT* QueryContext)
+    {
+        PQUERY_CONTEXT QC = *QueryContext;
+
+        if (InterlockedDecrement(&QC->RefCount) == 0)
+        {
+            QC->Data = nullptr; // clean shared_ptr pointed to Data
+            contextsInUse_.fetch_sub(1, memory_order_relaxed);
+            DNS_TRACE_QUERY(CONTEXT_DELETED, QC, 0, 0);
+            ContextPool().release(QC);
+            *QueryContext = NULL;
+        }
+    }
+
+    /** Pool of the contexts. Never destroyed, callbacks may complete after the transport is deleted. */
+    static ObjectPool<QUERY_CONTEXT>& ContextPool()
+    {
+        static auto Pool = new ObjectPool<QUERY_CONTEXT>();
+        return *Pool;
+    }
+
+    /** Takes context for the DNS resolution for the single DNS server from the pool. */
+    DWORD AllocateQueryContext(_Out_ PQUERY_CONTEXT* QueryContext)
+    {
+        *QueryContext = ContextPool().acquire();
+        if (*QueryContext == NULL)
+        {
+            *QueryContext = new (nothrow) QUERY_CONTEXT();
+            if (*QueryContext == NULL)
+            {
+                return ERROR_NOT_ENOUGH_MEMORY;
+            }
+        }
+
+        // Reused context keeps the state of the previous query.
+        ZeroMemory(&(*QueryContext)->QueryResults, sizeof((*QueryContext)->QueryResults));
+        ZeroMemory(&(*QueryContext)->QueryCancelContext, sizeof((*QueryContext)->QueryCancelContext));
+        (*QueryContext)->QueryResults.Version = DNS_QUERY_RESULTS_VERSION1;
+        (*QueryContext)->RefCount = 0;
+        (*QueryContext)->Transport = nullptr;
+        return ERROR_SUCCESS;
+    }
+
+    /** Callback function called by DNS as part of asynchronous query complete. */
+    static VOID WINAPI QueryCompleteCallback(_In_ PVOID Context, _Inout_ PDNS_QUERY_RESULT QueryResults)
+    {
+        PQUERY_CONTEXT QueryContext = (PQUERY_CONTEXT)Context;
+
+        if (QueryContext->Transport)
+        {
+            QueryContext->Transport->Unregister(QueryContext);
+        }
+
+        if (QueryResults->QueryStatus != ERROR_SUCCESS)
+        {
+            DNS_TRACE_QUERY(QUERY_STATUS, QueryContext->Data.get(), QueryContext->Ind, QueryResults->QueryStatus);
+        }
+
+        if (QueryResults->QueryStatus == ERROR_CANCELLED)
+        {
+            QueryContext->Data->onError(QueryContext->Ind, DnsResolver::RESULT_CODE::CANCELLED);
+        }
+        else if (QueryResults->QueryStatus == ERROR_SUCCESS)
+        {
+            ExtractIp(QueryResults->pQueryRecords, QueryContext->Data, QueryContext->Ind);
+        }
+        else if (QueryResults->QueryStatus == ERROR_TIMEOUT)
+        {
+            QueryContext->Data->onError(QueryContext->Ind, DnsResolver::RESULT_CODE::TIMEOUT);
+        }
+        else
+        {
+            // Only negative answers of the server are cached, not failures to get the answer.
+            const bool Negative = QueryResults->QueryStatus == DNS_ERROR_RCODE_NAME_ERROR || QueryResults->QueryStatus == DNS_INFO_NO_RECORDS;
+            QueryContext->Data->onError(QueryContext->Ind, DnsResolver::RESULT_CODE::NOT_RESOLVED, Negative ? DEFAULT_NEGATIVE_TTL : 0);
+        }
+
+        if (QueryResults->pQueryRecords)
+        {
+            DnsRecordListFree(QueryResults->pQueryRecords, DnsFreeRecordList);
+        }
+
+        DeReferenceQueryContext(&QueryContext);
+    }
+
+    /** Starts resolution of the host on the single DNS server. */
+    void Query(const wstring& host, const wstring& dns, DataPtr data, int ind) override
+    {
+        if (data->isDone(ind))
+        {
+            return; // nobody waits for the result anymore
+        }
+        if (!data->markSent(ind))
+        {
+            return; // started already
+        }
+        if (chrono::steady_clock::now() >= data->deadline())
+        {
+            data->onError(ind, DnsResolver::RESULT_CODE::TIMEOUT);
+            return;
+        }
+
+        if (host.size() >= DNS_MAX_NAME_BUFFER_LENGTH)
+        {
+            data->onError(ind, DnsResolver::RESULT_CODE::NOT_RESOLVED);
+            DNS_TRACE_ERROR(INVALID_HOST, data.get(), ind, 0);
+            return;
+        }
+
+        DWORD Error{ ERROR_SUCCESS };
+        PQUERY_CONTEXT QueryContext{ nullptr };
+        DNS_QUERY_REQUEST DnsQueryRequest;
+        DNS_ADDR_ARRAY DnsServerList;
+
+        /**
+        *   Allocate QueryContext
+        */
+        Error = AllocateQueryContext(&QueryContext);
+        if (Error != ERROR_SUCCESS)
+        {
+            data->onError(ind, DnsResolver::RESULT_CODE::INTERNAL_ERROR);
+            DNS_TRACE_ERROR(CONTEXT_ALLOCATION_FAILED, data.get(), ind, Error);
+            return;
+        }
+        memcpy(QueryContext->QueryName, host.c_str(), (host.size() + 1) * sizeof(wchar_t));
+        QueryContext->QueryType = data->queryType(ind);
+        QueryContext->QueryOptions = 0;
+        QueryContext->RefCount = 0;
+        QueryContext->Data = data;
+        QueryContext->Ind = ind;
+        contextsInUse_.fetch_add(1, memory_order_relaxed);
+        DNS_TRACE_QUERY(CONTEXT_ALLOCATED, QueryContext, data.get(), ind);
+
+        /**
+        *   Initiate asynchronous DnsQuery: Note that QueryResults and
+        *   QueryCancelContext should be valid till query completes.
+        */
+        ZeroMemory(&DnsQueryRequest, sizeof(DnsQueryRequest));
+        DnsQueryRequest.Version = DNS_QUERY_REQUEST_VERSION1;
+        DnsQueryRequest.QueryName = QueryContext->QueryName;
+        DnsQueryRequest.QueryType = QueryContext->QueryType;
+        DnsQueryRequest.QueryOptions = (ULONG64)QueryContext->QueryOptions;
+        DnsQueryRequest.pQueryContext = QueryContext;
+        DnsQueryRequest.pQueryCompletionCallback = QueryCompleteCallback;
+
+        /**
+        *   Increase reference count in order to avoid context dereferencing in the middle.
+        */
+        AddReferenceQueryContext(QueryContext);
+
+        /**
+        *   Cancellable queries are registered, so Cancel() can find their cancel context.
+        */
+        if (data->cancellable())
+        {
+            QueryContext->Transport = this;
+            AddReferenceQueryContext(QueryContext);
+            lock_guard<mutex> lock(pendingMutex_);
+            pending_.emplace(QueryKey{ data.get(), ind }, QueryContext);
+        }
+
+        /**
+        *   If user specifies server, construct DNS_ADDR_ARRAY
+        */
+        if (!dns.empty())
+        {
+            Error = GetDnsServerList(dns, &DnsServerList);
+
+            if (Error != ERROR_SUCCESS)
+            {
+                DNS_TRACE_ERROR(SERVER_LIST_FAILED, data.get(), ind, Error);
+            }
+
+            DnsQueryRequest.pDnsServerList = &DnsServerList;
+        }
+
+        DNS_TRACE_QUERY(QUERY_SENT, data.get(), ind, 0);
+        Error = DnsQueryEx(&DnsQueryRequest,
+            &QueryContext->QueryResults,
+            &QueryContext->QueryCancelContext);
+
+        /**
+        *   If DnsQueryEx() returns  DNS_REQUEST_PENDING, Completion routine
+        *   will be invoked. If not (when completed inline) completion routine
+        *   will not be invoked.
+        */
+        if (Error != DNS_REQUEST_PENDING)
+        {
+            QueryCompleteCallback(QueryContext, &QueryContext->QueryResults);
+        }
+    }
+
+    /** Cancels the pending query with DnsCancelQuery(). Its callback is called with ERROR_CANCELLED. */
+    void Cancel(const DataPtr& data, int ind) override
+    {
+        PQUERY_CONTEXT QueryContext{ nullptr };
+        {
+            lock_guard<mutex> lock(pendingMutex_);
+            auto it = pending_.find(QueryKey{ data.get(), ind });
+            if (it == pending_.end())
+            {
+                return;
+            }
+            QueryContext = it->second;
+            AddReferenceQueryContext(QueryContext);
+        }
+        DnsCancelQuery(&QueryContext->QueryCancelContext);
+        DeReferenceQueryContext(&QueryContext);
+    }
+
+private:
+    /** Removes the completed query from the cancellable ones. */
+    void Unregister(_In_ PQUERY_CONTEXT QueryContext)
+    {
+        {
+            lock_guard<mutex> lock(pendingMutex_);
+            if (pending_.erase(QueryKey{ QueryContext->Data.get(), QueryContext->Ind }) == 0)
+            {
+                return;
+            }
+        }
+        DeReferenceQueryContext(&QueryContext);
+    }
+
+    /** True if WSAStartup() succeeded. */
+    bool wsaStarted_{ false };
+
+    /** DNS_ADDR_ARRAY of the already used servers. */
+    mutex serversMutex_;
+    unordered_map<wstring, DNS_ADDR_ARRAY> servers_;
+
+    /** Cancellable queries in flight. Each holds a reference of its context. */
+    mutex pendingMutex_;
+    unordered_map<QueryKey, PQUERY_CONTEXT, QueryKeyHash> pending_;
+};
+
+atomic<size_t> WinDnsTransport::contextsInUse_{ 0 };
+
+}
+
+unique_ptr<DnsTransport> DnsTransport::createDefault()
+{
+    return make_unique<WinDnsTransport>();
+}
+
+#endif
@@ -1,5 +1,10 @@
 #include "Algorithms.hpp"
+#include "DnsMessage.hpp"
 #include "DnsResolver.hpp"
+#include "DnsTrace.hpp"
+#ifndef _WIN32
+#include "DnsStubServer.hpp"
+#endif
 
 #include <boost/locale.hpp>
 #include <boost/log/core.hpp>
@@ -8,12 +13,14 @@
 #include <boost/log/utility/setup/file.hpp>
 
 #include <algorithm>
+#include <condition_variable>
 #include <fstream>
-#include <future>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <random>
+#include <sstream>
 #include <thread>
-#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -39,35 +46,39 @@ const vector<wstring> dnsServers = {
 /** Number of threads to call DnsResolver. */
 const int kThreadNum{ 100 };
 
-/** Timeout to wait for the single resolution future. */
-const chrono::milliseconds kTimeout{ 5ms };
-
-/** TEST 1. DnsResolver */
-void test1() {
+/** TEST 1. DnsResolver
+* @param servers DNS servers used for the first lookup of each host.
+* @param defaultServers DNS servers used for the second lookup of each host. Empty means system configured server.
+*/
+void test1(const vector<wstring>& servers = dnsServers, const vector<wstring>& defaultServers = {}) {
 
     /** Launch tasks to resolve host using DNS servers. */
     BOOST_LOG_TRIVIAL(debug) << __FUNCTION__ << " ======================= LOOKUP STARTED =========================";
+    const auto start = chrono::high_resolution_clock::now();
 
     const int tasksCount{ kThreadNum * 2 * static_cast<int>(hosts.size()) };
     DnsResolver resolver;
-    vector<future<DataPtr>> futures;
-    futures.reserve(tasksCount);
+
+    // Results are printed by the callbacks when lookups are done, so no thread polls for them.
     mutex mut; // used only for test purposes.
+    condition_variable cv;
+    int count{ 0 };
+    vector<int> order; // order of tasks in which they are done
+    order.reserve(tasksCount);
+    atomic_int next{ 0 };
+    auto onResult = [&](int i, const DataPtr& data) {
+        data->print(i);
+        lock_guard<mutex> lock(mut);
+        order.push_back(i);
+        if (++count == tasksCount)
+            cv.notify_all();
+    };
     auto func = [&]() {
         for (const auto& host : hosts) {
-            promise<DataPtr> prom1;
-            {
-                lock_guard<mutex> lock(mut);
-                futures.emplace_back(prom1.get_future());
-            }
-            resolver.Lookup(host, dnsServers, move(prom1));
-
-            promise<DataPtr> prom2;
-            {
-                lock_guard<mutex> lock(mut);
-                futures.emplace_back(prom2.get_future());
-            }
-            resolver.Lookup(host, {}, move(prom2));
+            const int i1 = next++;
+            resolver.Lookup(host, servers, [i1, &onResult](const DataPtr& data) { onResult(i1, data); });
+            const int i2 = next++;
+            resolver.Lookup(host, defaultServers, [i2, &onResult](const DataPtr& data) { onResult(i2, data); });
         }
     };
     vector<thread> threads;
@@ -76,30 +87,18 @@ void test1() {
         threads.emplace_back(func);
     }
     for (auto&& t : threads)
-        t.detach();
+        t.join();
 
-    // Wait until all results will be ready and printSmall them when they are ready.
     BOOST_LOG_TRIVIAL(debug) << __FUNCTION__ << " ======================= LOOKUP INITIATED FOR ALL HOSTS =========================";
-    
-    int count{ 0 };
-    vector<int> order; // order of tasks in which they are printed (not done, because we will have wait timeout)
-    order.reserve(tasksCount);
-    unordered_set<int> got; // technical hash-table used to check if the given future was already processed.
-    while (count < tasksCount) {
-        for (auto i = 0; i < futures.size(); ++i) {
-            if (got.find(i) != got.cend())
-                continue;
-            if (futures[i].wait_for(kTimeout) == future_status::ready) {
-                got.insert(i);
-                count++;
-                futures[i].get()->print(i);
-                order.push_back(i);
-            }
-        }
+    {
+        unique_lock<mutex> lock(mut);
+        cv.wait(lock, [&]() { return count == tasksCount; });
     }
 
     // Log order of the tasks to be printed.
+    const auto dur = chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - start).count();
     BOOST_LOG_TRIVIAL(debug) << __FUNCTION__ << " ======================== LOOKUP FINISHED ===========================";
+    BOOST_LOG_TRIVIAL(debug) << __FUNCTION__ << " lookups=" << tasksCount << " time=" << dur;
     string orderStr;
     for (const auto& v : order) {
         orderStr += to_string(v);
@@ -108,12 +107,22 @@ void test1() {
     orderStr += "\n\n";
     orderStr += to_string(order.size()); 
     orderStr += " ";
-    orderStr += to_string(futures.size());
-    orderStr += " ";
     orderStr += to_string(count);
     orderStr += " ";
     orderStr += to_string(tasksCount);
     BOOST_LOG_TRIVIAL(debug) << orderStr;
+
+    // Resolve all hosts by one batch and wait for it once.
+    BOOST_LOG_TRIVIAL(debug) << __FUNCTION__ << " ======================= BATCH LOOKUP STARTED =========================";
+    const auto batch = resolver.LookupBatch(hosts, servers);
+    batch->wait();
+    for (size_t i = 0; i < batch->size(); ++i)
+        batch->results()[i]->print(static_cast<int>(i));
+    BOOST_LOG_TRIVIAL(debug) << __FUNCTION__ << " ======================= BATCH LOOKUP FINISHED =========================";
+
+    ostringstream metrics;
+    resolver.metrics().write(metrics);
+    BOOST_LOG_TRIVIAL(debug) << __FUNCTION__ << " metrics:\n" << metrics.str();
 }
 
 vector < tuple<vector<int>, vector<int> > > data2 = {
@@ -134,8 +143,10 @@ vector < tuple<vector<int>, vector<int> > > data2 = {
         {2, 4, 4, 1, 1, 5, 7, 6, 5, 6, 8, 11, 10})
 };
 
-/** Test 2. Set intersection with repetitions. */
-void test2() {
+/** Test 2. Set intersection with repetitions.
+* @return false if results of the variants differ from intersection().
+*/
+bool test2() {
 
     // Helper lambda for printing small arrays.
     Algorithms<int> alg;
@@ -158,43 +169,81 @@ void test2() {
     };
     for (const auto& in : data2) {
         printSmall(in, alg.intersection(get<0>(in), get<1>(in)));
-        auto v1 = get<0>(in);
-        auto v2 = get<1>(in);
-        printSmall(make_tuple(v1, v2), alg.intersection2(v1, v2));
+        printSmall(in, alg.intersection2(get<0>(in), get<1>(in)));
     }
 
-    // Test big sets;
-    auto testPrintBig = [&](const string& testName, const tuple<vector<int>, vector<int>>& in) {
-        
-        {
-            const auto nowS = chrono::high_resolution_clock::now();
-            const auto resS = alg.intersection(get<0>(in), get<1>(in));
-            const auto endS = chrono::high_resolution_clock::now();
-            const auto durS = chrono::duration_cast<chrono::milliseconds>(endS - nowS).count();
+    // Test big sets: every variant is timed and its sorted result is compared with the sorted result of intersection().
+    bool ok{ true };
+    vector<int> expected;
+    auto check = [&](const string& testName, const string& variant, const function<vector<int>()>& run) {
+        const auto nowS = chrono::high_resolution_clock::now();
+        auto resS = run();
+        const auto endS = chrono::high_resolution_clock::now();
+        const auto durS = chrono::duration_cast<chrono::milliseconds>(endS - nowS).count();
+        sort(resS.begin(), resS.end());
+        const bool same = resS == expected;
+        ok = ok && same;
 
-            BOOST_LOG_TRIVIAL(debug) << testName << " in1.size=" << get<0>(in).size()
-                << " in2.size=" << get<1>(in).size()
-                << " res.size=" << resS.size()
-                << " timeSingle=" << durS;
-        } 
-        
+        BOOST_LOG_TRIVIAL(debug) << testName << " " << variant
+            << " res.size=" << resS.size()
+            << " time=" << durS
+            << (same ? "" : " DIFFERS");
+    };
+
+    // Partitions are exercised with several threads even on the single core.
+    const size_t threads = max(4u, thread::hardware_concurrency());
+    auto testPrintBig = [&](const string& testName, const tuple<vector<int>, vector<int>>& in) {
+        const auto& v1 = get<0>(in);
+        const auto& v2 = get<1>(in);
+        BOOST_LOG_TRIVIAL(debug) << testName << " in1.size=" << v1.size() << " in2.size=" << v2.size();
         {
-            auto v1 = get<0>(in);
-            auto v2 = get<1>(in);
             const auto nowS = chrono::high_resolution_clock::now();
-            const auto resS = alg.intersection2(v1, v2);
+            expected = alg.intersection(v1, v2);
             const auto endS = chrono::high_resolution_clock::now();
             const auto durS = chrono::duration_cast<chrono::milliseconds>(endS - nowS).count();
+            sort(expected.begin(), expected.end());
 
-            BOOST_LOG_TRIVIAL(debug) << testName << " in1.size=" << get<0>(in).size()
-                << " in2.size=" << get<1>(in).size()
-                << " res.size=" << resS.size()
-                << " timeSingle=" << durS;
+            BOOST_LOG_TRIVIAL(debug) << testName << " intersection res.size=" << expected.size() << " time=" << durS;
         }
+        check(testName, "intersection2", [&]() { return alg.intersection2(v1, v2); });
+        check(testName, "intersectionParallel threads=" + to_string(threads), [&]() { return alg.intersectionParallel(v1, v2, threads); });
+        vector<int>().swap(expected);
     };
     testPrintBig("not intersected ", make_tuple(vector<int>(2e8, 1), vector<int>(2e8, 2)));
-    vector<int> v1(1e8), v2(2e8);
     testPrintBig("totally intersected ", make_tuple(vector<int>(1e8, 1), vector<int>(2e8, 1)));
+
+    // Many distinct values repeated many times, so partitions get their share of every value's repetitions.
+    mt19937 rng(2);
+    auto randomSet = [&rng](size_t size, int range) {
+        vector<int> v(size);
+        uniform_int_distribution<int> dist(-range / 2, range / 2);
+        for (auto& el : v)
+            el = dist(rng);
+        return v;
+    };
+    testPrintBig("repeated ", make_tuple(randomSet(2e7, 1e5), randomSet(3e7, 1e5)));
+
+    // Sets differing in size 32 times and more are intersected by galloping. Values are repeated in both sets,
+    // small set has values missing in big one. Both orders of the arguments are checked.
+    auto testSkewed = [&](const string& testName, vector<int> small, vector<int> big) {
+        BOOST_LOG_TRIVIAL(debug) << testName << " in1.size=" << small.size() << " in2.size=" << big.size();
+        expected = alg.intersection(small, big);
+        sort(expected.begin(), expected.end());
+        check(testName, "intersection2", [&]() { return alg.intersection2(small, big); });
+        check(testName, "intersection2 swapped", [&]() { return alg.intersection2(big, small); });
+        sort(small.begin(), small.end());
+        sort(big.begin(), big.end());
+        check(testName, "intersectionSorted", [&]() { return alg.intersectionSorted(small, big); });
+        check(testName, "intersectionSorted swapped", [&]() { return alg.intersectionSorted(big, small); });
+        vector<int>().swap(expected);
+    };
+    testSkewed("skewed ", randomSet(1e3, 2e3), randomSet(1e6, 1e3));
+    testSkewed("skewed repeated ", randomSet(1e3, 50), randomSet(1e6, 100));
+    testSkewed("skewed all repeated ", vector<int>(1e3, 7), vector<int>(1e6, 7));
+
+    if (!ok)
+        cout << "Test 2 failed: results differ from intersection()" << endl;
+    return ok;
 };
 
 void test3() {
@@ -228,6 +277,122 @@ void test3() {
         calcAndPrint(segs);
 }
 
+/** Test 4. DNS message parsing: messages parsed per second by the in-place reader and by the allocating parser. */
+void test4() {
+
+    // Typical answer: CNAME and several addresses of its target.
+    DnsMessage::Message msg;
+    msg.id = 1;
+    msg.response = true;
+    msg.qname = "www.example.com";
+    auto add = [&msg](const string& name, uint16_t type, vector<uint8_t> address, const string& target) {
+        DnsMessage::Record rec;
+        rec.name = name;
+        rec.type = type;
+        rec.ttl = 300;
+        rec.address = move(address);
+        rec.target = target;
+        msg.answers.push_back(move(rec));
+    };
+    add("www.example.com", DnsMessage::TYPE_CNAME, {}, "www.example.com.cdn.example.net");
+    for (uint8_t i = 1; i <= 4; ++i)
+        add("www.example.com.cdn.example.net", DnsMessage::TYPE_A, { 93, 184, 216, i }, "");
+    vector<uint8_t> buf;
+    DnsMessage::build(msg, buf);
+
+    const int count{ 5000000 };
+    auto measure = [&](const string& name, const function<size_t()>& parse) {
+        size_t records{ 0 };
+        const auto start = chrono::high_resolution_clock::now();
+        for (int i = 0; i < count; ++i)
+            records += parse();
+        const auto dur = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start).count();
+        BOOST_LOG_TRIVIAL(debug) << name << " size=" << buf.size() << " messages=" << count << " records=" << records
+            << " time=" << dur / 1000 << " messagesPerSecond=" << static_cast<uint64_t>(count * 1e6 / max<int64_t>(1, dur));
+    };
+    measure("reader ", [&buf]() {
+        DnsMessage::Reader reader;
+        DnsMessage::RecordView rec;
+        size_t records{ 0 };
+        if (reader.reset(buf.data(), buf.size())) {
+            while (reader.next(rec))
+                records += rec.name == reader.qname() || rec.type == DnsMessage::TYPE_A;
+        }
+        return records;
+    });
+    measure("parse ", [&buf]() {
+        DnsMessage::Message res;
+        return DnsMessage::parse(buf.data(), buf.size(), res) ? res.answers.size() : 0;
+    });
+}
+
+/** Test 5. DnsResolver stress: every one of thousands of concurrent lookups must complete exactly once.
+* In FIRST_ANSWER mode cancellations race with answers, repeated hosts are coalesced.
+* @param servers DNS servers of the lookups.
+* @return false if any lookup is lost or completed twice.
+*/
+bool test5(const vector<wstring>& servers) {
+    const int lookupsPerThread{ 200 };
+    const int lookups{ kThreadNum * lookupsPerThread };
+
+    // Completions of every lookup, declared before the resolver, which may still call back when it is destroyed.
+    vector<atomic_int> calls(lookups);
+    vector<atomic_int> batchCalls(lookups);
+    auto missing = [](const vector<atomic_int>& c) { return count_if(c.cbegin(), c.cend(), [](const atomic_int& n) { return n == 0; }); };
+    auto repeated = [](const vector<atomic_int>& c) { return count_if(c.cbegin(), c.cend(), [](const atomic_int& n) { return n > 1; }); };
+
+    DnsResolver::Options options;
+    options.cacheCapacity = 0;
+    options.mode = DnsResolver::MODE::FIRST_ANSWER;
+    DnsResolver resolver(options);
+
+    // Single lookups: the callback of every lookup marks its own counter, lookups not called back in time are lost.
+    const auto start = chrono::high_resolution_clock::now();
+    atomic_int completed{ 0 }, empty{ 0 };
+    vector<thread> threads;
+    threads.reserve(kThreadNum);
+    for (auto i = 0; i < kThreadNum; ++i) {
+        threads.emplace_back([&, i]() {
+            for (int j = 0; j < lookupsPerThread; ++j) {
+                auto& counter = calls[i * lookupsPerThread + j];
+                resolver.Lookup(hosts[j % hosts.size()], servers, [&](const DataPtr& data) {
+                    if (counter++ == 0)
+                        completed++;
+                    if (!data)
+                        empty++;
+                });
+            }
+        });
+    }
+    for (auto&& t : threads)
+        t.join();
+    const auto deadline = chrono::steady_clock::now() + chrono::seconds(10);
+    while (completed < lookups && chrono::steady_clock::now() < deadline)
+        this_thread::sleep_for(chrono::milliseconds(1));
+    const auto dur = chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - start).count();
+    const auto lost = missing(calls);
+    BOOST_LOG_TRIVIAL(debug) << __FUNCTION__ << " lookups=" << lookups << " completed=" << completed
+        << " lost=" << lost << " empty=" << empty << " time=" << dur;
+
+    // Batch lookup: the callback counts completions of every host.
+    vector<wstring> batchHosts;
+    for (int i = 0; i < lookups; ++i)
+        batchHosts.push_back(hosts[i % hosts.size()]);
+    const auto batch = resolver.LookupBatch(batchHosts, servers, [&batchCalls](size_t index, const DataPtr&) { batchCalls[index]++; });
+    const bool done = batch->waitFor(chrono::seconds(10));
+    const auto missed = missing(batchCalls);
+    BOOST_LOG_TRIVIAL(debug) << __FUNCTION__ << " batch=" << batchHosts.size() << " done=" << done
+        << " lost=" << missed << " double=" << repeated(batchCalls);
+
+    // Late second completions of the single lookups are counted too.
+    const auto twice = repeated(calls) + repeated(batchCalls);
+    if (lost || empty || missed || twice) {
+        cout << "Test 5 failed: lost=" << lost + missed << " empty=" << empty << " double=" << twice << endl;
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char** argv) {
     // Configure log options.
     boost::log::add_file_log(
@@ -239,10 +404,44 @@ int main(int argc, char** argv) {
         boost::log::trivial::severity >= boost::log::trivial::debug
     );
 
+    // Exit code is not zero if any test failed.
+    bool failed{ false };
+
+    // Events of the resolver are kept in memory while test 1 runs and formatted after it.
+    DnsTrace::setMode(DnsTrace::MODE::RING);
     cout << "Test 1: DnsResolver. Doing ..." << endl;
+#ifndef _WIN32
+    // With --stub hosts are resolved on the in-process loopback server, so no network is needed.
+    unique_ptr<DnsStubServer> stub;
+    if (argc > 1 && string(argv[1]) == "--stub") {
+        DnsStubServer::Zone zone;
+        zone.add("google.com", DnsMessage::TYPE_A, "142.250.74.46");
+        zone.add("google.com", DnsMessage::TYPE_AAAA, "2a00:1450:4001:82b::200e");
+        zone.add("linkedin.com", DnsMessage::TYPE_CNAME, "www.linkedin.com.cdn.cloudflare.net");
+        zone.add("www.linkedin.com.cdn.cloudflare.net", DnsMessage::TYPE_A, "13.107.42.14");
+        zone.add("mail.ru", DnsMessage::TYPE_A, "217.69.139.202");
+        stub = make_unique<DnsStubServer>(move(zone));
+        test1({ stub->address() }, { stub->address() });
+    }
+    else
+#endif
     test1();
+    DnsTrace::setMode(DnsTrace::MODE::OFF);
+    {
+        ofstream trace("TestTask.trace");
+        DnsTrace::dump(trace);
+    }
     cout << "Test 2: Sets intersection. Doing ..." << endl;
-    test2();
+    failed |= !test2();
     cout << "Test 3: Segments union. Doing ..." << endl;
     test3();
+    cout << "Test 4: DNS message parsing. Doing ..." << endl;
+    test4();
+#ifndef _WIN32
+    if (stub) {
+        cout << "Test 5: DnsResolver stress. Doing ..." << endl;
+        failed |= !test5({ stub->address(), stub->address() });
+    }
+#endif
+    return failed ? 1 : 0;
 }
\ No newline at end of file